@@ -17,6 +17,10 @@
 #pragma once
 
 #include "bowlerPacket.hpp"
+#include "frameTrace.hpp"
+#include "linkMonitor.hpp"
+#include "loopHealth.hpp"
+#include "memoryStats.hpp"
 #include <array>
 #include <functional>
 #include <memory>
@@ -29,10 +33,28 @@ template <std::size_t N> class BowlerComs {
 
   virtual void addEnsuredPacket(std::function<std::shared_ptr<Packet>(void)> iaddPacket) = 0;
 
+  /**
+   * Adds a packet which is only made when it is first used. addEnsuredPackets() reserves the id,
+   * and the factory runs when the first frame for the id arrives, so packets the PC never uses
+   * cost nothing at connect time.
+   *
+   * @param iid The id of the packet the factory makes.
+   * @param ifactory Makes the packet.
+   */
+  virtual void addEnsuredPacket(std::uint16_t iid,
+                                std::function<std::shared_ptr<Packet>(void)> ifactory) = 0;
+
   virtual std::int32_t addEnsuredPackets() = 0;
 
   /**
-   * Adds a packet event handler. The packet id cannot already be used.
+   * @return The ids reserved for lazily made packets (see addEnsuredPacket) which have not been
+   * used yet.
+   */
+  virtual std::vector<std::uint16_t> getUnusedPacketIDs() = 0;
+
+  /**
+   * Adds a packet event handler. The packet id cannot already be used. Safe to call from any
+   * thread, including while loop() is running.
    *
    * @param ipacket The packet event handler.
    * @return `1` on success or BOWLER_ERROR on error.
@@ -40,16 +62,59 @@ template <std::size_t N> class BowlerComs {
   virtual std::int32_t addPacket(std::shared_ptr<Packet> ipacket) = 0;
 
   /**
-   * Removes a packet event handler.
+   * Removes a packet event handler. Safe to call from any thread, including while loop() is
+   * running.
+   *
+   * @param iid The id of the packet.
+   */
+  virtual void removePacket(const std::uint16_t iid) = 0;
+
+  /**
+   * Removes several packet event handlers at once. Safe to call from any thread, including while
+   * loop() is running.
    *
+   * @param iids The ids of the packets. Ids without a packet are skipped.
+   */
+  virtual void removePackets(const std::vector<std::uint16_t> &iids) = 0;
+
+  /**
    * @param iid The id of the packet.
+   * @return The packet event handler, or `nullptr` if there is none for that id (or it is reserved
+   * for a lazily made packet which has not been used yet).
    */
-  virtual void removePacket(const std::uint8_t iid) = 0;
+  virtual std::shared_ptr<Packet> getPacket(const std::uint16_t iid) = 0;
 
   /**
    * @return Every attached packet id.
    */
-  virtual std::vector<std::uint8_t> getAllPacketIDs() = 0;
+  virtual std::vector<std::uint16_t> getAllPacketIDs() = 0;
+
+  /**
+   * Puts every reliable packet back into its starting RDT state and refills every rate limit
+   * bucket without touching the packet event handlers.
+   */
+  virtual void resetReliableState() = 0;
+
+  /**
+   * Switches the header format. Takes effect after the reply to the frame currently being handled
+   * has been written.
+   *
+   * @param iformat HEADER_FORMAT_LEGACY or HEADER_FORMAT_WIDE.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  virtual std::int32_t setHeaderFormat(std::uint8_t iformat) = 0;
+
+  /**
+   * Sets which slice of group frames (see GROUP_PACKET_ID) this device handles.
+   *
+   * @param iindex The group index, or GROUP_INDEX_NONE to ignore group frames.
+   */
+  virtual void setGroupIndex(std::uint16_t iindex) = 0;
+
+  /**
+   * Drops every scheduled command which has not run yet (see Packet::setScheduled).
+   */
+  virtual void clearScheduledCommands() = 0;
 
   /**
    * Run an iteration of coms.
@@ -57,5 +122,35 @@ template <std::size_t N> class BowlerComs {
    * @return `1` on success or BOWLER_ERROR on error.
    */
   virtual std::int32_t loop() = 0;
+
+  /**
+   * @return The frame trace, or `nullptr` if tracing is not enabled.
+   */
+  virtual FrameTrace *getFrameTrace() = 0;
+
+  /**
+   * @return The loop health histograms, or `nullptr` if they are not enabled.
+   */
+  virtual LoopHealth *getLoopHealth() = 0;
+
+  /**
+   * @return The link monitor, or `nullptr` if it is not enabled.
+   */
+  virtual LinkMonitor *getLinkMonitor() = 0;
+
+  /**
+   * @return How much memory the coms use and how much the device has left.
+   */
+  virtual MemoryStats getMemoryStats() = 0;
+
+  /**
+   * Forgets the peak stack depth so far.
+   */
+  virtual void resetStackPeak() = 0;
+
+  /**
+   * @return The time the frame currently being handled was read from the server.
+   */
+  virtual time_t getLastReceiveTime() const = 0;
 };
 } // namespace bowlerserver
@@ -17,17 +17,31 @@
 #pragma once
 
 #include "bowlerDeviceServerUtil.hpp"
+#include "bowlerSerialServer.hpp"
 #include "bowlerUdpServer.hpp"
 #include "defaultBowlerComs.hpp"
 #include "noopPacket.hpp"
 #include <Arduino.h>
 #include <Esp32WifiManager.h>
 
+#if defined(USE_LWIP_UDP)
+#include "bowlerLwipUdpServer.hpp"
+#endif
+
+// The baud rate of the serial link when neither USE_WIFI nor USE_HID is defined
+#ifndef BOWLER_SERIAL_BAUD_RATE
+#define BOWLER_SERIAL_BAUD_RATE 2000000
+#endif
+
 namespace bowlerserver {
 template <std::size_t N> class BowlerComsController {
   public:
   void loop() {
     time_t time = getTime();
+    LoopHealth *health = coms.getLoopHealth();
+    if (health != nullptr) {
+      health->beginLoop(time);
+    }
 
     // Ensure 0.5 ms spacing *between* reads for Wifi to transact. Also check for the wrapover case
     if (time - lastLoopTime > 500 || time < lastLoopTime) {
@@ -45,6 +59,8 @@ template <std::size_t N> class BowlerComsController {
         }
 #elif defined(USE_HID)
         state = run;
+#else
+        state = run;
 #endif
         break;
       }
@@ -60,12 +76,32 @@ template <std::size_t N> class BowlerComsController {
 // If this is run before the sensor reads, the I2C will fail because the time it takes to send
 // the UDP causes a timeout
 #if defined(USE_WIFI)
+      const time_t managerStart = getTime();
       manager.loop();
+      if (health != nullptr) {
+        health->record(LOOP_HEALTH_MANAGER, getTime() - managerStart);
+      }
+
       if (manager.getState() == Connected) {
-        coms.loop();
+        loopComs(health);
       }
 #elif defined(USE_HID)
+#else
+      loopComs(health);
 #endif
+
+      // Keep playing back scheduled commands even while the link is down
+      coms.runScheduledCommands(getTime());
+    }
+
+    // Check here too so losing Wi-Fi, when coms stops running, still trips the failsafes
+    LinkMonitor *link = coms.getLinkMonitor();
+    if (link != nullptr) {
+      link->check(getTime());
+    }
+
+    if (health != nullptr) {
+      health->endLoop(getTime());
     }
   }
 
@@ -73,7 +109,58 @@ template <std::size_t N> class BowlerComsController {
     return coms;
   }
 
+  /**
+   * Starts measuring the loop: its period, the time in the Wi-Fi manager, in coms and outside the
+   * controller. The PC reads the histograms with OPERATION_READ_LOOP_HEALTH.
+   *
+   * @param itargetPeriod The loop period to count overruns against in microseconds, or `0` for
+   * none.
+   */
+  void enableLoopHealth(time_t itargetPeriod) {
+    coms.enableLoopHealth(itargetPeriod);
+  }
+
+  /**
+   * Makes room for scheduled commands (see Packet::setScheduled), which the controller runs on
+   * time from its loop.
+   *
+   * @param icapacity The most commands that can wait at once.
+   */
+  void enableScheduledCommands(std::size_t icapacity) {
+    coms.enableScheduledCommands(icapacity);
+  }
+
+  /**
+   * Makes room to cache the replies of idempotent packets (see Packet::setIdempotent), so
+   * dashboards polling them do not run their events.
+   *
+   * @param icapacity The most replies to cache.
+   */
+  void enableReplyCache(std::size_t icapacity) {
+    coms.enableReplyCache(icapacity);
+  }
+
+  /**
+   * Starts watching for the PC going quiet and returns the monitor to add failsafes to (e.g. to
+   * stop the motors). See DefaultBowlerComs::enableLinkMonitor.
+   *
+   * @param iinterval The heartbeat interval the PC keeps in microseconds.
+   * @param imissedBeats The number of intervals without a frame after which the link is lost.
+   * @return The monitor.
+   */
+  LinkMonitor &enableLinkMonitor(time_t iinterval, std::uint32_t imissedBeats) {
+    return coms.enableLinkMonitor(iinterval, imissedBeats);
+  }
+
   protected:
+  void loopComs(LoopHealth *ihealth) {
+    const time_t comsStart = getTime();
+    coms.loop();
+    if (ihealth != nullptr) {
+      ihealth->record(LOOP_HEALTH_COMS, getTime() - comsStart);
+    }
+  }
+
   void setup() {
     if (state != startup) {
       return;
@@ -85,7 +172,7 @@ template <std::size_t N> class BowlerComsController {
     manager.setupAP();
 #elif defined(USE_HID)
 #else
-    Serial.begin(115200);
+    Serial.begin(BOWLER_SERIAL_BAUD_RATE);
 #endif
   }
 
@@ -97,9 +184,17 @@ template <std::size_t N> class BowlerComsController {
 
 #if defined(USE_WIFI)
   WifiManager manager;
+#if defined(USE_LWIP_UDP)
+  // Skips WiFiUDP's copies. Opened once coms first runs, after the connection is up.
+  DefaultBowlerComs<N> coms{std::unique_ptr<LwipUDPServer<N>>(new LwipUDPServer<N>())};
+#else
   DefaultBowlerComs<N> coms{std::unique_ptr<UDPServer<N>>(new UDPServer<N>())};
+#endif
 #elif defined(USE_HID)
 #error "BowlerServerController not implemented for HID yet."
+#else
+  DefaultBowlerComs<N> coms{std::unique_ptr<SerialServer<N, decltype(Serial)>>(
+    new SerialServer<N, decltype(Serial)>(Serial))};
 #endif
 };
 } // namespace bowlerserver
@@ -0,0 +1,231 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerNativeUdpServer.hpp"
+#include "defaultBowlerComs.hpp"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <thread>
+#include <vector>
+
+namespace bowlerserver {
+/**
+ * Hosts many independent simulated devices in one Linux process. Each device is a
+ * DefaultBowlerComs with its own handlers and its own NativeUDPServer on consecutive ports. The
+ * devices are sharded across worker threads (one per core), and each worker waits on its devices'
+ * sockets with epoll.
+ */
+template <std::size_t N> class DeviceFarm {
+  public:
+  /**
+   * Checks the configuration, which start() then fails with EINVAL if it is invalid.
+   *
+   * @param ideviceCount The number of devices to simulate.
+   * @param ibasePort The port of the first device. Device i listens on ibasePort + i, so every
+   * device's port must fit in 16 bits.
+   * @param iworkerCount The number of worker threads. Must be at least 1.
+   * @param isetupDevice Called once per device to add its packets.
+   * @param ibatchSize The most datagrams each device receives or sends per system call (see
+   * NativeUDPServer), which is also its drain limit.
+   */
+  DeviceFarm(std::size_t ideviceCount,
+             std::uint16_t ibasePort,
+             std::size_t iworkerCount,
+             std::function<void(DefaultBowlerComs<N> &)> isetupDevice,
+             std::size_t ibatchSize = 1)
+    : deviceCount(ideviceCount),
+      basePort(ibasePort),
+      workerCount(iworkerCount),
+      batchSize(ibatchSize),
+      setupDevice(isetupDevice),
+      counters(new WorkerCounter[iworkerCount]),
+      isValid(iworkerCount > 0 && ideviceCount <= 0x10000 - static_cast<std::size_t>(ibasePort)) {
+  }
+
+  virtual ~DeviceFarm() {
+    stop();
+  }
+
+  /**
+   * Creates the devices and starts the workers.
+   *
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t start() {
+    if (!isValid) {
+      errno = EINVAL;
+      return BOWLER_ERROR;
+    }
+
+    devices.reserve(deviceCount);
+    for (std::size_t i = 0; i < deviceCount; i++) {
+      auto server = new NativeUDPServer<N>(static_cast<std::uint16_t>(basePort + i), batchSize);
+      if (!server->isOpen()) {
+        delete server;
+        return BOWLER_ERROR;
+      }
+
+      std::unique_ptr<Device> device(new Device{
+        server, std::unique_ptr<DefaultBowlerComs<N>>(
+                  new DefaultBowlerComs<N>(std::unique_ptr<BowlerServer<N>>(server)))});
+      device->coms->setDrainLimit(batchSize);
+      setupDevice(*device->coms);
+      devices.push_back(std::move(device));
+    }
+
+    running = true;
+    const unsigned coreCount = std::max(1u, std::thread::hardware_concurrency());
+    for (std::size_t i = 0; i < workerCount; i++) {
+      int epollFd = epoll_create1(0);
+      if (epollFd < 0) {
+        return abortStart();
+      }
+
+      // Shard the devices round robin
+      for (std::size_t j = i; j < devices.size(); j += workerCount) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = devices[j].get();
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, devices[j]->server->getFd(), &event) < 0) {
+          close(epollFd);
+          return abortStart();
+        }
+      }
+
+      workers.push_back(std::thread(&DeviceFarm::work, this, i, epollFd));
+
+      // Pin each worker to its own core so the per-worker rates are per-core rates
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(i % coreCount, &cpus);
+      pthread_setaffinity_np(workers.back().native_handle(), sizeof(cpus), &cpus);
+    }
+
+    return 1;
+  }
+
+  /**
+   * Stops the workers. The devices stay alive until the farm is destroyed.
+   */
+  void stop() {
+    running = false;
+    for (auto &&worker : workers) {
+      worker.join();
+    }
+    workers.clear();
+  }
+
+  /**
+   * @param iworker The index of the worker.
+   * @return The number of frames the worker has handled so far.
+   */
+  std::uint64_t getFramesHandled(std::size_t iworker) const {
+    return counters[iworker].frames.load(std::memory_order_relaxed);
+  }
+
+  std::size_t getWorkerCount() const {
+    return workerCount;
+  }
+
+  protected:
+  struct Device {
+    NativeUDPServer<N> *server;
+    std::unique_ptr<DefaultBowlerComs<N>> coms;
+  };
+
+  // Padded to a cache line so workers do not contend on each other's counters
+  struct WorkerCounter {
+    std::atomic<std::uint64_t> frames{0};
+    char padding[64 - sizeof(std::atomic<std::uint64_t>)];
+  };
+
+  /**
+   * Stops the workers started so far, which close their epoll fds, keeping errno from the failure.
+   *
+   * @return BOWLER_ERROR.
+   */
+  std::int32_t abortStart() {
+    const int error = errno;
+    stop();
+    errno = error;
+    return BOWLER_ERROR;
+  }
+
+  void work(std::size_t iworker, int iepollFd) {
+    std::array<epoll_event, 64> events;
+    // Devices with received frames left over, which epoll will not report again
+    std::vector<Device *> pending;
+    std::vector<Device *> stillPending;
+    while (running) {
+      int count = epoll_wait(iepollFd, events.data(), events.size(), pending.empty() ? 100 : 0);
+      stillPending.clear();
+      for (int i = 0; i < count; i++) {
+        Device *device = static_cast<Device *>(events[i].data.ptr);
+        if (std::find(pending.begin(), pending.end(), device) == pending.end()) {
+          serviceDevice(iworker, device, stillPending);
+        }
+      }
+
+      for (auto &&device : pending) {
+        serviceDevice(iworker, device, stillPending);
+      }
+      pending.swap(stillPending);
+    }
+
+    close(iepollFd);
+  }
+
+  void serviceDevice(std::size_t iworker, Device *idevice, std::vector<Device *> &ipending) {
+    const std::uint64_t before = idevice->server->getFramesReceived();
+
+    // Drain the device's socket, but bounded so one busy device cannot starve the others
+    for (std::size_t j = 0; j < MAX_LOOPS_PER_WAKEUP; j++) {
+      const std::uint64_t received = idevice->server->getFramesReceived();
+      idevice->coms->loop();
+      if (idevice->server->getFramesReceived() == received &&
+          !idevice->server->hasPendingFrames()) {
+        break;
+      }
+    }
+
+    if (idevice->server->hasPendingFrames()) {
+      ipending.push_back(idevice);
+    }
+
+    counters[iworker].frames.fetch_add(idevice->server->getFramesReceived() - before,
+                                       std::memory_order_relaxed);
+  }
+
+  static const std::size_t MAX_LOOPS_PER_WAKEUP = 32;
+
+  std::size_t deviceCount;
+  std::uint16_t basePort;
+  std::size_t workerCount;
+  std::size_t batchSize;
+  std::function<void(DefaultBowlerComs<N> &)> setupDevice;
+  std::unique_ptr<WorkerCounter[]> counters;
+  bool isValid;
+  std::vector<std::unique_ptr<Device>> devices;
+  std::vector<std::thread> workers;
+  std::atomic<bool> running{false};
+};
+} // namespace bowlerserver
@@ -17,11 +17,23 @@
 #pragma once
 
 #include "errno.h"
+
+#if defined(PLATFORM_NATIVE)
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#define BOWLER_LOG(...)                                                                            \
+  std::printf("%s:%d: ", __FILE__, __LINE__);                                                      \
+  std::printf(__VA_ARGS__)
+#else
 #include <Arduino.h>
 
 #define BOWLER_LOG(...)                                                                            \
   Serial.printf("%s:%d: ", __FILE__, __LINE__);                                                    \
   Serial.printf(__VA_ARGS__)
+#endif
 
 namespace bowlerserver {
 const std::int32_t BOWLER_ERROR = INT32_MAX;
@@ -30,19 +42,122 @@ const std::int32_t DEFAULT_PACKET_SIZE = 64;
 const std::int32_t HEADER_LENGTH = 3;
 const std::int32_t DEFAULT_PAYLOAD_SIZE = DEFAULT_PACKET_SIZE - HEADER_LENGTH;
 
-const std::uint8_t SERVER_MANAGEMENT_PACKET_ID = 1;
+const std::int32_t FRAME_TIMESTAMPS_LENGTH = 8;
+// Scheduled packets (see Packet::setScheduled) start their payload with the time to run at
+const std::int32_t SCHEDULED_TIME_LENGTH = 4;
+
+// Legacy header format is: <ID (1 byte)> <Seq Num (1 byte)> <ACK num (1 byte)>.
+const std::uint8_t HEADER_FORMAT_LEGACY = 0;
+// Wide header format is: <ID (2 bytes)> <Flags (1 byte)>, with the Seq Num in HEADER_SEQ_BIT and
+// the ACK num in HEADER_ACK_BIT of the flags.
+const std::uint8_t HEADER_FORMAT_WIDE = 1;
+const std::uint8_t HEADER_SEQ_BIT = 1 << 0;
+const std::uint8_t HEADER_ACK_BIT = 1 << 1;
+// Set in the last header byte (the ACK num or the flags) of a reply whose payload starts with a
+// STATUS_* code from the device instead of data from the packet event.
+const std::uint8_t HEADER_STATUS_BIT = 1 << 7;
+// Set in the last header byte of every reply while the device is over its loop budget (see
+// DefaultBowlerComs::setLoopBudget). The PC should send less until it clears.
+const std::uint8_t HEADER_BUSY_BIT = 1 << 6;
+// Set in the last header byte of a frame, in either direction, whose payload is compressed with the
+// packet's codec (see Packet::setCompressed).
+const std::uint8_t HEADER_COMPRESSED_BIT = 1 << 5;
+
+const std::uint16_t SERVER_MANAGEMENT_PACKET_ID = 1;
+
+// Group frames address the same unreliable packet on many devices at once, e.g. over multicast.
+// Payload format is: <Handler ID (2 bytes)> <Slice length (1 byte)> <Slice count (1 byte)>
+// <Flags (1 byte)> <Slices>, and the device with group index i hands slice i to the packet event.
+// Devices only reply if GROUP_FLAG_ACK is set, with: <Handler ID (2 bytes)> <Group index (2 bytes)>
+// <Event payload>.
+const std::uint16_t GROUP_PACKET_ID = 0;
+const std::int32_t GROUP_HEADER_LENGTH = 5;
+const std::int32_t GROUP_REPLY_HEADER_LENGTH = 4;
+const std::uint8_t GROUP_FLAG_ACK = 1 << 0;
+const std::uint16_t GROUP_INDEX_NONE = UINT16_MAX;
+
+const std::uint16_t BOWLER_SERVER_UDP_PORT = 1866;
 
 const std::uint8_t OPERATION_DISCONNECT_ID = 1;
 const std::uint8_t OPERATION_ADD_ENSURED_PACKETS = 2;
+const std::uint8_t OPERATION_READ_FRAME_TRACE = 3;
+const std::uint8_t OPERATION_TIME_SYNC = 4;
+const std::uint8_t OPERATION_SET_FRAME_TIMESTAMPS = 5;
+const std::uint8_t OPERATION_GET_SESSION = 6;
+const std::uint8_t OPERATION_RESUME_SESSION = 7;
+const std::uint8_t OPERATION_SET_HEADER_FORMAT = 8;
+const std::uint8_t OPERATION_SET_GROUP_INDEX = 9;
+const std::uint8_t OPERATION_READ_LOOP_HEALTH = 10;
+const std::uint8_t OPERATION_READ_MEMORY_STATS = 11;
+const std::uint8_t OPERATION_CLEAR_SCHEDULED_COMMANDS = 12;
+const std::uint8_t OPERATION_READ_UNUSED_PACKETS = 13;
+const std::uint8_t OPERATION_HEARTBEAT = 14;
+const std::uint8_t OPERATION_SET_COMPRESSION = 15;
 
 const std::uint8_t STATUS_ACCEPTED = 1;
 const std::uint8_t STATUS_REJECTED_GENERIC = 2;
+const std::uint8_t STATUS_EXPIRED = 3;
+const std::uint8_t STATUS_RATE_LIMITED = 4;
+const std::uint8_t STATUS_SCHEDULE_FULL = 5;
+
+const std::uint8_t COMPRESSION_CODEC_NONE = 0;
+// See LzCodec
+const std::uint8_t COMPRESSION_CODEC_LZ = 1;
+
+const std::uint8_t PRIORITY_LOW = 0;
+const std::uint8_t PRIORITY_NORMAL = 1;
+const std::uint8_t PRIORITY_HIGH = 2;
 
 #if defined(PLATFORM_ESP32)
 using time_t = int64_t;
 #elif defined(PLATFORM_TEENSY)
 using time_t = uint32_t;
+#elif defined(PLATFORM_NATIVE)
+using time_t = int64_t;
 #endif
 
 time_t getTime();
+
+/**
+ * @return The number of free bytes on the heap.
+ */
+std::size_t getFreeHeap();
+
+/**
+ * @return The size of the largest block the heap can allocate at once, which is less than
+ * getFreeHeap() once the heap is fragmented.
+ */
+std::size_t getLargestFreeBlock();
+
+/**
+ * @return The least free stack the calling task has had since it started, in bytes, or `0` where
+ * the platform does not track it (everywhere but ESP32, where FreeRTOS paints task stacks).
+ */
+std::size_t getStackHeadroom();
+
+/**
+ * Writes a value into a buffer in little-endian byte order.
+ *
+ * @param obuffer The buffer to write into. Must have room for sizeof(T) bytes.
+ * @param ivalue The value to write.
+ */
+template <typename T> void writeLittleEndian(std::uint8_t *obuffer, T ivalue) {
+  for (std::size_t i = 0; i < sizeof(T); i++) {
+    obuffer[i] = static_cast<std::uint8_t>(static_cast<std::uint64_t>(ivalue) >> (8 * i));
+  }
+}
+
+/**
+ * Reads a little-endian value from a buffer.
+ *
+ * @param ibuffer The buffer to read from. Must hold at least sizeof(T) bytes.
+ * @return The value.
+ */
+template <typename T> T readLittleEndian(const std::uint8_t *ibuffer) {
+  std::uint64_t value = 0;
+  for (std::size_t i = 0; i < sizeof(T); i++) {
+    value |= static_cast<std::uint64_t>(ibuffer[i]) << (8 * i);
+  }
+  return static_cast<T>(value);
+}
 } // namespace bowlerserver
@@ -0,0 +1,240 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <lwip/pbuf.h>
+#include <lwip/priv/tcpip_priv.h>
+#include <lwip/udp.h>
+
+namespace bowlerserver {
+// The number of received datagrams LwipUDPServer can hold. Must be a power of 2.
+const std::uint32_t LWIP_RX_RING_SLOTS = 16;
+
+/**
+ * A BowlerServer which uses the lwIP raw UDP API instead of WiFiUDP. Received pbufs are queued by
+ * the lwIP thread in a lock-free ring and copied once, straight into the frame buffer, when read.
+ * Replies are copied once into a new pbuf and sent from the lwIP thread. Listens on port
+ * BOWLER_SERVER_UDP_PORT by default. Each reply goes to whoever sent the frame it answers, even
+ * when several frames from different peers are read in one iteration (see
+ * DefaultBowlerComs::setDrainLimit). Only IPv4 peers are supported.
+ *
+ * The socket is opened on first use, so the network stack must be up by the time coms runs.
+ */
+template <std::size_t N> class LwipUDPServer : public BowlerServer<N> {
+  public:
+  /**
+   * @param iport The port to listen on.
+   */
+  LwipUDPServer(std::uint16_t iport = BOWLER_SERVER_UDP_PORT) : port(iport) {
+  }
+
+  virtual ~LwipUDPServer() {
+    if (pcb != nullptr) {
+      PcbCall call;
+      call.server = this;
+      tcpip_api_call(closePcb, &call);
+    }
+
+    // The lwIP thread no longer queues anything
+    while (head.load() != tail.load()) {
+      pbuf_free(ring[head.load() & (LWIP_RX_RING_SLOTS - 1)].buffer);
+      head.store(head.load() + 1);
+    }
+  }
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    return writeFrame(payload, N);
+  }
+
+  std::int32_t writeFrame(const std::array<std::uint8_t, N> &payload,
+                          std::size_t length) override {
+    if (pcb == nullptr || !hasPeer) {
+      errno = ENOTCONN;
+      return BOWLER_ERROR;
+    }
+
+    const u16_t size = static_cast<u16_t>(std::min<std::size_t>(length, N));
+    pbuf *buffer = pbuf_alloc(PBUF_TRANSPORT, size, PBUF_RAM);
+    if (buffer == nullptr) {
+      errno = ENOMEM;
+      return BOWLER_ERROR;
+    }
+    pbuf_take(buffer, payload.data(), size);
+
+    SendCall call;
+    call.server = this;
+    call.buffer = buffer;
+    tcpip_api_call(sendPcb, &call);
+    pbuf_free(buffer);
+
+    if (call.result != ERR_OK) {
+      errno = EIO;
+      return BOWLER_ERROR;
+    }
+
+    return 1;
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    std::size_t length;
+    return readFrame(payload, length);
+  }
+
+  std::int32_t readFrame(std::array<std::uint8_t, N> &payload, std::size_t &length) override {
+    const std::uint32_t h = head.load(std::memory_order_relaxed);
+    if (pcb == nullptr || h == tail.load(std::memory_order_acquire)) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    ReceivedDatagram &datagram = ring[h & (LWIP_RX_RING_SLOTS - 1)];
+    length = pbuf_copy_partial(
+      datagram.buffer, payload.data(), static_cast<u16_t>(std::min<std::size_t>(N, 0xFFFF)), 0);
+    std::fill(payload.begin() + length, payload.end(), 0);
+
+    ip_addr_copy(peerAddress, datagram.address);
+    peerPort = datagram.port;
+    hasPeer = true;
+
+    pbuf_free(datagram.buffer);
+    head.store(h + 1, std::memory_order_release);
+    return 1;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    if (pcb == nullptr && !open()) {
+      available = false;
+      return BOWLER_ERROR;
+    }
+
+    available = head.load(std::memory_order_relaxed) != tail.load(std::memory_order_acquire);
+    return 1;
+  }
+
+  std::uint64_t getReplyTarget() const override {
+    return (static_cast<std::uint64_t>(ip4_addr_get_u32(ip_2_ip4(&peerAddress))) << 16) |
+           peerPort;
+  }
+
+  void setReplyTarget(std::uint64_t itarget) override {
+    ip_addr_set_ip4_u32(&peerAddress, static_cast<std::uint32_t>(itarget >> 16));
+    peerPort = static_cast<u16_t>(itarget & 0xFFFF);
+    hasPeer = true;
+  }
+
+  /**
+   * @return The number of datagrams dropped because the ring was full.
+   */
+  std::uint32_t getFramesDropped() const {
+    return framesDropped.load(std::memory_order_relaxed);
+  }
+
+  private:
+  struct ReceivedDatagram {
+    pbuf *buffer;
+    ip_addr_t address;
+    u16_t port;
+  };
+
+  struct PcbCall : tcpip_api_call_data {
+    LwipUDPServer *server;
+  };
+
+  struct SendCall : tcpip_api_call_data {
+    LwipUDPServer *server;
+    pbuf *buffer;
+    err_t result;
+  };
+
+  bool open() {
+    PcbCall call;
+    call.server = this;
+    if (tcpip_api_call(openPcb, &call) != ERR_OK) {
+      errno = ENOTCONN;
+      return false;
+    }
+    return true;
+  }
+
+  // These run on the lwIP thread
+
+  static err_t openPcb(tcpip_api_call_data *icall) {
+    LwipUDPServer *server = static_cast<PcbCall *>(icall)->server;
+    udp_pcb *newPcb = udp_new();
+    if (newPcb == nullptr) {
+      return ERR_MEM;
+    }
+
+    const err_t result = udp_bind(newPcb, IP_ADDR_ANY, server->port);
+    if (result != ERR_OK) {
+      udp_remove(newPcb);
+      return result;
+    }
+
+    udp_recv(newPcb, onReceive, server);
+    server->pcb = newPcb;
+    return ERR_OK;
+  }
+
+  static err_t closePcb(tcpip_api_call_data *icall) {
+    LwipUDPServer *server = static_cast<PcbCall *>(icall)->server;
+    udp_remove(server->pcb);
+    server->pcb = nullptr;
+    return ERR_OK;
+  }
+
+  static err_t sendPcb(tcpip_api_call_data *icall) {
+    SendCall *call = static_cast<SendCall *>(icall);
+    LwipUDPServer *server = call->server;
+    call->result = udp_sendto(server->pcb, call->buffer, &server->peerAddress, server->peerPort);
+    return ERR_OK;
+  }
+
+  static void
+  onReceive(void *iarg, udp_pcb *, pbuf *ibuffer, const ip_addr_t *iaddress, u16_t iport) {
+    LwipUDPServer *server = static_cast<LwipUDPServer *>(iarg);
+    const std::uint32_t t = server->tail.load(std::memory_order_relaxed);
+    if (t - server->head.load(std::memory_order_acquire) == LWIP_RX_RING_SLOTS) {
+      // coms is not keeping up. Drop the newest datagram; the PC will resend it.
+      server->framesDropped.fetch_add(1, std::memory_order_relaxed);
+      pbuf_free(ibuffer);
+      return;
+    }
+
+    // The ring owns the pbuf until read() copies it out
+    ReceivedDatagram &datagram = server->ring[t & (LWIP_RX_RING_SLOTS - 1)];
+    datagram.buffer = ibuffer;
+    ip_addr_copy(datagram.address, *iaddress);
+    datagram.port = iport;
+    server->tail.store(t + 1, std::memory_order_release);
+  }
+
+  std::uint16_t port;
+  udp_pcb *pcb{nullptr};
+  ReceivedDatagram ring[LWIP_RX_RING_SLOTS];
+  std::atomic<std::uint32_t> head{0};
+  std::atomic<std::uint32_t> tail{0};
+  std::atomic<std::uint32_t> framesDropped{0};
+  ip_addr_t peerAddress;
+  u16_t peerPort{0};
+  bool hasPeer{false};
+};
+} // namespace bowlerserver
@@ -0,0 +1,273 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+namespace bowlerserver {
+/**
+ * A BowlerServer which uses a nonblocking UDP socket on Linux. Replies go to whoever sent the
+ * frame being replied to.
+ *
+ * Datagrams are received and sent in batches: one recvmmsg pulls up to the batch size of
+ * datagrams, and replies are queued until flush() (called by DefaultBowlerComs after each
+ * iteration) or until the batch is full, then sent with one sendmmsg. Give DefaultBowlerComs a
+ * drain limit of at least the batch size so one iteration handles a whole batch.
+ */
+template <std::size_t N> class NativeUDPServer : public BowlerServer<N> {
+  public:
+  /**
+   * Opens the socket and binds it to the port. Check isOpen() afterwards.
+   *
+   * @param iport The port to listen on.
+   * @param ibatchSize The most datagrams to receive or send per system call. 1 sends each reply
+   * as soon as it is written.
+   */
+  NativeUDPServer(std::uint16_t iport = BOWLER_SERVER_UDP_PORT, std::size_t ibatchSize = 1)
+    : rx(std::max<std::size_t>(ibatchSize, 1)), tx(std::max<std::size_t>(ibatchSize, 1)) {
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+      BOWLER_LOG("Error opening socket: %d %s\n", errno, strerror(errno));
+      return;
+    }
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(iport);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+      BOWLER_LOG("Error binding port %u: %d %s\n", iport, errno, strerror(errno));
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  virtual ~NativeUDPServer() {
+    if (fd >= 0) {
+      flush();
+      close(fd);
+    }
+  }
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    return writeFrame(payload, N);
+  }
+
+  std::int32_t writeFrame(const std::array<std::uint8_t, N> &payload,
+                          std::size_t length) override {
+    if (fd < 0 || !hasPeer) {
+      errno = ENOTCONN;
+      return BOWLER_ERROR;
+    }
+
+    tx.buffers[tx.count] = payload;
+    tx.peers[tx.count] = peer;
+    tx.lengths[tx.count] = std::min(length, N);
+    tx.count++;
+
+    if (tx.count == tx.buffers.size()) {
+      return flush();
+    }
+
+    return 1;
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    std::size_t length;
+    return readFrame(payload, length);
+  }
+
+  std::int32_t readFrame(std::array<std::uint8_t, N> &payload, std::size_t &length) override {
+    bool available;
+    if (rx.next == rx.count && (isDataAvailable(available) == BOWLER_ERROR || !available)) {
+      return BOWLER_ERROR;
+    }
+
+    const std::array<std::uint8_t, N> &buffer = rx.buffers[rx.next];
+    length = std::min<std::size_t>(rx.lengths[rx.next], N);
+    std::copy(buffer.begin(), buffer.begin() + length, payload.begin());
+    std::fill(payload.begin() + length, payload.end(), 0);
+
+    // Replies go here until the coms says otherwise with setReplyTarget
+    peer = rx.peers[rx.next];
+    hasPeer = true;
+    rx.next++;
+    return 1;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    if (fd < 0) {
+      errno = ENOTCONN;
+      available = false;
+      return BOWLER_ERROR;
+    }
+
+    if (rx.next == rx.count) {
+      std::fill(rx.lengths.begin(), rx.lengths.end(), N);
+      rx.prepare();
+      const int received =
+        recvmmsg(fd, rx.headers.data(), rx.headers.size(), MSG_DONTWAIT, nullptr);
+      if (received <= 0) {
+        available = false;
+        // recvmmsg will set errno (EWOULDBLOCK if there is no data)
+        return BOWLER_ERROR;
+      }
+
+      for (int i = 0; i < received; i++) {
+        rx.lengths[i] = rx.headers[i].msg_len;
+      }
+      rx.count = static_cast<std::size_t>(received);
+      rx.next = 0;
+      framesReceived += rx.count;
+    }
+
+    available = true;
+    return 1;
+  }
+
+  /**
+   * Sends every queued reply.
+   *
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t flush() override {
+    std::size_t sent = 0;
+    tx.prepare();
+    while (sent < tx.count) {
+      const int count = sendmmsg(fd, tx.headers.data() + sent, tx.count - sent, 0);
+      if (count < 0) {
+        // sendmmsg will set errno. Drop the rest like a lost datagram.
+        tx.count = 0;
+        return BOWLER_ERROR;
+      }
+      sent += static_cast<std::size_t>(count);
+    }
+
+    tx.count = 0;
+    return 1;
+  }
+
+  std::uint64_t getReplyTarget() const override {
+    return (static_cast<std::uint64_t>(peer.sin_addr.s_addr) << 16) | peer.sin_port;
+  }
+
+  void setReplyTarget(std::uint64_t itarget) override {
+    peer.sin_family = AF_INET;
+    peer.sin_addr.s_addr = static_cast<in_addr_t>(itarget >> 16);
+    peer.sin_port = static_cast<in_port_t>(itarget & 0xFFFF);
+  }
+
+  /**
+   * @return Whether datagrams from the last recvmmsg have not been read yet. The socket will not
+   * poll as readable for them.
+   */
+  bool hasPendingFrames() const {
+    return rx.next < rx.count;
+  }
+
+  /**
+   * Joins a multicast group so the server also receives datagrams sent to it, e.g. group frames
+   * (see GROUP_PACKET_ID). Replies still go to the sender's own address.
+   *
+   * @param igroup The group address, e.g. `239.18.66.1`.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t joinGroup(const char *igroup) {
+    ip_mreq request{};
+    if (inet_pton(AF_INET, igroup, &request.imr_multiaddr) != 1) {
+      errno = EINVAL;
+      return BOWLER_ERROR;
+    }
+    request.imr_interface.s_addr = htonl(INADDR_ANY);
+
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) < 0) {
+      // setsockopt will set errno
+      return BOWLER_ERROR;
+    }
+
+    return 1;
+  }
+
+  /**
+   * @return Whether the socket was opened and bound.
+   */
+  bool isOpen() const {
+    return fd >= 0;
+  }
+
+  /**
+   * @return The socket, for use with poll or epoll.
+   */
+  int getFd() const {
+    return fd;
+  }
+
+  /**
+   * @return The number of datagrams received so far.
+   */
+  std::uint64_t getFramesReceived() const {
+    return framesReceived;
+  }
+
+  private:
+  /**
+   * Buffers and message headers for one direction of batched I/O.
+   */
+  struct Batch {
+    Batch(std::size_t isize)
+      : buffers(isize), peers(isize), lengths(isize), iovecs(isize), headers(isize) {
+    }
+
+    /**
+     * Points the message headers at the buffers and peers, each as long as its entry in lengths.
+     */
+    void prepare() {
+      for (std::size_t i = 0; i < headers.size(); i++) {
+        iovecs[i].iov_base = buffers[i].data();
+        iovecs[i].iov_len = lengths[i];
+        headers[i].msg_hdr = msghdr{};
+        headers[i].msg_hdr.msg_name = &peers[i];
+        headers[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+        headers[i].msg_hdr.msg_iov = &iovecs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+      }
+    }
+
+    std::vector<std::array<std::uint8_t, N>> buffers;
+    std::vector<sockaddr_in> peers;
+    std::vector<std::size_t> lengths;
+    std::vector<iovec> iovecs;
+    std::vector<mmsghdr> headers;
+    std::size_t count{0};
+    std::size_t next{0};
+  };
+
+  int fd{-1};
+  sockaddr_in peer{};
+  bool hasPeer{false};
+  Batch rx;
+  Batch tx;
+  std::uint64_t framesReceived{0};
+};
+} // namespace bowlerserver
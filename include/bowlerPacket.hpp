@@ -1,12 +1,15 @@
 #pragma once
 
+#include "bowlerDeviceServerUtil.hpp"
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstdint>
 
 namespace bowlerserver {
 class Packet {
   public:
-  Packet(std::uint8_t iid, bool iisReliable = false) : id(iid), m_isReliable(iisReliable) {
+  Packet(std::uint16_t iid, bool iisReliable = false) : id(iid), m_isReliable(iisReliable) {
   }
 
   virtual ~Packet() = default;
@@ -19,7 +22,27 @@ class Packet {
    */
   virtual std::int32_t event(std::uint8_t *payload) = 0;
 
-  std::uint8_t getId() const {
+  /**
+   * Processes several payloads for this packet at once, in the order they were received. Only
+   * called for unreliable packets when more than one of their frames was read in the same
+   * iteration of coms (see DefaultBowlerComs::setDrainLimit). Override this to handle them
+   * together, e.g. in one bus transaction. Calls event() on each payload by default.
+   *
+   * @param payloads The payloads (not including header data).
+   * @param count The number of payloads.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  virtual std::int32_t eventBatch(std::uint8_t *const *payloads, std::size_t count) {
+    std::int32_t result = 1;
+    for (std::size_t i = 0; i < count; i++) {
+      if (event(payloads[i]) == BOWLER_ERROR) {
+        result = BOWLER_ERROR;
+      }
+    }
+    return result;
+  }
+
+  std::uint16_t getId() const {
     return id;
   }
 
@@ -27,8 +50,225 @@ class Packet {
     return m_isReliable;
   }
 
+  /**
+   * @return Whether replies to this packet carry device timestamps in their last
+   * FRAME_TIMESTAMPS_LENGTH bytes.
+   */
+  bool isTimestamped() const {
+    return m_isTimestamped;
+  }
+
+  /**
+   * Sets whether replies to this packet carry device timestamps. The last FRAME_TIMESTAMPS_LENGTH
+   * bytes of the payload are overwritten with the time the frame was received and the time its
+   * reply was written, so the packet must not use them.
+   *
+   * @param iisTimestamped Whether to timestamp replies.
+   */
+  void setTimestamped(bool iisTimestamped) {
+    m_isTimestamped = iisTimestamped;
+  }
+
+  /**
+   * @return The PRIORITY_* class of this packet.
+   */
+  std::uint8_t getPriority() const {
+    return priority;
+  }
+
+  /**
+   * Sets the priority class of this packet. When several frames are read in the same iteration
+   * of coms (see DefaultBowlerComs::setDrainLimit), frames for higher priority packets are
+   * handled and replied to first. Frames for the same packet always keep their order.
+   *
+   * @param ipriority The PRIORITY_* class.
+   */
+  void setPriority(std::uint8_t ipriority) {
+    priority = ipriority;
+  }
+
+  /**
+   * @return The longest time in microseconds a frame for this packet may wait to be handled, or
+   * `0` if it has no deadline.
+   */
+  time_t getDeadline() const {
+    return deadline;
+  }
+
+  /**
+   * Sets how long a frame for this packet may wait between being read and its event running.
+   * Frames which waited longer are dropped without running the event; the reply has
+   * HEADER_STATUS_BIT set and STATUS_EXPIRED as the first payload byte. A reliable packet does
+   * not ACK an expired frame. Frames for PRIORITY_HIGH packets never expire.
+   *
+   * @param ideadline The deadline in microseconds, or `0` for none.
+   */
+  void setDeadline(time_t ideadline) {
+    deadline = ideadline;
+  }
+
+  /**
+   * @return The number of frames per second this packet accepts on average, or `0` if it is not
+   * rate limited.
+   */
+  std::uint32_t getRateLimit() const {
+    return rateLimit;
+  }
+
+  /**
+   * @return The number of frames this packet accepts back-to-back.
+   */
+  std::uint32_t getRateBurst() const {
+    return rateBurst;
+  }
+
+  /**
+   * Limits how often this packet's event runs with a token bucket. Frames over the limit are
+   * dropped without running the event; the reply has HEADER_STATUS_BIT set and
+   * STATUS_RATE_LIMITED as the first payload byte, telling the PC to back off. A reliable packet
+   * does not ACK a dropped frame.
+   *
+   * @param irateLimit The number of frames per second to accept on average, or `0` for no limit.
+   * @param irateBurst The number of frames to accept back-to-back. At least 1.
+   */
+  void setRateLimit(std::uint32_t irateLimit, std::uint32_t irateBurst) {
+    rateLimit = irateLimit;
+    rateBurst = irateBurst > 0 ? irateBurst : 1;
+  }
+
+  /**
+   * @return Whether this packet's commands run at a time given in the frame.
+   */
+  bool isScheduled() const {
+    return m_isScheduled;
+  }
+
+  /**
+   * Makes this packet's commands run at a time the PC picks instead of as soon as they arrive, so
+   * network jitter does not become actuation jitter. Each payload starts with
+   * <Execute at (SCHEDULED_TIME_LENGTH bytes)>, the low 32 bits of getTime() to run the event at;
+   * the event sees the rest of the payload. The reply is sent when the command is queued, with
+   * HEADER_STATUS_BIT set and STATUS_ACCEPTED, or STATUS_SCHEDULE_FULL if there was no room (see
+   * DefaultBowlerComs::enableScheduledCommands). Commands already due run right away. The event
+   * runs without a reply, so anything it writes into the payload is dropped.
+   *
+   * @param iisScheduled Whether commands are scheduled.
+   */
+  void setScheduled(bool iisScheduled) {
+    m_isScheduled = iisScheduled;
+  }
+
+  /**
+   * @return The length of this packet's frames including the header, or `0` for the coms' full
+   * frame length.
+   */
+  std::size_t getFrameLength() const {
+    return frameLength;
+  }
+
+  /**
+   * Puts this packet in a smaller frame size class than the coms' full frame length N, e.g. so
+   * short control frames stay short on the wire while bulk packets use the full length. Its
+   * replies are written with this length, and bytes of a received frame past it are zeroed
+   * before the event sees them. Timestamps (see setTimestamped) go at the end of this length.
+   *
+   * @param ilength The frame length including the header, or `0` for the full frame length.
+   */
+  void setFrameLength(std::size_t ilength) {
+    frameLength = ilength;
+  }
+
+  /**
+   * @return The length of this packet's payloads (not including header data) on coms with a full
+   * frame length of N. This is the frame length (see setFrameLength) clamped to what fits in N and
+   * leaves at least one payload byte.
+   */
+  template <std::size_t N> std::size_t getPayloadLength() const {
+    if (frameLength == 0 || frameLength > N) {
+      return N - HEADER_LENGTH;
+    }
+    return std::max<std::size_t>(frameLength, HEADER_LENGTH + 1) - HEADER_LENGTH;
+  }
+
+  /**
+   * @return Whether this packet's frames may be compressed.
+   */
+  bool isCompressed() const {
+    return m_isCompressed;
+  }
+
+  /**
+   * Sets whether this packet's frames may be compressed with LzCodec, usually negotiated by the
+   * PC with OPERATION_SET_COMPRESSION. Replies are compressed after the event when that makes
+   * them shorter, and received frames the PC compressed are decompressed before the event; either
+   * way HEADER_COMPRESSED_BIT marks a compressed frame. Only worth it for large, repetitive
+   * payloads on servers with variable length frames (see BowlerServer::writeFrame).
+   *
+   * @param iisCompressed Whether frames may be compressed.
+   */
+  void setCompressed(bool iisCompressed) {
+    m_isCompressed = iisCompressed;
+  }
+
+  /**
+   * @return Whether this packet's replies may be served from the reply cache.
+   */
+  bool isIdempotent() const {
+    return m_isIdempotent;
+  }
+
+  /**
+   * @return How long a cached reply stays valid in microseconds, or `0` for until the cache is
+   * invalidated.
+   */
+  time_t getCacheTtl() const {
+    return cacheTtl;
+  }
+
+  /**
+   * Declares that this packet's event only reads state, so the same request payload always gets
+   * the same reply until that state changes (e.g. identity, firmware version or configuration).
+   * With DefaultBowlerComs::enableReplyCache, repeats of a request are then answered from the
+   * cache without calling the event. Call invalidateCache() whenever the state changes. Adding
+   * the packet to coms invalidates it as well, so replies cached before it was removed are not
+   * used once it is added back.
+   *
+   * @param iisIdempotent Whether replies may be cached.
+   * @param icacheTtl How long a cached reply stays valid in microseconds, or `0` for until the
+   * cache is invalidated.
+   */
+  void setIdempotent(bool iisIdempotent, time_t icacheTtl = 0) {
+    m_isIdempotent = iisIdempotent;
+    cacheTtl = icacheTtl;
+  }
+
+  /**
+   * Drops the cached replies of this packet. Safe to call from any thread.
+   */
+  void invalidateCache() {
+    cacheGeneration.fetch_add(1, std::memory_order_release);
+  }
+
+  /**
+   * @return A number which changes every time invalidateCache() is called.
+   */
+  std::uint32_t getCacheGeneration() const {
+    return cacheGeneration.load(std::memory_order_acquire);
+  }
+
   protected:
-  std::uint8_t id;
+  std::uint16_t id;
   bool m_isReliable;
+  bool m_isTimestamped{false};
+  bool m_isScheduled{false};
+  bool m_isCompressed{false};
+  bool m_isIdempotent{false};
+  time_t cacheTtl{0};
+  std::atomic<std::uint32_t> cacheGeneration{0};
+  std::uint8_t priority{PRIORITY_NORMAL};
+  time_t deadline{0};
+  std::uint32_t rateLimit{0};
+  std::uint32_t rateBurst{1};
+  std::size_t frameLength{0};
 };
 } // namespace bowlerserver
@@ -0,0 +1,306 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include <algorithm>
+
+#if defined(PLATFORM_NATIVE)
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+namespace bowlerserver {
+const std::size_t SERIAL_CRC_LENGTH = 2;
+// Bytes read from the port at once
+const std::size_t SERIAL_RX_BUFFER_LENGTH = 256;
+
+/**
+ * Computes the CRC-16/CCITT-FALSE of some data.
+ *
+ * @param idata The data.
+ * @param ilength The number of bytes.
+ * @return The CRC.
+ */
+inline std::uint16_t crc16(const std::uint8_t *idata, std::size_t ilength) {
+  // The CRC of each byte value shifted into the high byte (polynomial 0x1021), so each byte of
+  // data is one lookup instead of eight shifts
+  static const std::uint16_t table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+  };
+
+  std::uint16_t crc = 0xFFFF;
+  for (std::size_t i = 0; i < ilength; i++) {
+    crc = static_cast<std::uint16_t>((crc << 8) ^ table[(crc >> 8) ^ idata[i]]);
+  }
+  return crc;
+}
+
+/**
+ * A BowlerServer which frames packets on a byte stream such as a UART. Each frame is sent as the
+ * COBS encoding of `<Frame (up to N bytes)> <CRC-16 (2 bytes, little endian)>` followed by a zero
+ * byte, so the receiver can always find the next frame after noise or a dropped byte. Frames
+ * shorter than the header, longer than N or with the wrong CRC are dropped.
+ *
+ * The port is a template parameter so no per-byte virtual calls are made. It needs
+ * `int available()`, `std::size_t readBytes(char *, std::size_t)` and
+ * `std::size_t write(const std::uint8_t *, std::size_t)`, like Arduino's HardwareSerial. Bytes are
+ * read from the port in bulk into a buffer and decoded from there, and each reply is encoded into
+ * a buffer and written with one call.
+ */
+template <std::size_t N, typename Port> class SerialServer : public BowlerServer<N> {
+  public:
+  /**
+   * @param iport The port to use. Must outlive the server and already be open (e.g. with
+   * `Serial.begin(BOWLER_SERIAL_BAUD_RATE)`).
+   */
+  SerialServer(Port &iport) : port(iport) {
+  }
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    return writeFrame(payload, N);
+  }
+
+  std::int32_t writeFrame(const std::array<std::uint8_t, N> &payload,
+                          std::size_t length) override {
+    length = std::min(length, N);
+    std::array<std::uint8_t, N + SERIAL_CRC_LENGTH> frame;
+    std::copy(payload.begin(), payload.begin() + length, frame.begin());
+    writeLittleEndian(frame.data() + length, crc16(payload.data(), length));
+
+    // COBS: each block starts with the distance to the next zero, at most 254 bytes apart
+    std::size_t codeIndex = 0;
+    std::size_t encodedLength = 1;
+    std::uint8_t code = 1;
+    for (std::size_t i = 0; i < length + SERIAL_CRC_LENGTH; i++) {
+      if (frame[i] != 0) {
+        txBuffer[encodedLength++] = frame[i];
+        code++;
+      }
+
+      if (frame[i] == 0 || code == 0xFF) {
+        txBuffer[codeIndex] = code;
+        codeIndex = encodedLength++;
+        code = 1;
+      }
+    }
+    txBuffer[codeIndex] = code;
+    txBuffer[encodedLength++] = 0;
+
+    if (port.write(txBuffer.data(), encodedLength) != encodedLength) {
+      errno = EIO;
+      return BOWLER_ERROR;
+    }
+
+    return 1;
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    std::size_t length;
+    return readFrame(payload, length);
+  }
+
+  std::int32_t readFrame(std::array<std::uint8_t, N> &payload, std::size_t &length) override {
+    bool available;
+    if (isDataAvailable(available) == BOWLER_ERROR || !available) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    length = rxFrameLength;
+    std::copy(rxFrame.begin(), rxFrame.begin() + length, payload.begin());
+    std::fill(payload.begin() + length, payload.end(), 0);
+    hasFrame = false;
+    return 1;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    while (!hasFrame) {
+      if (rxStart == rxEnd && !fillRxBuffer()) {
+        break;
+      }
+
+      decode();
+    }
+
+    available = hasFrame;
+    return 1;
+  }
+
+  /**
+   * @return The number of frames dropped because of a bad length or CRC.
+   */
+  std::uint32_t getFramesDropped() const {
+    return framesDropped;
+  }
+
+  private:
+  bool fillRxBuffer() {
+    const int available = port.available();
+    if (available <= 0) {
+      return false;
+    }
+
+    const std::size_t count = std::min<std::size_t>(available, rxBuffer.size());
+    rxStart = 0;
+    rxEnd = port.readBytes(reinterpret_cast<char *>(rxBuffer.data()), count);
+    return rxEnd > 0;
+  }
+
+  /**
+   * Decodes buffered bytes until a frame is complete or the buffer is empty.
+   */
+  void decode() {
+    while (rxStart < rxEnd) {
+      const std::uint8_t byte = rxBuffer[rxStart++];
+      if (byte == 0) {
+        endFrame();
+        if (hasFrame) {
+          return;
+        }
+        continue;
+      }
+
+      if (blockRemaining == 0) {
+        // A new block. The end of the previous block stands for a zero unless it was full.
+        if (blockCode != 0 && blockCode != 0xFF) {
+          pushByte(0);
+        }
+        blockCode = byte;
+        blockRemaining = byte - 1;
+      } else {
+        pushByte(byte);
+        blockRemaining--;
+      }
+    }
+  }
+
+  void pushByte(std::uint8_t ibyte) {
+    if (rxLength < rxFrame.size()) {
+      rxFrame[rxLength] = ibyte;
+    }
+    // Keep counting past the end so an overlong frame is dropped
+    rxLength++;
+  }
+
+  void endFrame() {
+    const bool isComplete = blockRemaining == 0 && blockCode != 0;
+    const std::size_t frameLength = rxLength - SERIAL_CRC_LENGTH;
+    if (isComplete && rxLength >= HEADER_LENGTH + SERIAL_CRC_LENGTH &&
+        rxLength <= rxFrame.size() &&
+        readLittleEndian<std::uint16_t>(rxFrame.data() + frameLength) ==
+          crc16(rxFrame.data(), frameLength)) {
+      hasFrame = true;
+      rxFrameLength = frameLength;
+    } else if (rxLength > 0 || blockCode != 0) {
+      framesDropped++;
+    }
+
+    rxLength = 0;
+    blockCode = 0;
+    blockRemaining = 0;
+  }
+
+  Port &port;
+  std::array<std::uint8_t, SERIAL_RX_BUFFER_LENGTH> rxBuffer;
+  std::size_t rxStart{0};
+  std::size_t rxEnd{0};
+  std::array<std::uint8_t, N + SERIAL_CRC_LENGTH> rxFrame;
+  std::size_t rxLength{0};
+  std::size_t rxFrameLength{0};
+  std::uint8_t blockCode{0};
+  std::uint8_t blockRemaining{0};
+  bool hasFrame{false};
+  std::uint32_t framesDropped{0};
+  std::array<std::uint8_t, N + SERIAL_CRC_LENGTH + (N + SERIAL_CRC_LENGTH) / 254 + 2> txBuffer;
+};
+
+#if defined(PLATFORM_NATIVE)
+/**
+ * A SerialServer port for a file descriptor on Linux, such as a tty or one end of a pty pair.
+ * The descriptor should be in raw mode.
+ */
+class FdSerialPort {
+  public:
+  /**
+   * @param ifd The file descriptor. Not closed by the port.
+   */
+  explicit FdSerialPort(int ifd) : fd(ifd) {
+  }
+
+  int available() {
+    int count = 0;
+    if (ioctl(fd, FIONREAD, &count) < 0) {
+      return 0;
+    }
+    return count;
+  }
+
+  std::size_t readBytes(char *ibuffer, std::size_t ilength) {
+    const ssize_t count = ::read(fd, ibuffer, ilength);
+    return count < 0 ? 0 : static_cast<std::size_t>(count);
+  }
+
+  std::size_t write(const std::uint8_t *ibuffer, std::size_t ilength) {
+    std::size_t written = 0;
+    while (written < ilength) {
+      const ssize_t count = ::write(fd, ibuffer + written, ilength - written);
+      if (count < 0) {
+        break;
+      }
+      written += static_cast<std::size_t>(count);
+    }
+    return written;
+  }
+
+  private:
+  int fd;
+};
+#endif
+} // namespace bowlerserver
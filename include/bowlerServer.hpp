@@ -43,6 +43,32 @@ template <std::size_t N> class BowlerServer {
    */
   virtual std::int32_t read(std::array<std::uint8_t, N> &ipayload) = 0;
 
+  /**
+   * Writes the start of a frame to the PC, for transports where frames can be shorter than N
+   * (e.g. datagrams). Writes the whole frame by default.
+   *
+   * @param ipayload The frame.
+   * @param ilength The number of bytes to write. At most N.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  virtual std::int32_t writeFrame(const std::array<std::uint8_t, N> &ipayload,
+                                  std::size_t /*ilength*/) {
+    return write(ipayload);
+  }
+
+  /**
+   * Reads a frame from the PC along with its length on the wire. Bytes past the length are
+   * zeroed. Frames are always N bytes long by default.
+   *
+   * @param ipayload The payload to write the data into.
+   * @param olength The length of the frame.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  virtual std::int32_t readFrame(std::array<std::uint8_t, N> &ipayload, std::size_t &olength) {
+    olength = N;
+    return read(ipayload);
+  }
+
   /**
    * Checks if there is data available to read.
    *
@@ -50,5 +76,34 @@ template <std::size_t N> class BowlerServer {
    * @return `1` on success or BOWLER_ERROR on error.
    */
   virtual std::int32_t isDataAvailable(bool &iavailable) = 0;
+
+  /**
+   * Sends any writes the server has queued. Servers which batch writes send them here; called
+   * once the replies to every frame read in an iteration of coms have been written.
+   *
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  virtual std::int32_t flush() {
+    return 1;
+  }
+
+  /**
+   * Gets where a reply to the frame read last should go. Servers which can receive from more than
+   * one peer use this so replies reach the right peer when several frames are read before any
+   * are replied to.
+   *
+   * @return An opaque value to pass to setReplyTarget.
+   */
+  virtual std::uint64_t getReplyTarget() const {
+    return 0;
+  }
+
+  /**
+   * Sets where the next write goes.
+   *
+   * @param itarget A value from getReplyTarget.
+   */
+  virtual void setReplyTarget(std::uint64_t /*itarget*/) {
+  }
 };
 } // namespace bowlerserver
@@ -0,0 +1,345 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include <atomic>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace bowlerserver {
+// The number of frames each direction of a shared memory channel can hold. Must be a power of 2.
+const std::uint32_t SHARED_MEMORY_RING_SLOTS = 64;
+
+/**
+ * A single producer, single consumer ring of frames which lives in shared memory. Frames are
+ * written and read in place in the ring's slots. A consumer with nothing to read can sleep on a
+ * futex until the producer publishes a frame.
+ */
+template <std::size_t N> struct SharedMemoryRing {
+  /**
+   * @return The slot to write the next frame into, or `nullptr` if the ring is full. Call
+   * commitWrite() to publish it.
+   */
+  std::uint8_t *beginWrite() {
+    const std::uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == SHARED_MEMORY_RING_SLOTS) {
+      return nullptr;
+    }
+    return slots[t & (SHARED_MEMORY_RING_SLOTS - 1)];
+  }
+
+  /**
+   * Publishes the frame written into the slot from beginWrite() and wakes the consumer if it is
+   * sleeping.
+   */
+  void commitWrite() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+    if (hasWaiter.load(std::memory_order_seq_cst) != 0) {
+      futex(FUTEX_WAKE, 1, nullptr);
+    }
+  }
+
+  /**
+   * @return The oldest unread frame, or `nullptr` if the ring is empty. Call commitRead() once
+   * done with it.
+   */
+  const std::uint8_t *beginRead() const {
+    const std::uint32_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return slots[h & (SHARED_MEMORY_RING_SLOTS - 1)];
+  }
+
+  /**
+   * Frees the slot from beginRead() for the producer.
+   */
+  void commitRead() {
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /**
+   * Sleeps until the ring has a frame to read.
+   *
+   * @param itimeout The longest time to sleep in microseconds.
+   * @return False if the ring is still empty.
+   */
+  bool waitForData(time_t itimeout) {
+    if (beginRead() != nullptr) {
+      return true;
+    }
+
+    timespec timeout{static_cast<std::time_t>(itimeout / 1000000),
+                     static_cast<long>(itimeout % 1000000) * 1000};
+
+    // Announce the waiter before checking again so a frame published in between is not missed
+    hasWaiter.store(1, std::memory_order_seq_cst);
+    const std::uint32_t observed = tail.load(std::memory_order_seq_cst);
+    if (observed == head.load(std::memory_order_relaxed)) {
+      futex(FUTEX_WAIT, observed, &timeout);
+    }
+    hasWaiter.store(0, std::memory_order_relaxed);
+    return beginRead() != nullptr;
+  }
+
+  // Each index and the consumer's waiter flag are on their own cache lines so the producer and
+  // consumer do not false share
+  alignas(64) std::atomic<std::uint32_t> head;
+  alignas(64) std::atomic<std::uint32_t> tail;
+  alignas(64) std::atomic<std::uint32_t> hasWaiter;
+  alignas(64) std::uint8_t slots[SHARED_MEMORY_RING_SLOTS][N];
+
+  private:
+  void futex(int iop, std::uint32_t ival, const timespec *itimeout) {
+    // Not FUTEX_PRIVATE_FLAG because the ring is shared between processes
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&tail), iop, ival, itimeout, nullptr, 0);
+  }
+};
+
+/**
+ * The layout of a shared memory channel: one ring for each direction.
+ */
+template <std::size_t N> struct SharedMemoryChannel {
+  SharedMemoryRing<N> toDevice;
+  SharedMemoryRing<N> toHost;
+};
+
+/**
+ * A mapping of a named POSIX shared memory channel.
+ */
+template <std::size_t N> class SharedMemoryMapping {
+  public:
+  /**
+   * Maps the channel. Check isOpen() afterwards.
+   *
+   * @param iname The shared memory object name, e.g. `/bowler-sim`.
+   * @param icreate Whether to create the channel instead of opening an existing one. Creating
+   * fails if a channel with the name already exists, so a live channel is never reset under its
+   * users; remove a stale one left by a crashed server with shm_unlink.
+   */
+  SharedMemoryMapping(const std::string &iname, bool icreate) : name(iname) {
+    int fd = shm_open(name.c_str(), icreate ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+    if (fd < 0 && errno == EEXIST) {
+      BOWLER_LOG("Shared memory %s already exists; another server may be using it (remove it "
+                 "with shm_unlink if it is stale)\n",
+                 name.c_str());
+      return;
+    } else if (fd < 0) {
+      BOWLER_LOG("Error opening shared memory %s: %d %s\n", name.c_str(), errno, strerror(errno));
+      return;
+    }
+
+    // Only the creator removes the name, so a failed create leaves the existing channel alone
+    isOwner = icreate;
+
+    if (icreate && ftruncate(fd, sizeof(SharedMemoryChannel<N>)) < 0) {
+      BOWLER_LOG("Error sizing shared memory %s: %d %s\n", name.c_str(), errno, strerror(errno));
+      close(fd);
+      return;
+    }
+
+    void *memory =
+      mmap(nullptr, sizeof(SharedMemoryChannel<N>), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+      BOWLER_LOG("Error mapping shared memory %s: %d %s\n", name.c_str(), errno, strerror(errno));
+      return;
+    }
+
+    channel = static_cast<SharedMemoryChannel<N> *>(memory);
+    if (icreate) {
+      resetRing(channel->toDevice);
+      resetRing(channel->toHost);
+    }
+  }
+
+  virtual ~SharedMemoryMapping() {
+    if (channel != nullptr) {
+      munmap(channel, sizeof(SharedMemoryChannel<N>));
+    }
+
+    if (isOwner) {
+      shm_unlink(name.c_str());
+    }
+  }
+
+  SharedMemoryMapping(const SharedMemoryMapping &) = delete;
+  SharedMemoryMapping &operator=(const SharedMemoryMapping &) = delete;
+
+  /**
+   * @return Whether the channel was mapped.
+   */
+  bool isOpen() const {
+    return channel != nullptr;
+  }
+
+  protected:
+  static void resetRing(SharedMemoryRing<N> &iring) {
+    iring.head.store(0);
+    iring.tail.store(0);
+    iring.hasWaiter.store(0);
+  }
+
+  std::string name;
+  bool isOwner{false};
+  SharedMemoryChannel<N> *channel{nullptr};
+};
+
+/**
+ * A BowlerServer which talks to a process on the same host (e.g. a simulator) through a shared
+ * memory channel instead of a socket. Reading and writing a frame is one copy between the ring and
+ * the frame buffer with no system call, unless the other side is sleeping in
+ * SharedMemoryClient::read. The server creates the channel and removes it when destroyed. Only
+ * one server can use a channel name at a time.
+ */
+template <std::size_t N> class SharedMemoryServer : public BowlerServer<N>,
+                                                    public SharedMemoryMapping<N> {
+  public:
+  /**
+   * Creates the channel. Check isOpen() afterwards, which is false if the channel already
+   * exists.
+   *
+   * @param iname The shared memory object name, e.g. `/bowler-sim`.
+   */
+  SharedMemoryServer(const std::string &iname) : SharedMemoryMapping<N>(iname, true) {
+  }
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    if (this->channel == nullptr) {
+      errno = ENOTCONN;
+      return BOWLER_ERROR;
+    }
+
+    std::uint8_t *slot = this->channel->toHost.beginWrite();
+    if (slot == nullptr) {
+      // The host is not keeping up with the replies
+      errno = ENOBUFS;
+      return BOWLER_ERROR;
+    }
+
+    std::copy(payload.begin(), payload.end(), slot);
+    this->channel->toHost.commitWrite();
+    return 1;
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    if (this->channel == nullptr) {
+      errno = ENOTCONN;
+      return BOWLER_ERROR;
+    }
+
+    const std::uint8_t *slot = this->channel->toDevice.beginRead();
+    if (slot == nullptr) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    std::copy(slot, slot + N, payload.begin());
+    this->channel->toDevice.commitRead();
+    return 1;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    if (this->channel == nullptr) {
+      errno = ENOTCONN;
+      available = false;
+      return BOWLER_ERROR;
+    }
+
+    available = this->channel->toDevice.beginRead() != nullptr;
+    return 1;
+  }
+
+  /**
+   * Sleeps until the host sends a frame, so a device thread need not spin between frames.
+   *
+   * @param itimeout The longest time to sleep in microseconds.
+   * @return False if there is still no frame.
+   */
+  bool waitForData(time_t itimeout) {
+    return this->channel != nullptr && this->channel->toDevice.waitForData(itimeout);
+  }
+};
+
+/**
+ * The host side of a SharedMemoryServer's channel.
+ */
+template <std::size_t N> class SharedMemoryClient : public SharedMemoryMapping<N> {
+  public:
+  /**
+   * Opens the channel, which the server must have created. Check isOpen() afterwards.
+   *
+   * @param iname The shared memory object name the server was created with.
+   */
+  SharedMemoryClient(const std::string &iname) : SharedMemoryMapping<N>(iname, false) {
+  }
+
+  /**
+   * Sends a frame to the device.
+   *
+   * @param ipayload The frame.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t write(const std::array<std::uint8_t, N> &ipayload) {
+    if (this->channel == nullptr) {
+      errno = ENOTCONN;
+      return BOWLER_ERROR;
+    }
+
+    std::uint8_t *slot = this->channel->toDevice.beginWrite();
+    if (slot == nullptr) {
+      errno = ENOBUFS;
+      return BOWLER_ERROR;
+    }
+
+    std::copy(ipayload.begin(), ipayload.end(), slot);
+    this->channel->toDevice.commitWrite();
+    return 1;
+  }
+
+  /**
+   * Reads a reply from the device, sleeping until one arrives.
+   *
+   * @param ipayload The frame to read the reply into.
+   * @param itimeout The longest time to sleep in microseconds.
+   * @return `1` on success or BOWLER_ERROR on error (errno is ETIMEDOUT if there was no reply).
+   */
+  std::int32_t read(std::array<std::uint8_t, N> &ipayload, time_t itimeout) {
+    if (this->channel == nullptr) {
+      errno = ENOTCONN;
+      return BOWLER_ERROR;
+    }
+
+    if (!this->channel->toHost.waitForData(itimeout)) {
+      errno = ETIMEDOUT;
+      return BOWLER_ERROR;
+    }
+
+    const std::uint8_t *slot = this->channel->toHost.beginRead();
+    std::copy(slot, slot + N, ipayload.begin());
+    this->channel->toHost.commitRead();
+    return 1;
+  }
+};
+} // namespace bowlerserver
@@ -20,13 +20,16 @@
 #include "bowlerServer.hpp"
 #include <WiFi.h>
 #include <WiFiUdp.h>
+#include <algorithm>
 #include <functional>
 
 namespace bowlerserver {
-const std::uint16_t BOWLER_SERVER_UDP_PORT = 1866;
-
 /**
  * A BowlerServer which uses UDP. Listens on port BOWLER_SERVER_UDP_PORT.
+ *
+ * Replies go to whoever sent the last datagram, so this server does not support reading more than
+ * one frame per iteration from different peers. Keep DefaultBowlerComs::setDrainLimit at 1 with it,
+ * or use LwipUDPServer.
  */
 template <std::size_t N> class UDPServer : public BowlerServer<N> {
   public:
@@ -39,6 +42,11 @@ template <std::size_t N> class UDPServer : public BowlerServer<N> {
   }
 
   std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    return writeFrame(payload, N);
+  }
+
+  std::int32_t writeFrame(const std::array<std::uint8_t, N> &payload,
+                          std::size_t length) override {
     if (!connected) {
       errno = ENOTCONN;
       return BOWLER_ERROR;
@@ -49,7 +57,7 @@ template <std::size_t N> class UDPServer : public BowlerServer<N> {
       return BOWLER_ERROR;
     }
 
-    udp.write(payload.data(), payload.size());
+    udp.write(payload.data(), std::min(length, N));
     if (!udp.endPacket()) {
       // endPacket will set errno
       return BOWLER_ERROR;
@@ -59,12 +67,19 @@ template <std::size_t N> class UDPServer : public BowlerServer<N> {
   }
 
   std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    std::size_t length;
+    return readFrame(payload, length);
+  }
+
+  std::int32_t readFrame(std::array<std::uint8_t, N> &payload, std::size_t &length) override {
     if (!connected) {
       errno = ENOTCONN;
       return BOWLER_ERROR;
     }
 
-    udp.read(payload.data(), payload.size());
+    const int count = udp.read(payload.data(), payload.size());
+    length = count > 0 ? static_cast<std::size_t>(count) : 0;
+    std::fill(payload.begin() + length, payload.end(), 0);
     return 1;
   }
 
@@ -85,12 +100,31 @@ template <std::size_t N> class UDPServer : public BowlerServer<N> {
     return 1;
   }
 
+  /**
+   * Joins a multicast group so the server also receives datagrams sent to it, e.g. group frames
+   * (see GROUP_PACKET_ID). Replies still go to the sender's own address.
+   *
+   * @param igroup The group address.
+   */
+  void joinGroup(IPAddress igroup) {
+    group = igroup;
+    if (connected) {
+      udp.stop();
+      udp.beginMulticast(group, BOWLER_SERVER_UDP_PORT);
+    }
+  }
+
   protected:
   void callback(WiFiEvent_t event) {
     switch (event) {
     case SYSTEM_EVENT_STA_GOT_IP:
       // ESP32 station got IP from connected AP
-      udp.begin(WiFi.localIP(), BOWLER_SERVER_UDP_PORT);
+      if (group) {
+        // Listens on every address, including the group
+        udp.beginMulticast(group, BOWLER_SERVER_UDP_PORT);
+      } else {
+        udp.begin(WiFi.localIP(), BOWLER_SERVER_UDP_PORT);
+      }
       connected = true;
       break;
 
@@ -102,7 +136,11 @@ template <std::size_t N> class UDPServer : public BowlerServer<N> {
     case SYSTEM_EVENT_AP_STACONNECTED:
       // A station connected to ESP32 soft-AP
       if (!connected) {
-        udp.begin(WiFi.softAPIP(), BOWLER_SERVER_UDP_PORT);
+        if (group) {
+          udp.beginMulticast(group, BOWLER_SERVER_UDP_PORT);
+        } else {
+          udp.begin(WiFi.softAPIP(), BOWLER_SERVER_UDP_PORT);
+        }
         connected = true;
       }
       break;
@@ -114,6 +152,7 @@ template <std::size_t N> class UDPServer : public BowlerServer<N> {
 
   private:
   WiFiUDP udp;
+  IPAddress group{0, 0, 0, 0};
   wifi_event_id_t event;
   bool connected{false};
 };
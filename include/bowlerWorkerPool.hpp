@@ -0,0 +1,197 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include <atomic>
+#include <cstddef>
+#include <functional>
+
+#if defined(PLATFORM_NATIVE)
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#elif defined(PLATFORM_ESP32)
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#endif
+
+namespace bowlerserver {
+/**
+ * Runs independent tasks on several cores.
+ */
+class WorkerPool {
+  public:
+  virtual ~WorkerPool() = default;
+
+  /**
+   * Runs `itask(i)` for every `i` in `[0, icount)`, spread over the workers and the calling
+   * thread. Returns once every task has finished.
+   *
+   * @param icount The number of tasks.
+   * @param itask The task.
+   */
+  virtual void run(std::size_t icount, const std::function<void(std::size_t)> &itask) = 0;
+
+  protected:
+  /**
+   * Takes tasks from the current job until there are none left.
+   */
+  void work() {
+    std::size_t i;
+    while ((i = next.fetch_add(1)) < jobCount) {
+      (*job)(i);
+    }
+  }
+
+  void beginJob(std::size_t icount, const std::function<void(std::size_t)> &itask) {
+    job = &itask;
+    jobCount = icount;
+    next = 0;
+  }
+
+  private:
+  const std::function<void(std::size_t)> *job{nullptr};
+  std::size_t jobCount{0};
+  std::atomic<std::size_t> next{0};
+};
+
+#if defined(PLATFORM_NATIVE)
+/**
+ * A WorkerPool backed by threads.
+ */
+class ThreadWorkerPool : public WorkerPool {
+  public:
+  /**
+   * @param iworkerCount The number of threads to start, not counting the calling thread.
+   */
+  ThreadWorkerPool(std::size_t iworkerCount) {
+    for (std::size_t i = 0; i < iworkerCount; i++) {
+      threads.push_back(std::thread(&ThreadWorkerPool::workerLoop, this));
+    }
+  }
+
+  virtual ~ThreadWorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    startCondition.notify_all();
+
+    for (auto &&thread : threads) {
+      thread.join();
+    }
+  }
+
+  void run(std::size_t icount, const std::function<void(std::size_t)> &itask) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      beginJob(icount, itask);
+      active = threads.size();
+      generation++;
+    }
+    startCondition.notify_all();
+
+    work();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCondition.wait(lock, [this]() { return active == 0; });
+  }
+
+  private:
+  void workerLoop() {
+    std::size_t seenGeneration = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        startCondition.wait(lock,
+                            [&]() { return stopping || generation != seenGeneration; });
+        if (stopping) {
+          return;
+        }
+        seenGeneration = generation;
+      }
+
+      work();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--active == 0) {
+        doneCondition.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable startCondition;
+  std::condition_variable doneCondition;
+  std::size_t generation{0};
+  std::size_t active{0};
+  bool stopping{false};
+};
+#elif defined(PLATFORM_ESP32)
+/**
+ * A WorkerPool backed by one FreeRTOS task pinned to the other core. The Arduino loop runs on
+ * core 1, so the worker defaults to core 0.
+ */
+class FreeRtosWorkerPool : public WorkerPool {
+  public:
+  /**
+   * @param icore The core to pin the worker task to.
+   * @param ipriority The priority of the worker task.
+   * @param istackSize The stack size of the worker task, in bytes.
+   */
+  FreeRtosWorkerPool(BaseType_t icore = 0,
+                     UBaseType_t ipriority = 1,
+                     std::uint32_t istackSize = 4096) {
+    start = xSemaphoreCreateBinary();
+    done = xSemaphoreCreateBinary();
+    xTaskCreatePinnedToCore(
+      &FreeRtosWorkerPool::taskEntry, "bowlerWorker", istackSize, this, ipriority, &task, icore);
+  }
+
+  virtual ~FreeRtosWorkerPool() {
+    vTaskDelete(task);
+    vSemaphoreDelete(start);
+    vSemaphoreDelete(done);
+  }
+
+  void run(std::size_t icount, const std::function<void(std::size_t)> &itask) override {
+    beginJob(icount, itask);
+    xSemaphoreGive(start);
+    work();
+    xSemaphoreTake(done, portMAX_DELAY);
+  }
+
+  private:
+  static void taskEntry(void *ipool) {
+    auto pool = static_cast<FreeRtosWorkerPool *>(ipool);
+    while (true) {
+      xSemaphoreTake(pool->start, portMAX_DELAY);
+      pool->work();
+      xSemaphoreGive(pool->done);
+    }
+  }
+
+  TaskHandle_t task;
+  SemaphoreHandle_t start;
+  SemaphoreHandle_t done;
+};
+#endif
+} // namespace bowlerserver
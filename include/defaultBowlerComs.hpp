@@ -19,13 +19,23 @@
 #include "bowlerComs.hpp"
 #include "bowlerDeviceServerUtil.hpp"
 #include "bowlerServer.hpp"
+#include "bowlerWorkerPool.hpp"
+#include "lzCodec.hpp"
+#include "packetTable.hpp"
 #include "serverManagementPacket.hpp"
-#include <map>
+#include <algorithm>
 
 namespace bowlerserver {
 /**
  * Buffer format is:
  * <ID (1 byte)> <Seq Num (1 byte)> <ACK num (1 byte)> <Payload (N bytes)>.
+ *
+ * The PC can switch to the wide header format (see HEADER_FORMAT_WIDE), which keeps the header
+ * length but carries 16-bit packet ids. Packets with ids above 255 are only reachable in the wide
+ * format.
+ *
+ * N is the longest frame. Packets can use shorter frames (see Packet::setFrameLength) on servers
+ * which carry frames of any length, such as UDP.
  */
 template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
   // The entire packet length must be at least the header length plus one payload byte
@@ -33,7 +43,12 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
                 "Packet length must be at least the header length plus one payload byte.");
 
   public:
-  DefaultBowlerComs(std::unique_ptr<BowlerServer<N>> iserver) : server(std::move(iserver)) {
+  DefaultBowlerComs(std::unique_ptr<BowlerServer<N>> iserver)
+    : server(std::move(iserver)),
+      frames(1),
+      batchPayloads(1),
+      groups(1),
+      runGroupTask([this](std::size_t igroup) { runGroup(groups[igroup]); }) {
     // Add the server management packet before anything else gets a chance
     addPacket(std::shared_ptr<ServerManagementPacket<N>>(new ServerManagementPacket<N>(this)));
   }
@@ -41,35 +56,92 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
   virtual ~DefaultBowlerComs() = default;
 
   void addEnsuredPacket(std::function<std::shared_ptr<Packet>(void)> iaddPacket) override {
-    ensuredPackets.push_back(iaddPacket);
+    ensuredPackets.push_back(EnsuredPacket{false, 0, std::move(iaddPacket)});
+  }
+
+  void addEnsuredPacket(std::uint16_t iid,
+                        std::function<std::shared_ptr<Packet>(void)> ifactory) override {
+    ensuredPackets.push_back(EnsuredPacket{true, iid, std::move(ifactory)});
   }
 
+  /**
+   * Adds every ensured packet at once, so only one new packet table is made however many there
+   * are. If any id is already used none are added.
+   *
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
   std::int32_t addEnsuredPackets() override {
+    std::vector<std::pair<std::uint16_t, std::shared_ptr<PacketSlot>>> slots;
+    slots.reserve(ensuredPackets.size());
     for (auto &&elem : ensuredPackets) {
-      if (addPacket(elem()) == BOWLER_ERROR) {
+      // Lazy packets only reserve their id; they are made when the first frame for them arrives
+      std::shared_ptr<Packet> packet = elem.isLazy ? nullptr : elem.factory();
+      if (!elem.isLazy && !packet) {
+        errno = EINVAL;
+        return BOWLER_ERROR;
+      }
+
+      const std::uint16_t id = elem.isLazy ? elem.id : packet->getId();
+      if (id == GROUP_PACKET_ID) {
+        // Reserved for group frames
+        errno = EINVAL;
         return BOWLER_ERROR;
       }
+
+      if (packet) {
+        // The factory may hand back a packet which was added before
+        packet->invalidateCache();
+      }
+
+      const auto factory = elem.isLazy ? elem.factory : nullptr;
+      slots.push_back(std::make_pair(
+        id,
+        std::shared_ptr<PacketSlot>(
+          new PacketSlot{std::move(packet), waitForZero, false, 0, 0, factory})));
+    }
+
+    if (!packets.insert(slots)) {
+      // A packet id is already used
+      errno = EINVAL;
+      return BOWLER_ERROR;
     }
 
     return 1;
   }
 
+  std::vector<std::uint16_t> getUnusedPacketIDs() override {
+    std::vector<std::uint16_t> ids;
+    packets.read([&ids](const PacketTable<PacketSlot> &itable) {
+      itable.forEach([&ids](std::uint16_t iid, PacketSlot &islot) {
+        if (!islot.packet) {
+          ids.push_back(iid);
+        }
+      });
+    });
+    return ids;
+  }
+
   /**
-   * Adds a packet event handler. The packet id cannot already be used.
+   * Adds a packet event handler. The packet id cannot already be used. Safe to call from any
+   * thread, including while loop() is running.
    *
    * @param ipacket The packet event handler.
    * @return `1` on success or BOWLER_ERROR on error.
    */
   std::int32_t addPacket(std::shared_ptr<Packet> ipacket) override {
-    if (packets.find(ipacket->getId()) == packets.end()) {
-      if (ipacket->isReliable()) {
-        // Initialize RDT state
-        reliableState[ipacket->getId()] = waitForZero;
-      }
+    const auto id = ipacket->getId();
+    if (id == GROUP_PACKET_ID) {
+      // Reserved for group frames
+      errno = EINVAL;
+      return BOWLER_ERROR;
+    }
 
-      // Save the packet last so we can `move` it
-      packets[ipacket->getId()] = std::move(ipacket);
-    } else {
+    // New packets start in the initial RDT state, without replies cached while they were added
+    // before
+    ipacket->invalidateCache();
+    std::shared_ptr<PacketSlot> slot(
+      new PacketSlot{std::move(ipacket), waitForZero, false, 0, 0, nullptr});
+    if (!packets.insert(id, std::move(slot))) {
       // The packet id is already used
       errno = EINVAL;
       return BOWLER_ERROR;
@@ -79,29 +151,322 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
   }
 
   /**
-   * Removes a packet event handler.
+   * Removes a packet event handler. Safe to call from any thread, including while loop() is
+   * running.
    *
    * @param iid The id of the packet.
    */
-  void removePacket(const std::uint8_t iid) override {
+  void removePacket(const std::uint16_t iid) override {
     packets.erase(iid);
   }
 
+  void removePackets(const std::vector<std::uint16_t> &iids) override {
+    packets.erase(iids);
+  }
+
+  /**
+   * @param iid The id of the packet.
+   * @return The packet event handler, or `nullptr` if there is none for that id.
+   */
+  std::shared_ptr<Packet> getPacket(const std::uint16_t iid) override {
+    std::shared_ptr<Packet> packet;
+    packets.read([&](const PacketTable<PacketSlot> &itable) {
+      auto slot = itable.find(iid);
+      if (slot != nullptr) {
+        packet = slot->packet;
+      }
+    });
+    return packet;
+  }
+
   /**
    * @return Every attached packet id. Does not return the SERVER_MANAGEMENT_PACKET_ID.
    */
-  std::vector<std::uint8_t> getAllPacketIDs() override {
-    std::vector<std::uint8_t> ids;
-    ids.reserve(packets.size() - 1); // Minus 1 for the management packet
+  std::vector<std::uint16_t> getAllPacketIDs() override {
+    std::vector<std::uint16_t> ids;
+    packets.read([&ids](const PacketTable<PacketSlot> &itable) {
+      ids.reserve(itable.size() - 1); // Minus 1 for the management packet
+
+      itable.forEach([&ids](std::uint16_t iid, PacketSlot &) {
+        // Don't return the server management packet
+        if (iid != SERVER_MANAGEMENT_PACKET_ID) {
+          ids.push_back(iid);
+        }
+      });
+    });
+
+    return ids;
+  }
+
+  /**
+   * Puts every reliable packet back into its starting RDT state and refills every rate limit
+   * bucket without touching the packet event handlers. Must be called from the thread running
+   * loop(), e.g. by a packet event.
+   */
+  void resetReliableState() override {
+    packets.read([](const PacketTable<PacketSlot> &itable) {
+      itable.forEach([](std::uint16_t, PacketSlot &islot) {
+        islot.state = waitForZero;
+        islot.hasRateCredit = false;
+      });
+    });
+  }
+
+  /**
+   * Switches the header format. Takes effect after the reply to the frame currently being handled
+   * has been written, so that reply still uses the old format.
+   *
+   * @param iformat HEADER_FORMAT_LEGACY or HEADER_FORMAT_WIDE.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t setHeaderFormat(std::uint8_t iformat) override {
+    if (iformat != HEADER_FORMAT_LEGACY && iformat != HEADER_FORMAT_WIDE) {
+      errno = EINVAL;
+      return BOWLER_ERROR;
+    }
+
+    pendingHeaderFormat = iformat;
+    return 1;
+  }
+
+  /**
+   * Sets which slice of group frames (see GROUP_PACKET_ID) this device handles.
+   *
+   * @param iindex The group index, or GROUP_INDEX_NONE to ignore group frames.
+   */
+  void setGroupIndex(std::uint16_t iindex) override {
+    groupIndex = iindex;
+  }
+
+  /**
+   * Starts recording the last frames handled by the coms. Any previous trace is discarded.
+   *
+   * @param icapacity The number of frames to keep.
+   */
+  void enableFrameTrace(std::size_t icapacity) {
+    frameTrace.reset(new FrameTrace(icapacity));
+  }
+
+  /**
+   * @return The frame trace, or `nullptr` if tracing is not enabled.
+   */
+  FrameTrace *getFrameTrace() override {
+    return frameTrace.get();
+  }
+
+  /**
+   * Starts keeping loop health histograms, which whatever runs the coms (e.g.
+   * BowlerComsController) fills in and the PC reads with OPERATION_READ_LOOP_HEALTH. Any previous
+   * histograms are discarded.
+   *
+   * @param itargetPeriod The loop period to count overruns against in microseconds, or `0` for
+   * none.
+   */
+  void enableLoopHealth(time_t itargetPeriod) {
+    loopHealth.reset(new LoopHealth(itargetPeriod));
+  }
+
+  LoopHealth *getLoopHealth() override {
+    return loopHealth.get();
+  }
+
+  /**
+   * Starts watching for the PC going quiet. The link is lost once `iinterval * imissedBeats`
+   * microseconds pass without a frame, which loop() checks after reading and
+   * BowlerComsController checks every loop (even while Wi-Fi is down). The PC keeps the link up
+   * with OPERATION_HEARTBEAT when it has nothing else to send. Any previous monitor and its
+   * failsafes are discarded.
+   *
+   * @param iinterval The heartbeat interval the PC keeps in microseconds.
+   * @param imissedBeats The number of intervals without a frame after which the link is lost.
+   * @return The monitor, to add failsafes to.
+   */
+  LinkMonitor &enableLinkMonitor(time_t iinterval, std::uint32_t imissedBeats) {
+    linkMonitor.reset(new LinkMonitor(iinterval, imissedBeats));
+    return *linkMonitor;
+  }
+
+  LinkMonitor *getLinkMonitor() override {
+    return linkMonitor.get();
+  }
 
-    for (auto &&elem : packets) {
-      // Don't return the server management packet
-      if (elem.first != SERVER_MANAGEMENT_PACKET_ID) {
-        ids.push_back(elem.first);
+  /**
+   * Starts or stops measuring the peak stack depth of loop() with StackProbe. Each iteration
+   * then paints STACK_PROBE_LENGTH bytes of stack, so leave it off unless sizing the stack.
+   *
+   * @param ienabled Whether to measure.
+   */
+  void enableStackProbe(bool ienabled) {
+    isStackProbeEnabled = ienabled;
+  }
+
+  MemoryStats getMemoryStats() override {
+    std::size_t heapBytes = packets.getHeapBytes() + frames.capacity() * sizeof(PendingFrame) +
+                            batchPayloads.capacity() * sizeof(std::uint8_t *) +
+                            groups.capacity() * sizeof(EventGroup) +
+                            ensuredPackets.capacity() * sizeof(ensuredPackets[0]) +
+                            scheduledCommands.capacity() * sizeof(ScheduledCommand) +
+                            replyCache.capacity() * sizeof(CachedReply) +
+                            (scheduleHeap.capacity() + freeCommands.capacity()) *
+                              sizeof(std::size_t);
+    if (frameTrace) {
+      heapBytes += frameTrace->getHeapBytes();
+    }
+    if (loopHealth) {
+      heapBytes += sizeof(LoopHealth);
+    }
+    if (linkMonitor) {
+      heapBytes += sizeof(LinkMonitor);
+    }
+
+    MemoryStats stats;
+    stats.heapBytes = static_cast<std::uint32_t>(heapBytes);
+    stats.stackPeak = static_cast<std::uint32_t>(stackPeak);
+    stats.freeHeap = static_cast<std::uint32_t>(getFreeHeap());
+    stats.largestFreeBlock = static_cast<std::uint32_t>(getLargestFreeBlock());
+    stats.stackHeadroom = static_cast<std::uint32_t>(getStackHeadroom());
+    stats.flags = isStackSaturated ? MEMORY_STATS_STACK_SATURATED : 0;
+    return stats;
+  }
+
+  void resetStackPeak() override {
+    stackPeak = 0;
+    isStackSaturated = false;
+  }
+
+  /**
+   * @return The time the frame currently being handled was read from the server.
+   */
+  time_t getLastReceiveTime() const override {
+    return lastReceiveTime;
+  }
+
+  /**
+   * Makes room for the commands of scheduled packets (see Packet::setScheduled) to wait until
+   * they are due. The buffers are allocated here, not in loop(). Any waiting commands are dropped.
+   *
+   * @param icapacity The most commands that can wait at once. Defaults to 0, which rejects every
+   * scheduled command.
+   */
+  void enableScheduledCommands(std::size_t icapacity) {
+    scheduledCommands.clear();
+    scheduledCommands.resize(icapacity);
+    scheduleHeap.clear();
+    scheduleHeap.reserve(icapacity);
+    freeCommands.clear();
+    freeCommands.reserve(icapacity);
+    for (std::size_t i = 0; i < icapacity; i++) {
+      freeCommands.push_back(icapacity - 1 - i);
+    }
+  }
+
+  /**
+   * Runs the events of the scheduled commands which are due, earliest first (and in the order they
+   * arrived for the same time). loop() calls this first, but whatever runs the coms should also
+   * call it between iterations as often as it can so commands run close to their time;
+   * BowlerComsController calls it every loop. Must be called from the thread running loop().
+   *
+   * @param inow The current time.
+   */
+  void runScheduledCommands(time_t inow) {
+    while (!scheduleHeap.empty()) {
+      const std::size_t index = scheduleHeap.front();
+      ScheduledCommand &command = scheduledCommands[index];
+      if (static_cast<std::int32_t>(command.executeAt - inow) > 0) {
+        break;
       }
+
+      std::pop_heap(scheduleHeap.begin(), scheduleHeap.end(), ScheduleOrder{scheduledCommands});
+      scheduleHeap.pop_back();
+      logEventError(command.packet->event(command.payload.data()));
+      command.packet.reset();
+      freeCommands.push_back(index);
     }
+  }
 
-    return ids;
+  void clearScheduledCommands() override {
+    for (auto &&index : scheduleHeap) {
+      scheduledCommands[index].packet.reset();
+      freeCommands.push_back(index);
+    }
+    scheduleHeap.clear();
+  }
+
+  /**
+   * @return The number of scheduled commands waiting to run.
+   */
+  std::size_t getScheduledCommandCount() const {
+    return scheduleHeap.size();
+  }
+
+  /**
+   * Makes room to cache the replies of idempotent packets (see Packet::setIdempotent), so a
+   * request with the same payload as an earlier one is answered without calling the event. The
+   * entries are allocated here, not in loop(), and the oldest is reused when they are all taken.
+   * Any cached replies are dropped.
+   *
+   * @param icapacity The most replies to cache. Defaults to 0, which caches nothing.
+   */
+  void enableReplyCache(std::size_t icapacity) {
+    replyCache.clear();
+    replyCache.resize(icapacity);
+    nextCacheEntry = 0;
+  }
+
+  /**
+   * Drops every cached reply. Use Packet::invalidateCache to drop one packet's replies from any
+   * thread; this must be called from the thread running loop().
+   */
+  void clearReplyCache() {
+    for (auto &&entry : replyCache) {
+      entry.isValid = false;
+      entry.packet.reset();
+    }
+  }
+
+  /**
+   * @return The number of requests answered from the reply cache.
+   */
+  std::uint32_t getReplyCacheHits() const {
+    return replyCacheHits;
+  }
+
+  /**
+   * Sets how many frames one iteration of coms may read before handling them. Frames for the same
+   * unreliable packet read in one iteration are handed to Packet::eventBatch together, and frames
+   * for higher priority packets (see Packet::setPriority) are handled first. The frame buffers are
+   * allocated here, not in loop().
+   *
+   * @param ilimit The maximum number of frames per iteration. Defaults to 1.
+   */
+  void setDrainLimit(std::size_t ilimit) {
+    frames.resize(std::max<std::size_t>(ilimit, 1));
+    batchPayloads.resize(frames.size());
+    groups.resize(frames.size());
+  }
+
+  /**
+   * Sets how long an iteration of coms may take from its start to each reply, which covers
+   * reading the frames and running their packet events. Replies sent later than that have
+   * HEADER_BUSY_BIT set so the PC can back off.
+   *
+   * @param ibudget The budget in microseconds, or `0` to never signal busy. Defaults to 0.
+   */
+  void setLoopBudget(time_t ibudget) {
+    loopBudget = ibudget;
+  }
+
+  /**
+   * Runs the packet events for different packets in parallel on a worker pool. Frames for the
+   * same packet still run in order on one worker, and replies are still written in order by the
+   * thread calling loop(), so RDT is unaffected. Packets that share state with each other must
+   * synchronize it themselves. Only frames read in the same iteration of coms can overlap, so
+   * this needs a drain limit above 1.
+   *
+   * @param ipool The worker pool, or `nullptr` to run every packet event on the calling thread.
+   */
+  void setWorkerPool(std::unique_ptr<WorkerPool> ipool) {
+    workerPool = std::move(ipool);
   }
 
   /**
@@ -110,172 +475,996 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
    * @return `1` on success or BOWLER_ERROR on error.
    */
   std::int32_t loop() override {
-    bool isDataAvailable;
-    std::int32_t error = server->isDataAvailable(isDataAvailable);
-    if (error != BOWLER_ERROR) {
-      if (isDataAvailable) {
-        std::array<std::uint8_t, N> data;
-
-        std::int32_t error = server->read(data);
-        if (error != BOWLER_ERROR) {
-          auto id = getPacketId(data);
-          auto packet = packets.find(id);
-          if (packet == packets.end()) {
-            BOWLER_LOG("Packet with id %u was not found.\n", id);
-
-            // The corresponding packet was not found, meaning there is no handler registered for
-            // it. Clear the payload and reply.
-            std::fill(std::next(data.begin(), HEADER_LENGTH), data.end(), 0);
-
-            auto writeError = server->write(data);
-            if (writeError == BOWLER_ERROR) {
-              BOWLER_LOG(
-                "Error while replying to unregistered packet: %d %s\n", errno, strerror(errno));
-            }
-
-            errno = ENODEV;
-            return BOWLER_ERROR;
-          } else {
-            // The packet handler was found
-            if (packet->second->isReliable()) {
-              handlePacketReliable(packet, data);
-            } else {
-              handlePacketUnreliable(packet, data);
-            }
-          }
-        } else {
-          // Error reading data
-          BOWLER_LOG("Error reading: %d %s\n", errno, strerror(errno));
+    if (!isStackProbeEnabled) {
+      return runIteration();
+    }
+
+    stackProbe.paint();
+    const std::int32_t result = runIteration();
+    bool saturated;
+    const std::size_t depth = stackProbe.measure(saturated);
+    if (depth > stackPeak || (depth == stackPeak && saturated)) {
+      stackPeak = depth;
+      isStackSaturated = saturated;
+    }
+    return result;
+  }
+
+  protected:
+  enum states_t { waitForZero, waitForOne };
+
+  // Token bucket credit for one frame
+  static const std::uint64_t RATE_CREDIT_PER_FRAME = 1000000;
+  // PendingFrame::cacheEntry of a frame whose reply is not cached
+  static const std::size_t NO_CACHE_ENTRY = SIZE_MAX;
+
+  /**
+   * Runs an iteration of coms.
+   *
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t runIteration() {
+    const time_t now = getTime();
+    loopStart = now;
+
+    runScheduledCommands(now);
+
+    const std::size_t count = readFrames();
+    if (linkMonitor) {
+      linkMonitor->check(getTime());
+    }
+
+    if (count == 0) {
+      packets.quiescent();
+      return 1;
+    }
+
+    // Dispatch from one snapshot of the packets. Packets added or removed meanwhile (from any
+    // thread) are seen on the next iteration, and removed ones stay alive until this one ends.
+    activePackets = &packets.acquire();
+
+    // A server management frame always ends the drain because it can change the packets. Finish
+    // the frames before it so they are handled before any change it makes.
+    const std::size_t managementStart = frames[count - 1].isManagement ? count - 1 : count;
+    bool allFound = handleFrames(0, managementStart);
+    allFound = handleFrames(managementStart, count) && allFound;
+
+    activePackets = nullptr;
+    packets.quiescent();
+
+    if (server->flush() == BOWLER_ERROR) {
+      BOWLER_LOG("Error flushing: %d %s\n", errno, strerror(errno));
+    }
+
+    if (!allFound) {
+      errno = ENODEV;
+      return BOWLER_ERROR;
+    }
+
+    return 1;
+  }
+
+  /**
+   * A factory given to addEnsuredPacket.
+   */
+  struct EnsuredPacket {
+    bool isLazy;
+    // The id the factory makes a packet for, if it is lazy
+    std::uint16_t id;
+    std::function<std::shared_ptr<Packet>(void)> factory;
+  };
+
+  /**
+   * A packet event handler and its RDT state.
+   */
+  struct PacketSlot {
+    // `nullptr` until the factory runs if the packet is made lazily
+    std::shared_ptr<Packet> packet;
+    states_t state;
+    // Token bucket for Packet::setRateLimit, in millionths of a frame
+    bool hasRateCredit;
+    std::uint64_t rateCredit;
+    time_t rateRefillTime;
+    std::function<std::shared_ptr<Packet>(void)> factory;
+  };
+
+  /**
+   * Looks up the slot for a packet id, making the packet first if it is lazy and not made yet.
+   *
+   * @param iid The id.
+   * @return The slot, or `nullptr` if there is no packet for the id.
+   */
+  PacketSlot *findSlot(std::uint16_t iid) {
+    PacketSlot *slot = activePackets->find(iid);
+    if (slot == nullptr || slot->packet) {
+      return slot;
+    }
+
+    std::shared_ptr<Packet> packet = slot->factory();
+    if (!packet || packet->getId() != iid) {
+      BOWLER_LOG("The factory for packet %u did not make it.\n", iid);
+      return nullptr;
+    }
+    packet->invalidateCache();
+
+    std::shared_ptr<PacketSlot> made(
+      new PacketSlot{std::move(packet), waitForZero, false, 0, 0, nullptr});
+    PacketSlot *madePointer = made.get();
+    if (!packets.replace(iid, slot, std::move(made))) {
+      // Removed since this iteration started
+      return nullptr;
+    }
+
+    // Switch to the table with the made packet so later frames use it too. Slots from the old
+    // table stay alive until this iteration ends.
+    activePackets = &packets.acquire();
+    return madePointer;
+  }
+
+  /**
+   * A frame read during the current iteration of coms.
+   */
+  struct PendingFrame {
+    std::array<std::uint8_t, N> data;
+    // The length of the frame on the wire
+    std::size_t length;
+    time_t receiveTime;
+    // Where the server should send the reply
+    std::uint64_t replyTarget;
+    bool isManagement;
+    // `nullptr` if there is no handler for the frame
+    PacketSlot *slot;
+    // The PRIORITY_* class of the frame's packet
+    std::uint8_t priority;
+    // Whether the packet event should run. False for out-of-order reliable frames.
+    bool runEvent;
+    // The STATUS_* code the frame was dropped with, or `0` if it was not
+    std::uint8_t rejectStatus;
+    // Whether the frame is a group frame, and its handler id and flags if so
+    bool isGroupFrame;
+    std::uint16_t groupHandlerId;
+    std::uint8_t groupFlags;
+    bool isGrouped;
+    // Whether the frame's command was queued to run later
+    bool isScheduled;
+    // Whether the reply came from the reply cache
+    bool isCached;
+    // The reply cache entry to store the reply in and the claim on it, or NO_CACHE_ENTRY
+    std::size_t cacheEntry;
+    std::uint32_t cacheClaim;
+    std::int32_t eventError;
+  };
+
+  /**
+   * A cached reply of an idempotent packet, keyed by the packet, its cache generation and the
+   * request payload.
+   */
+  struct CachedReply {
+    std::weak_ptr<Packet> packet;
+    std::uint32_t generation{0};
+    std::array<std::uint8_t, N - HEADER_LENGTH> request;
+    std::array<std::uint8_t, N - HEADER_LENGTH> reply;
+    time_t storedAt{0};
+    // The frame which claimed the entry last, so only its reply is stored
+    std::uint32_t claim{0};
+    // False until the reply is stored
+    bool isValid{false};
+  };
+
+  /**
+   * A command waiting for its time to run.
+   */
+  struct ScheduledCommand {
+    // The payload after the execute at time
+    std::array<std::uint8_t, N - HEADER_LENGTH> payload;
+    std::shared_ptr<Packet> packet;
+    time_t executeAt;
+    // Keeps commands for the same time in the order they arrived
+    std::uint32_t order;
+  };
+
+  /**
+   * Orders scheduleHeap so the earliest command is at the front.
+   */
+  struct ScheduleOrder {
+    bool operator()(std::size_t ia, std::size_t ib) const {
+      const ScheduledCommand &a = commands[ia];
+      const ScheduledCommand &b = commands[ib];
+      if (a.executeAt != b.executeAt) {
+        return static_cast<std::int32_t>(a.executeAt - b.executeAt) > 0;
+      }
+      return static_cast<std::int32_t>(a.order - b.order) > 0;
+    }
+
+    const std::vector<ScheduledCommand> &commands;
+  };
+
+  /**
+   * The frames for one packet in a range of frames.
+   */
+  struct EventGroup {
+    // The index of the first frame for the packet
+    std::size_t first;
+    // One past the index of the last frame in the range
+    std::size_t end;
+    // Where the group's payload pointers start in batchPayloads
+    std::size_t payloadOffset;
+  };
+
+  /**
+   * Reads frames from the server until there are none left, the drain limit is reached, or a
+   * server management frame is read.
+   *
+   * @return The number of frames read.
+   */
+  std::size_t readFrames() {
+    std::size_t count = 0;
+    while (count < frames.size()) {
+      bool isDataAvailable;
+      if (server->isDataAvailable(isDataAvailable) == BOWLER_ERROR) {
+        // Error running isDataAvailable. EWOULDBLOCK is typical of having no data (not really an
+        // error).
+        if (errno != EWOULDBLOCK) {
+          BOWLER_LOG("Error peeking: %d %s\n", errno, strerror(errno));
         }
+        break;
       }
-    } else {
-      // Error running isDataAvailable. EWOULDBLOCK is typical of having no data (not really an
-      // error).
-      if (errno != EWOULDBLOCK) {
-        BOWLER_LOG("Error peeking: %d %s\n", errno, strerror(errno));
+
+      if (!isDataAvailable) {
+        break;
+      }
+
+      PendingFrame &frame = frames[count];
+      if (server->readFrame(frame.data, frame.length) == BOWLER_ERROR) {
+        // Error reading data
+        BOWLER_LOG("Error reading: %d %s\n", errno, strerror(errno));
+        break;
+      }
+
+      lastReceiveTime = getTime();
+      frame.receiveTime = lastReceiveTime;
+      if (linkMonitor) {
+        linkMonitor->heard(lastReceiveTime);
+      }
+      frame.replyTarget = server->getReplyTarget();
+      traceFrame(FRAME_TRACE_RX, frame.data, frame.length, FRAME_TRACE_RECEIVED);
+      count++;
+
+      frame.isManagement = getPacketId(frame.data) == SERVER_MANAGEMENT_PACKET_ID;
+      if (frame.isManagement) {
+        break;
       }
     }
 
-    return 1;
+    return count;
   }
 
-  protected:
   /**
-   * Handles a packet for unreliable transport.
+   * Handles a range of the frames read during this iteration and writes their replies in order.
    *
-   * @param idata Data that was just read from the receive buffer.
+   * @param ibegin The index of the first frame.
+   * @param iend One past the index of the last frame.
+   * @return False if any frame had no handler.
    */
-  template <typename T>
-  void handlePacketUnreliable(T &ipacket, std::array<std::uint8_t, N> &idata) {
-    auto error = ipacket->second->event(idata.data() + HEADER_LENGTH);
-    if (error == BOWLER_ERROR) {
-      BOWLER_LOG("Error handling packet event: %d %s\n", errno, strerror(errno));
+  bool handleFrames(std::size_t ibegin, std::size_t iend) {
+    bool allFound = true;
+    for (std::size_t i = ibegin; i < iend; i++) {
+      allFound = findHandler(frames[i]) && allFound;
     }
 
-    error = server->write(idata);
-    if (error == BOWLER_ERROR) {
-      BOWLER_LOG("Error writing: %d %s\n", errno, strerror(errno));
+    sortByPriority(ibegin, iend);
+
+    // Handle each priority class completely before the next, so lower classes wait for the
+    // replies of higher ones and not the other way around
+    std::size_t classBegin = ibegin;
+    while (classBegin < iend) {
+      std::size_t classEnd = classBegin + 1;
+      while (classEnd < iend && frames[classEnd].priority == frames[classBegin].priority) {
+        classEnd++;
+      }
+
+      for (std::size_t i = classBegin; i < classEnd; i++) {
+        admitFrame(frames[i]);
+      }
+
+      runEvents(classBegin, classEnd);
+
+      for (std::size_t i = classBegin; i < classEnd; i++) {
+        replyToFrame(frames[i]);
+      }
+
+      classBegin = classEnd;
     }
+
+    return allFound;
   }
 
   /**
-   * Handles a packet for reliable transport.
+   * Finds the handler for a frame.
    *
-   * @param idata Data that was just read from the receive buffer.
+   * @param iframe The frame.
+   * @return False if there is no handler for the frame.
    */
-  template <typename T> void handlePacketReliable(T &ipacket, std::array<std::uint8_t, N> &idata) {
-    states_t &state = reliableState[ipacket->first];
-    switch (state) {
-    case waitForZero: {
-      if (getSeqNum(idata) == 0) {
-        // Right payload. Handle it.
-        const auto eventError = ipacket->second->event(idata.data() + HEADER_LENGTH);
-        if (eventError == BOWLER_ERROR) {
-          BOWLER_LOG("Error handling packet event: %d %s\n", errno, strerror(errno));
-        }
+  bool findHandler(PendingFrame &iframe) {
+    auto id = getPacketId(iframe.data);
+    iframe.slot = id == GROUP_PACKET_ID ? nullptr : findSlot(id);
+    iframe.runEvent = false;
+    iframe.isGrouped = false;
+    iframe.isScheduled = false;
+    iframe.isCached = false;
+    iframe.cacheEntry = NO_CACHE_ENTRY;
+    iframe.rejectStatus = 0;
+    iframe.eventError = 1;
 
-        // ACK it and start waiting for the next packet.
-        setAckNum(idata, 0);
-        auto error = server->write(idata);
-        if (error == BOWLER_ERROR) {
-          BOWLER_LOG("Error writing: %d %s\n", errno, strerror(errno));
-        }
+    iframe.isGroupFrame = id == GROUP_PACKET_ID;
+    if (iframe.isGroupFrame) {
+      findGroupHandler(iframe);
+      return true;
+    }
 
-        if (ipacket->first == SERVER_MANAGEMENT_PACKET_ID && eventError == 2) {
-          // The server management packet processed a disconnection, so force the state into the
-          // starting state
-          state = waitForZero;
-        } else {
-          state = waitForOne;
-        }
-      } else {
-        // Wrong packet. Clear the payload and ACK 1.
-        std::fill(std::next(idata.begin(), HEADER_LENGTH), idata.end(), 0);
-        setAckNum(idata, 1);
-        auto error = server->write(idata);
-        if (error == BOWLER_ERROR) {
-          BOWLER_LOG("Error writing: %d %s\n", errno, strerror(errno));
-        }
+    if (iframe.slot == nullptr) {
+      BOWLER_LOG("Packet with id %u was not found.\n", id);
+
+      // The corresponding packet was not found, meaning there is no handler registered for it.
+      // Clear the payload so the reply is empty.
+      std::fill(std::next(iframe.data.begin(), HEADER_LENGTH), iframe.data.end(), 0);
+      iframe.priority = PRIORITY_NORMAL;
+      return false;
+    }
+
+    // Whatever the PC sent past the packet's frame size class is not for the packet
+    const std::size_t frameLength = getFrameLength(*iframe.slot->packet);
+    std::fill(std::next(iframe.data.begin(), frameLength), iframe.data.end(), 0);
+    iframe.priority = iframe.slot->packet->getPriority();
+
+    if ((iframe.data.at(HEADER_LENGTH - 1) & HEADER_COMPRESSED_BIT) &&
+        !decompressFrame(iframe, frameLength)) {
+      BOWLER_LOG("Dropping badly compressed frame for packet %u.\n", id);
+      // admitFrame turns it into a status reply
+      iframe.rejectStatus = STATUS_REJECTED_GENERIC;
+    }
+    return true;
+  }
+
+  /**
+   * Decompresses the payload of a frame the PC compressed, in place, and clears
+   * HEADER_COMPRESSED_BIT.
+   *
+   * @param iframe The frame.
+   * @param iframeLength The length of the packet's frames.
+   * @return False if the packet does not take compressed frames or the payload is malformed.
+   */
+  bool decompressFrame(PendingFrame &iframe, std::size_t iframeLength) {
+    iframe.data.at(HEADER_LENGTH - 1) &= ~HEADER_COMPRESSED_BIT;
+    if (!iframe.slot->packet->isCompressed() || iframe.length < HEADER_LENGTH) {
+      return false;
+    }
+
+    const std::size_t payloadLength = iframeLength - HEADER_LENGTH;
+    const std::size_t available = std::min(iframe.length, iframeLength) - HEADER_LENGTH;
+    std::uint8_t *payload = iframe.data.data() + HEADER_LENGTH;
+    if (!LzCodec::decompress(payload, available, codecBuffer.data(), payloadLength)) {
+      return false;
+    }
+
+    std::copy(codecBuffer.begin(), codecBuffer.begin() + payloadLength, payload);
+    return true;
+  }
+
+  /**
+   * Compresses the payload of a reply, in place, if the packet allows it and it gets shorter.
+   *
+   * @param ipacket The packet the reply is from.
+   * @param idata The reply.
+   * @param ilength The length of the reply.
+   * @return The new length of the reply.
+   */
+  std::size_t
+  compressFrame(const Packet &ipacket, std::array<std::uint8_t, N> &idata, std::size_t ilength) {
+    if (!ipacket.isCompressed() || ilength <= HEADER_LENGTH + 1) {
+      return ilength;
+    }
+
+    std::uint8_t *payload = idata.data() + HEADER_LENGTH;
+    const std::size_t payloadLength = ilength - HEADER_LENGTH;
+    const std::size_t compressedLength =
+      codec.compress(payload, payloadLength, codecBuffer.data(), payloadLength - 1);
+    if (compressedLength == 0) {
+      // Not compressible, so send it as it is
+      return ilength;
+    }
+
+    std::copy(codecBuffer.begin(), codecBuffer.begin() + compressedLength, payload);
+    std::fill(payload + compressedLength, payload + payloadLength, 0);
+    idata.at(HEADER_LENGTH - 1) |= HEADER_COMPRESSED_BIT;
+    return HEADER_LENGTH + compressedLength;
+  }
+
+  /**
+   * @param ipacket A packet.
+   * @return The length of the packet's frames (see Packet::setFrameLength).
+   */
+  static std::size_t getFrameLength(const Packet &ipacket) {
+    return HEADER_LENGTH + ipacket.getPayloadLength<N>();
+  }
+
+  /**
+   * Finds the handler for a group frame and moves this device's slice to the start of the
+   * payload, so the packet event sees it like any other payload. Leaves the frame without a
+   * handler if it does not address this device; such frames are ignored.
+   *
+   * @param iframe The group frame.
+   */
+  void findGroupHandler(PendingFrame &iframe) {
+    iframe.slot = nullptr;
+    iframe.priority = PRIORITY_NORMAL;
+
+    std::uint8_t *payload = iframe.data.data() + HEADER_LENGTH;
+    iframe.groupHandlerId = readLittleEndian<std::uint16_t>(payload);
+    const std::size_t sliceLength = payload[2];
+    const std::size_t sliceCount = payload[3];
+    iframe.groupFlags = payload[4];
+    const std::size_t sliceOffset = GROUP_HEADER_LENGTH + std::size_t(groupIndex) * sliceLength;
+    if (groupIndex >= sliceCount || sliceLength == 0 ||
+        sliceOffset + sliceLength > N - HEADER_LENGTH) {
+      return;
+    }
+
+    // Only unreliable packets take group frames because their RDT state is per device
+    PacketSlot *slot = findSlot(iframe.groupHandlerId);
+    if (slot == nullptr || slot->packet->isReliable()) {
+      return;
+    }
+
+    std::copy(payload + sliceOffset, payload + sliceOffset + sliceLength, payload);
+    std::fill(payload + sliceLength, iframe.data.data() + N, 0);
+    iframe.slot = slot;
+    iframe.priority = slot->packet->getPriority();
+  }
+
+  /**
+   * Stable sorts a range of frames from the highest priority class to the lowest. Frames for the
+   * same packet keep their order. Sorts in place because the range is only ever a few frames.
+   *
+   * @param ibegin The index of the first frame.
+   * @param iend One past the index of the last frame.
+   */
+  void sortByPriority(std::size_t ibegin, std::size_t iend) {
+    for (std::size_t i = ibegin + 1; i < iend; i++) {
+      std::size_t j = i;
+      while (j > ibegin && frames[j - 1].priority < frames[i].priority) {
+        j--;
       }
+
+      if (j != i) {
+        std::rotate(std::next(frames.begin(), j),
+                    std::next(frames.begin(), i),
+                    std::next(frames.begin(), i + 1));
+      }
+    }
+  }
+
+  /**
+   * Decides whether a frame's packet event runs: drops frames over their packet's rate limit or
+   * past its deadline and runs the RDT receiver for reliable packets.
+   *
+   * @param iframe The frame.
+   */
+  void admitFrame(PendingFrame &iframe) {
+    if (iframe.slot == nullptr) {
+      return;
+    }
+
+    if (iframe.rejectStatus != 0) {
+      // Already rejected when its handler was found
+      rejectFrame(iframe, iframe.rejectStatus);
+      return;
+    }
+
+    const std::shared_ptr<Packet> &packet = iframe.slot->packet;
+    if (!takeRateToken(*iframe.slot)) {
+      BOWLER_LOG("Dropping rate limited frame for packet %u.\n", packet->getId());
+      rejectFrame(iframe, STATUS_RATE_LIMITED);
+      return;
+    }
+
+    const time_t deadline = packet->getDeadline();
+    if (iframe.priority < PRIORITY_HIGH && deadline != 0 &&
+        getTime() - iframe.receiveTime > deadline) {
+      BOWLER_LOG("Dropping expired frame for packet %u.\n", packet->getId());
+      rejectFrame(iframe, STATUS_EXPIRED);
+      return;
+    }
+
+    if (packet->isScheduled() && freeCommands.empty()) {
+      BOWLER_LOG("Dropping scheduled frame for packet %u, schedule is full.\n", packet->getId());
+      rejectFrame(iframe, STATUS_SCHEDULE_FULL);
+      return;
+    }
+
+    if (!packet->isReliable()) {
+      iframe.runEvent = true;
+      scheduleFrame(iframe);
+      lookUpCachedReply(iframe);
+      return;
+    }
+
+    states_t &state = iframe.slot->state;
+    const std::uint8_t expectedSeqNum = state == waitForZero ? 0 : 1;
+    const std::uint8_t seqNum = getSeqNum(iframe.data);
+    if (seqNum == expectedSeqNum || resetsSession(iframe)) {
+      // Right payload. ACK it and start waiting for the next packet.
+      setAckNum(iframe.data, seqNum);
+      state = seqNum == 0 ? waitForOne : waitForZero;
+      iframe.runEvent = true;
+      scheduleFrame(iframe);
+      lookUpCachedReply(iframe);
+    } else {
+      // Wrong packet. Clear the payload and ACK the Seq Num we got.
+      std::fill(std::next(iframe.data.begin(), HEADER_LENGTH), iframe.data.end(), 0);
+      setAckNum(iframe.data, 1 - expectedSeqNum);
+    }
+  }
+
+  /**
+   * Checks whether a frame is a server management operation which puts RDT state back into the
+   * starting state. These run whatever Seq Num they come with, because a reconnecting PC cannot
+   * know which state the last PC left the management packet in.
+   *
+   * @param iframe The frame.
+   * @return True if the frame is a disconnect or a session resume.
+   */
+  static bool resetsSession(const PendingFrame &iframe) {
+    const std::uint8_t operation = iframe.data.at(HEADER_LENGTH);
+    return iframe.isManagement &&
+           (operation == OPERATION_DISCONNECT_ID || operation == OPERATION_RESUME_SESSION);
+  }
+
+  /**
+   * Takes a token from a packet's rate limit bucket, refilling it for the time since the last
+   * frame first.
+   *
+   * @param islot The packet's slot.
+   * @return False if the packet is over its rate limit.
+   */
+  static bool takeRateToken(PacketSlot &islot) {
+    const std::uint32_t rateLimit = islot.packet->getRateLimit();
+    if (rateLimit == 0) {
+      return true;
+    }
+
+    const std::uint64_t capacity =
+      static_cast<std::uint64_t>(islot.packet->getRateBurst()) * RATE_CREDIT_PER_FRAME;
+    const time_t now = getTime();
+    if (!islot.hasRateCredit) {
+      // Start with a full bucket
+      islot.hasRateCredit = true;
+      islot.rateCredit = capacity;
+    } else {
+      const std::uint64_t elapsed = static_cast<std::uint64_t>(now - islot.rateRefillTime);
+      islot.rateCredit = std::min(capacity, islot.rateCredit + elapsed * rateLimit);
+    }
+    islot.rateRefillTime = now;
+
+    if (islot.rateCredit < RATE_CREDIT_PER_FRAME) {
+      return false;
+    }
+
+    islot.rateCredit -= RATE_CREDIT_PER_FRAME;
+    return true;
+  }
+
+  /**
+   * Queues the command in an admitted frame for a scheduled packet instead of running its event
+   * now, and turns the frame into a status reply. Does nothing for other packets. There must be a
+   * free command.
+   *
+   * @param iframe The frame.
+   */
+  void scheduleFrame(PendingFrame &iframe) {
+    const std::shared_ptr<Packet> &packet = iframe.slot->packet;
+    if (!packet->isScheduled()) {
+      return;
+    }
+
+    const std::size_t index = freeCommands.back();
+    freeCommands.pop_back();
+    ScheduledCommand &command = scheduledCommands[index];
+
+    // The PC sends the low 32 bits of the time, which is never far from now
+    std::uint8_t *payload = iframe.data.data() + HEADER_LENGTH;
+    const time_t now = getTime();
+    const std::uint32_t executeAt = readLittleEndian<std::uint32_t>(payload);
+    const std::uint32_t nowLow = static_cast<std::uint32_t>(now);
+    command.executeAt = now + static_cast<std::int32_t>(executeAt - nowLow);
+    command.order = scheduleOrder++;
+    command.packet = packet;
+    std::copy(payload + SCHEDULED_TIME_LENGTH, iframe.data.data() + N, command.payload.begin());
+    std::fill(command.payload.end() - SCHEDULED_TIME_LENGTH, command.payload.end(), 0);
+
+    scheduleHeap.push_back(index);
+    std::push_heap(scheduleHeap.begin(), scheduleHeap.end(), ScheduleOrder{scheduledCommands});
+
+    iframe.runEvent = false;
+    iframe.isScheduled = true;
+    std::fill(payload, iframe.data.data() + N, 0);
+    payload[0] = STATUS_ACCEPTED;
+    iframe.data.at(HEADER_LENGTH - 1) |= HEADER_STATUS_BIT;
+  }
+
+  /**
+   * Answers an admitted frame for an idempotent packet from the reply cache instead of running its
+   * event, if a fresh reply to the same request is cached. Otherwise claims an entry for the reply.
+   *
+   * @param iframe The frame.
+   */
+  void lookUpCachedReply(PendingFrame &iframe) {
+    const std::shared_ptr<Packet> &packet = iframe.slot->packet;
+    if (!iframe.runEvent || iframe.isGroupFrame || !packet->isIdempotent() || replyCache.empty()) {
+      return;
+    }
+
+    const std::uint32_t generation = packet->getCacheGeneration();
+    const time_t ttl = packet->getCacheTtl();
+    const time_t now = getTime();
+    std::uint8_t *payload = iframe.data.data() + HEADER_LENGTH;
+    const std::size_t payloadLength = packet->getPayloadLength<N>();
+    for (std::size_t i = 0; i < replyCache.size(); i++) {
+      CachedReply &entry = replyCache[i];
+      if (entry.packet.owner_before(packet) || packet.owner_before(entry.packet) ||
+          !std::equal(payload, payload + payloadLength, entry.request.begin())) {
+        continue;
+      }
+
+      if (entry.isValid && entry.generation == generation &&
+          (ttl == 0 || now - entry.storedAt <= ttl)) {
+        std::copy(entry.reply.begin(), entry.reply.begin() + payloadLength, payload);
+        iframe.runEvent = false;
+        iframe.isCached = true;
+        replyCacheHits++;
+        return;
+      }
+
+      // Stale, so store the new reply over it
+      iframe.cacheEntry = i;
       break;
     }
 
-    case waitForOne: {
-      if (getSeqNum(idata) == 1) {
-        // Right payload. Handle it.
-        auto error = ipacket->second->event(idata.data() + HEADER_LENGTH);
-        if (error == BOWLER_ERROR) {
-          BOWLER_LOG("Error handling packet event: %d %s\n", errno, strerror(errno));
+    if (iframe.cacheEntry == NO_CACHE_ENTRY) {
+      iframe.cacheEntry = nextCacheEntry;
+      nextCacheEntry = (nextCacheEntry + 1) % replyCache.size();
+    }
+
+    CachedReply &entry = replyCache[iframe.cacheEntry];
+    entry.packet = packet;
+    entry.generation = generation;
+    entry.isValid = false;
+    entry.claim = ++cacheClaimCount;
+    iframe.cacheClaim = entry.claim;
+    std::copy(payload, payload + payloadLength, entry.request.begin());
+  }
+
+  /**
+   * Stores the reply to a frame in the entry it claimed in lookUpCachedReply, unless the event
+   * failed or a later frame claimed the entry.
+   *
+   * @param iframe The frame.
+   */
+  void storeCachedReply(const PendingFrame &iframe) {
+    CachedReply &entry = replyCache[iframe.cacheEntry];
+    if (entry.claim != iframe.cacheClaim || iframe.eventError == BOWLER_ERROR) {
+      return;
+    }
+
+    const std::size_t payloadLength = iframe.slot->packet->template getPayloadLength<N>();
+    std::copy(iframe.data.begin() + HEADER_LENGTH,
+              iframe.data.begin() + HEADER_LENGTH + payloadLength,
+              entry.reply.begin());
+    entry.storedAt = getTime();
+    entry.isValid = true;
+  }
+
+  /**
+   * Turns a frame into a status reply without running its packet event. A reliable packet's RDT
+   * state is left alone and the frame is not ACKed, so the PC can tell it was not handled.
+   *
+   * @param iframe The frame.
+   * @param istatus The STATUS_* code to reply with.
+   */
+  void rejectFrame(PendingFrame &iframe, std::uint8_t istatus) {
+    if (iframe.slot->packet->isReliable()) {
+      setAckNum(iframe.data, iframe.slot->state == waitForZero ? 1 : 0);
+    }
+
+    std::fill(std::next(iframe.data.begin(), HEADER_LENGTH), iframe.data.end(), 0);
+    iframe.data.at(HEADER_LENGTH) = istatus;
+    iframe.data.at(HEADER_LENGTH - 1) |= HEADER_STATUS_BIT;
+    iframe.rejectStatus = istatus;
+  }
+
+  /**
+   * Runs the packet events for a range of admitted frames. The frames are grouped by packet; each
+   * group runs in the order its frames were read, and frames for the same unreliable packet go to
+   * Packet::eventBatch together. Groups run on the worker pool if there is one.
+   *
+   * @param ibegin The index of the first frame.
+   * @param iend One past the index of the last frame.
+   */
+  void runEvents(std::size_t ibegin, std::size_t iend) {
+    std::size_t groupCount = 0;
+    std::size_t payloadOffset = 0;
+    for (std::size_t i = ibegin; i < iend; i++) {
+      if (!frames[i].runEvent || frames[i].isGrouped) {
+        continue;
+      }
+
+      EventGroup &group = groups[groupCount++];
+      group.first = i;
+      group.end = iend;
+      group.payloadOffset = payloadOffset;
+
+      // Claim every frame for this packet so it is only in one group
+      for (std::size_t j = i; j < iend; j++) {
+        if (frames[j].runEvent && frames[j].slot == frames[i].slot) {
+          frames[j].isGrouped = true;
+          payloadOffset++;
         }
+      }
+    }
 
-        // ACK it and start waiting for the next packet.
-        setAckNum(idata, 1);
-        error = server->write(idata);
-        if (error == BOWLER_ERROR) {
-          BOWLER_LOG("Error writing: %d %s\n", errno, strerror(errno));
+    if (workerPool && groupCount > 1) {
+      workerPool->run(groupCount, runGroupTask);
+    } else {
+      for (std::size_t i = 0; i < groupCount; i++) {
+        runGroup(groups[i]);
+      }
+    }
+  }
+
+  /**
+   * Runs the packet events for one group of frames.
+   *
+   * @param igroup The group.
+   */
+  void runGroup(const EventGroup &igroup) {
+    PacketSlot *slot = frames[igroup.first].slot;
+    std::uint8_t **payloads = batchPayloads.data() + igroup.payloadOffset;
+
+    std::size_t batchSize = 0;
+    for (std::size_t i = igroup.first; i < igroup.end; i++) {
+      if (frames[i].runEvent && frames[i].slot == slot) {
+        payloads[batchSize++] = frames[i].data.data() + HEADER_LENGTH;
+      }
+    }
+
+    if (slot->packet->isReliable() || batchSize == 1) {
+      // Reliable packets see every frame on its own
+      std::size_t handled = 0;
+      for (std::size_t i = igroup.first; handled < batchSize; i++) {
+        if (frames[i].runEvent && frames[i].slot == slot) {
+          frames[i].eventError = slot->packet->event(payloads[handled++]);
+          logEventError(frames[i].eventError);
         }
+      }
+    } else {
+      const std::int32_t error = slot->packet->eventBatch(payloads, batchSize);
+      logEventError(error);
 
-        // Even if the server management packet processed a disconnection, this returns us to the
-        // starting state (which we want)
-        state = waitForZero;
-      } else {
-        // Wrong packet. Clear the payload and ACK 0.
-        std::fill(std::next(idata.begin(), HEADER_LENGTH), idata.end(), 0);
-        setAckNum(idata, 0);
-        auto error = server->write(idata);
-        if (error == BOWLER_ERROR) {
-          BOWLER_LOG("Error writing: %d %s\n", errno, strerror(errno));
+      for (std::size_t i = igroup.first; i < igroup.end; i++) {
+        if (frames[i].runEvent && frames[i].slot == slot) {
+          frames[i].eventError = error;
         }
       }
-      break;
     }
+  }
+
+  static void logEventError(std::int32_t ierror) {
+    if (ierror == BOWLER_ERROR) {
+      BOWLER_LOG("Error handling packet event: %d %s\n", errno, strerror(errno));
+    }
+  }
+
+  /**
+   * Writes the reply to a handled frame.
+   *
+   * @param iframe The frame.
+   */
+  void replyToFrame(PendingFrame &iframe) {
+    if (iframe.isGroupFrame) {
+      if (iframe.slot == nullptr || !(iframe.groupFlags & GROUP_FLAG_ACK)) {
+        // Not for this device, or the PC does not want a reply from every device
+        return;
+      }
+
+      // Say which device this reply is from in front of the event payload
+      std::uint8_t *payload = iframe.data.data() + HEADER_LENGTH;
+      std::copy_backward(
+        payload, iframe.data.data() + N - GROUP_REPLY_HEADER_LENGTH, iframe.data.data() + N);
+      writeLittleEndian(payload, iframe.groupHandlerId);
+      writeLittleEndian(payload + 2, groupIndex);
+    }
+
+    server->setReplyTarget(iframe.replyTarget);
+    if (iframe.slot == nullptr) {
+      // Echo the frame at the length it came in
+      const std::size_t length = std::max<std::size_t>(iframe.length, HEADER_LENGTH);
+      auto writeError = reply(iframe.data, length, FRAME_TRACE_NO_HANDLER);
+      if (writeError == BOWLER_ERROR) {
+        BOWLER_LOG("Error while replying to unregistered packet: %d %s\n", errno, strerror(errno));
+      }
+      return;
+    }
+
+    if (iframe.isManagement && iframe.runEvent && iframe.eventError == 2) {
+      // The server management packet processed a disconnection, so force the state into the
+      // starting state
+      iframe.slot->state = waitForZero;
+    }
+
+    std::uint8_t traceResult = FRAME_TRACE_OUT_OF_ORDER;
+    if (iframe.rejectStatus == STATUS_EXPIRED) {
+      traceResult = FRAME_TRACE_EXPIRED;
+    } else if (iframe.rejectStatus == STATUS_RATE_LIMITED) {
+      traceResult = FRAME_TRACE_RATE_LIMITED;
+    } else if (iframe.rejectStatus == STATUS_SCHEDULE_FULL) {
+      traceResult = FRAME_TRACE_SCHEDULE_FULL;
+    } else if (iframe.rejectStatus == STATUS_REJECTED_GENERIC) {
+      traceResult = FRAME_TRACE_BAD_ENCODING;
+    } else if (iframe.isScheduled) {
+      traceResult = FRAME_TRACE_SCHEDULED;
+    } else if (iframe.isCached) {
+      traceResult = FRAME_TRACE_CACHED;
+    } else if (iframe.runEvent) {
+      traceResult = getTraceResult(iframe.eventError);
+    }
+
+    // Group frames belong to the group packet, which uses the full frame length
+    if (iframe.cacheEntry != NO_CACHE_ENTRY) {
+      storeCachedReply(iframe);
+    }
+
+    std::size_t length = iframe.isGroupFrame ? N : getFrameLength(*iframe.slot->packet);
+    stampFrame(iframe.slot->packet, iframe.receiveTime, iframe.data, length);
+    if (!iframe.isGroupFrame) {
+      length = compressFrame(*iframe.slot->packet, iframe.data, length);
+    }
+    auto error = reply(iframe.data, length, traceResult);
+    if (error == BOWLER_ERROR) {
+      BOWLER_LOG("Error writing: %d %s\n", errno, strerror(errno));
+    }
+  }
+
+  /**
+   * Writes a reply to the PC, recording it in the frame trace first.
+   *
+   * @param idata The frame to write.
+   * @param ilength The length of the frame.
+   * @param itraceResult The FRAME_TRACE_* result code to record.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t
+  reply(std::array<std::uint8_t, N> &idata, std::size_t ilength, std::uint8_t itraceResult) {
+    if (loopBudget != 0 && getTime() - loopStart > loopBudget) {
+      idata.at(HEADER_LENGTH - 1) |= HEADER_BUSY_BIT;
+    }
+
+    traceFrame(FRAME_TRACE_TX, idata, ilength, itraceResult);
+    auto error = server->writeFrame(idata, ilength);
+
+    // A header format change requested by this frame applies from the next frame on
+    headerFormat = pendingHeaderFormat;
+    return error;
+  }
+
+  /**
+   * Writes the receive and transmit timestamps into the end of the frame if the packet asked for
+   * them. Format is: <Receive time (4 bytes)> <Transmit time (4 bytes)>, each the low 32 bits of
+   * getTime().
+   *
+   * @param ipacket The packet the frame is for.
+   * @param ireceiveTime The time the frame was read from the server.
+   * @param idata The frame to stamp.
+   * @param ilength The length of the frame.
+   */
+  void stampFrame(const std::shared_ptr<Packet> &ipacket,
+                  time_t ireceiveTime,
+                  std::array<std::uint8_t, N> &idata,
+                  std::size_t ilength) {
+    if (ilength >= HEADER_LENGTH + FRAME_TIMESTAMPS_LENGTH && ipacket->isTimestamped()) {
+      std::uint8_t *stamps = idata.data() + ilength - FRAME_TIMESTAMPS_LENGTH;
+      writeLittleEndian(stamps, static_cast<std::uint32_t>(ireceiveTime));
+      writeLittleEndian(stamps + 4, static_cast<std::uint32_t>(getTime()));
     }
   }
 
-  std::uint8_t getPacketId(const std::array<std::uint8_t, N> &idata) const {
+  void traceFrame(std::uint8_t idirection,
+                  const std::array<std::uint8_t, N> &idata,
+                  std::size_t ilength,
+                  std::uint8_t iresult) {
+    if (frameTrace) {
+      frameTrace->record(idirection,
+                         getPacketId(idata),
+                         getSeqNum(idata),
+                         getAckNum(idata),
+                         idata.data() + HEADER_LENGTH,
+                         ilength > HEADER_LENGTH ? ilength - HEADER_LENGTH : 0,
+                         iresult);
+    }
+  }
+
+  static std::uint8_t getTraceResult(std::int32_t ieventError) {
+    return ieventError == BOWLER_ERROR ? FRAME_TRACE_HANDLER_ERROR : FRAME_TRACE_OK;
+  }
+
+  std::uint16_t getPacketId(const std::array<std::uint8_t, N> &idata) const {
+    if (headerFormat == HEADER_FORMAT_WIDE) {
+      return readLittleEndian<std::uint16_t>(idata.data());
+    }
     return idata.at(0);
   }
 
   std::uint8_t getSeqNum(const std::array<std::uint8_t, N> &idata) const {
+    if (headerFormat == HEADER_FORMAT_WIDE) {
+      return (idata.at(2) & HEADER_SEQ_BIT) ? 1 : 0;
+    }
     return idata.at(1);
   }
 
   std::uint8_t getAckNum(const std::array<std::uint8_t, N> &idata) const {
-    return idata.at(2);
+    if (headerFormat == HEADER_FORMAT_WIDE) {
+      return (idata.at(2) & HEADER_ACK_BIT) ? 1 : 0;
+    }
+    return idata.at(2) & ~(HEADER_STATUS_BIT | HEADER_BUSY_BIT | HEADER_COMPRESSED_BIT);
   }
 
   void setSeqNum(std::array<std::uint8_t, N> &idata, std::uint8_t iseqNum) const {
-    idata.at(1) = iseqNum;
+    if (headerFormat == HEADER_FORMAT_WIDE) {
+      idata.at(2) = iseqNum ? (idata.at(2) | HEADER_SEQ_BIT) : (idata.at(2) & ~HEADER_SEQ_BIT);
+    } else {
+      idata.at(1) = iseqNum;
+    }
   }
 
   void setAckNum(std::array<std::uint8_t, N> &idata, std::uint8_t iackNum) const {
-    idata.at(2) = iackNum;
+    if (headerFormat == HEADER_FORMAT_WIDE) {
+      idata.at(2) = iackNum ? (idata.at(2) | HEADER_ACK_BIT) : (idata.at(2) & ~HEADER_ACK_BIT);
+    } else {
+      idata.at(2) = iackNum;
+    }
   }
 
-  enum states_t { waitForZero, waitForOne };
   std::unique_ptr<BowlerServer<N>> server;
-  std::map<std::uint8_t, std::shared_ptr<Packet>> packets;
-  std::map<std::uint8_t, states_t> reliableState;
-  std::vector<std::function<std::shared_ptr<Packet>(void)>> ensuredPackets;
+  PacketRegistry<PacketSlot> packets;
+  const PacketTable<PacketSlot> *activePackets{nullptr};
+  std::vector<EnsuredPacket> ensuredPackets;
+  std::unique_ptr<FrameTrace> frameTrace;
+  std::unique_ptr<LoopHealth> loopHealth;
+  std::unique_ptr<LinkMonitor> linkMonitor;
+  LzCodec codec;
+  std::vector<CachedReply> replyCache;
+  std::size_t nextCacheEntry{0};
+  std::uint32_t cacheClaimCount{0};
+  std::uint32_t replyCacheHits{0};
+  std::array<std::uint8_t, N> codecBuffer;
+  time_t lastReceiveTime{0};
+  std::vector<PendingFrame> frames;
+  std::vector<std::uint8_t *> batchPayloads;
+  std::vector<EventGroup> groups;
+  std::function<void(std::size_t)> runGroupTask;
+  std::unique_ptr<WorkerPool> workerPool;
+  std::vector<ScheduledCommand> scheduledCommands;
+  // Indices into scheduledCommands: a min-heap of waiting commands and a stack of free ones
+  std::vector<std::size_t> scheduleHeap;
+  std::vector<std::size_t> freeCommands;
+  std::uint32_t scheduleOrder{0};
+  std::uint16_t groupIndex{GROUP_INDEX_NONE};
+  time_t loopBudget{0};
+  time_t loopStart{0};
+  bool isStackProbeEnabled{false};
+  StackProbe stackProbe;
+  bool isStackSaturated{false};
+  std::size_t stackPeak{0};
+  std::uint8_t headerFormat{HEADER_FORMAT_LEGACY};
+  std::uint8_t pendingHeaderFormat{HEADER_FORMAT_LEGACY};
 };
 } // namespace bowlerserver
@@ -26,7 +26,7 @@ namespace bowlerserver {
  */
 class EchoPacket : public Packet {
   public:
-  EchoPacket(std::uint8_t iid, bool iisReliable = false) : Packet(iid, iisReliable) {
+  EchoPacket(std::uint16_t iid, bool iisReliable = false) : Packet(iid, iisReliable) {
   }
 
   std::int32_t event(std::uint8_t *payload) override {
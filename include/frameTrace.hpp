@@ -0,0 +1,183 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+namespace bowlerserver {
+const std::uint8_t FRAME_TRACE_RX = 0;
+const std::uint8_t FRAME_TRACE_TX = 1;
+
+const std::uint8_t FRAME_TRACE_RECEIVED = 0;
+const std::uint8_t FRAME_TRACE_OK = 1;
+const std::uint8_t FRAME_TRACE_HANDLER_ERROR = 2;
+const std::uint8_t FRAME_TRACE_NO_HANDLER = 3;
+const std::uint8_t FRAME_TRACE_OUT_OF_ORDER = 4;
+const std::uint8_t FRAME_TRACE_EXPIRED = 5;
+const std::uint8_t FRAME_TRACE_RATE_LIMITED = 6;
+const std::uint8_t FRAME_TRACE_SCHEDULED = 7;
+const std::uint8_t FRAME_TRACE_SCHEDULE_FULL = 8;
+const std::uint8_t FRAME_TRACE_BAD_ENCODING = 9;
+const std::uint8_t FRAME_TRACE_CACHED = 10;
+
+// The number of payload bytes kept per entry
+const std::size_t FRAME_TRACE_PAYLOAD_LENGTH = 4;
+
+/**
+ * One traced frame. The timestamp is the low 32 bits of getTime().
+ */
+struct FrameTraceEntry {
+  std::uint32_t timestamp;
+  std::uint8_t direction;
+  std::uint16_t id;
+  std::uint8_t seqNum;
+  std::uint8_t ackNum;
+  std::uint8_t result;
+  std::array<std::uint8_t, FRAME_TRACE_PAYLOAD_LENGTH> payload;
+};
+
+/**
+ * Serialized entry format is:
+ * <Timestamp (4 bytes)> <Direction (1 byte)> <ID (2 bytes)> <Seq Num (1 byte)> <ACK num (1 byte)>
+ * <Result (1 byte)> <Payload (FRAME_TRACE_PAYLOAD_LENGTH bytes)>.
+ */
+const std::size_t FRAME_TRACE_ENTRY_LENGTH = 10 + FRAME_TRACE_PAYLOAD_LENGTH;
+
+/**
+ * A circular trace of the last frames handled by the coms. The buffer is allocated once up front
+ * so recording a frame is only a handful of stores.
+ */
+class FrameTrace {
+  public:
+  /**
+   * @param icapacity The number of entries to keep. A capacity of 0 is clamped to 1.
+   */
+  FrameTrace(std::size_t icapacity)
+    : entries(new FrameTraceEntry[std::max<std::size_t>(icapacity, 1)]()),
+      capacity(std::max<std::size_t>(icapacity, 1)) {
+  }
+
+  /**
+   * Records a frame, overwriting the oldest entry if the trace is full.
+   *
+   * @param idirection FRAME_TRACE_RX or FRAME_TRACE_TX.
+   * @param iid The packet id from the header.
+   * @param iseqNum The Seq Num from the header.
+   * @param iackNum The ACK num from the header.
+   * @param ipayload The payload (not including header data).
+   * @param ilength The length of the payload.
+   * @param iresult One of the FRAME_TRACE_* result codes.
+   */
+  void record(std::uint8_t idirection,
+              std::uint16_t iid,
+              std::uint8_t iseqNum,
+              std::uint8_t iackNum,
+              const std::uint8_t *ipayload,
+              std::size_t ilength,
+              std::uint8_t iresult) {
+    FrameTraceEntry &entry = entries[next];
+    entry.timestamp = static_cast<std::uint32_t>(getTime());
+    entry.direction = idirection;
+    entry.id = iid;
+    entry.seqNum = iseqNum;
+    entry.ackNum = iackNum;
+    entry.result = iresult;
+    entry.payload.fill(0);
+    std::memcpy(entry.payload.data(), ipayload, std::min(ilength, FRAME_TRACE_PAYLOAD_LENGTH));
+
+    if (++next == capacity) {
+      next = 0;
+    }
+    if (held < capacity) {
+      held++;
+    }
+
+    recorded++;
+  }
+
+  /**
+   * @return The number of frames recorded since the trace was created, modulo 2^32. This is also
+   * the sequence number the next recorded frame will get.
+   */
+  std::uint32_t getRecordedCount() const {
+    return recorded;
+  }
+
+  /**
+   * @return The sequence number of the oldest entry still held.
+   */
+  std::uint32_t getOldestSeq() const {
+    return recorded - static_cast<std::uint32_t>(held);
+  }
+
+  /**
+   * @return The heap the trace takes.
+   */
+  std::size_t getHeapBytes() const {
+    return sizeof(FrameTrace) + capacity * sizeof(FrameTraceEntry);
+  }
+
+  /**
+   * Serializes as many entries as fit into the buffer, starting at the given sequence number (or
+   * the oldest held entry if that one was already overwritten). Sequence numbers wrap around, so
+   * they are compared by how far they are behind getRecordedCount().
+   *
+   * @param istartSeq The sequence number of the first entry to serialize.
+   * @param obuffer The buffer to write into.
+   * @param ilength The length of the buffer.
+   * @param ofirstSeq The sequence number of the first serialized entry.
+   * @return The number of entries serialized.
+   */
+  std::size_t serialize(std::uint32_t istartSeq,
+                        std::uint8_t *obuffer,
+                        std::size_t ilength,
+                        std::uint32_t &ofirstSeq) const {
+    const std::uint32_t behind = recorded - istartSeq;
+    const std::size_t available = behind <= held ? behind : held;
+    ofirstSeq = recorded - static_cast<std::uint32_t>(available);
+
+    std::size_t count = 0;
+    for (; count < available && (count + 1) * FRAME_TRACE_ENTRY_LENGTH <= ilength; count++) {
+      // The entry `available - count` frames back from the next one to be written
+      const FrameTraceEntry &entry = entries[(next + capacity - (available - count)) % capacity];
+      std::uint8_t *out = obuffer + count * FRAME_TRACE_ENTRY_LENGTH;
+      writeLittleEndian(out, entry.timestamp);
+      out[4] = entry.direction;
+      writeLittleEndian(out + 5, entry.id);
+      out[7] = entry.seqNum;
+      out[8] = entry.ackNum;
+      out[9] = entry.result;
+      std::memcpy(out + 10, entry.payload.data(), FRAME_TRACE_PAYLOAD_LENGTH);
+    }
+
+    return count;
+  }
+
+  protected:
+  std::unique_ptr<FrameTraceEntry[]> entries;
+  std::size_t capacity;
+  std::size_t next{0};
+  // The number of entries held, up to capacity
+  std::size_t held{0};
+  std::uint32_t recorded{0};
+};
+} // namespace bowlerserver
@@ -0,0 +1,140 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace bowlerserver {
+/**
+ * Serialized link stats format is: <Loss count (4 bytes)> <Last detection latency (4 bytes)>
+ * <Max detection latency (4 bytes)>, the latencies in microseconds.
+ */
+const std::size_t LINK_STATS_LENGTH = 12;
+
+/**
+ * Watches for the PC going quiet. Every frame from the PC counts as a heartbeat; the PC sends
+ * OPERATION_HEARTBEAT when it has nothing else to send. Once the PC has been heard from, the link
+ * is declared lost when a number of heartbeat intervals pass without a frame, and the failsafe
+ * callbacks run (e.g. to stop the motors). The next frame brings the link back up.
+ *
+ * The detection latency of a loss is the time from the last frame to the loss being declared,
+ * which is at most the timeout plus however long the loop takes to call check().
+ */
+class LinkMonitor {
+  public:
+  /**
+   * @param iinterval The heartbeat interval the PC keeps in microseconds.
+   * @param imissedBeats The number of intervals without a frame after which the link is lost.
+   */
+  LinkMonitor(time_t iinterval, std::uint32_t imissedBeats)
+    : timeout(iinterval * std::max<std::uint32_t>(imissedBeats, 1)) {
+  }
+
+  /**
+   * Adds a callback to run when the link is lost. Callbacks run in the order they were added, on
+   * the thread calling check().
+   *
+   * @param ifailsafe The callback.
+   */
+  void addFailsafe(std::function<void(void)> ifailsafe) {
+    failsafes.push_back(std::move(ifailsafe));
+  }
+
+  /**
+   * Records that a frame arrived from the PC.
+   *
+   * @param inow The time the frame was read.
+   */
+  void heard(time_t inow) {
+    lastHeard = inow;
+    isUp = true;
+  }
+
+  /**
+   * Declares the link lost if the PC has been quiet for too long. Call this often, e.g. every
+   * loop.
+   *
+   * @param inow The current time.
+   * @return Whether the link is up.
+   */
+  bool check(time_t inow) {
+    if (isUp && inow - lastHeard > timeout) {
+      isUp = false;
+      lossCount++;
+      lastLatency = static_cast<std::uint32_t>(
+        std::min<std::uint64_t>(static_cast<std::uint64_t>(inow - lastHeard), UINT32_MAX));
+      maxLatency = std::max(maxLatency, lastLatency);
+
+      for (auto &&failsafe : failsafes) {
+        failsafe();
+      }
+    }
+
+    return isUp;
+  }
+
+  /**
+   * @return Whether a frame has arrived within the timeout, as of the last check().
+   */
+  bool isLinkUp() const {
+    return isUp;
+  }
+
+  /**
+   * @return The time without a frame after which the link is lost, in microseconds.
+   */
+  time_t getTimeout() const {
+    return timeout;
+  }
+
+  std::uint32_t getLossCount() const {
+    return lossCount;
+  }
+
+  std::uint32_t getLastDetectionLatency() const {
+    return lastLatency;
+  }
+
+  std::uint32_t getMaxDetectionLatency() const {
+    return maxLatency;
+  }
+
+  /**
+   * Writes the stats into a buffer of at least LINK_STATS_LENGTH bytes.
+   *
+   * @param ibuffer The buffer.
+   */
+  void serialize(std::uint8_t *ibuffer) const {
+    writeLittleEndian(ibuffer, lossCount);
+    writeLittleEndian(ibuffer + 4, lastLatency);
+    writeLittleEndian(ibuffer + 8, maxLatency);
+  }
+
+  private:
+  std::vector<std::function<void(void)>> failsafes;
+  time_t timeout;
+  time_t lastHeard{0};
+  bool isUp{false};
+  std::uint32_t lossCount{0};
+  std::uint32_t lastLatency{0};
+  std::uint32_t maxLatency{0};
+};
+} // namespace bowlerserver
@@ -0,0 +1,191 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace bowlerserver {
+const std::uint8_t LOOP_HEALTH_PERIOD = 0;
+const std::uint8_t LOOP_HEALTH_MANAGER = 1;
+const std::uint8_t LOOP_HEALTH_COMS = 2;
+const std::uint8_t LOOP_HEALTH_OUTSIDE = 3;
+const std::uint8_t LOOP_HEALTH_HISTOGRAM_COUNT = 4;
+
+// Bucket i counts durations below LOOP_HISTOGRAM_FIRST_BOUND << i microseconds (and at least the
+// previous bound). The last bucket counts everything longer.
+const std::size_t LOOP_HISTOGRAM_BUCKETS = 10;
+const std::uint32_t LOOP_HISTOGRAM_FIRST_BOUND = 32;
+
+/**
+ * Serialized histogram format is: <Sample count (4 bytes)> <Max (4 bytes)>
+ * <Overrun count (4 bytes)> <Buckets (4 bytes each, LOOP_HISTOGRAM_BUCKETS of them)>.
+ */
+const std::size_t LOOP_HISTOGRAM_LENGTH = 12 + 4 * LOOP_HISTOGRAM_BUCKETS;
+
+/**
+ * A fixed-bucket histogram of durations in microseconds.
+ */
+class LoopHistogram {
+  public:
+  /**
+   * Records a duration.
+   *
+   * @param iduration The duration in microseconds.
+   * @param itarget Durations longer than this count as overruns. `0` for no target.
+   */
+  void record(time_t iduration, time_t itarget) {
+    const std::uint32_t duration =
+      iduration <= 0 ? 0
+                     : static_cast<std::uint32_t>(std::min<std::uint64_t>(iduration, UINT32_MAX));
+
+    std::size_t bucket = 0;
+    while (bucket < LOOP_HISTOGRAM_BUCKETS - 1 &&
+           duration >= (LOOP_HISTOGRAM_FIRST_BOUND << bucket)) {
+      bucket++;
+    }
+    buckets[bucket]++;
+
+    samples++;
+    max = std::max(max, duration);
+    if (itarget != 0 && iduration > itarget) {
+      overruns++;
+    }
+  }
+
+  void reset() {
+    buckets.fill(0);
+    samples = 0;
+    max = 0;
+    overruns = 0;
+  }
+
+  /**
+   * Writes the histogram into a buffer of at least LOOP_HISTOGRAM_LENGTH bytes.
+   *
+   * @param ibuffer The buffer.
+   */
+  void serialize(std::uint8_t *ibuffer) const {
+    writeLittleEndian(ibuffer, samples);
+    writeLittleEndian(ibuffer + 4, max);
+    writeLittleEndian(ibuffer + 8, overruns);
+    for (std::size_t i = 0; i < LOOP_HISTOGRAM_BUCKETS; i++) {
+      writeLittleEndian(ibuffer + 12 + 4 * i, buckets[i]);
+    }
+  }
+
+  std::uint32_t getSampleCount() const {
+    return samples;
+  }
+
+  std::uint32_t getMax() const {
+    return max;
+  }
+
+  std::uint32_t getOverrunCount() const {
+    return overruns;
+  }
+
+  std::uint32_t getBucket(std::size_t ibucket) const {
+    return buckets.at(ibucket);
+  }
+
+  private:
+  std::array<std::uint32_t, LOOP_HISTOGRAM_BUCKETS> buckets{};
+  std::uint32_t samples{0};
+  std::uint32_t max{0};
+  std::uint32_t overruns{0};
+};
+
+/**
+ * Histograms of how the controller's loop spends its time: the period between loops, the time in
+ * the Wi-Fi manager, the time in coms, and the time outside the controller (the rest of the
+ * user's Arduino loop). Every duration is also checked against a target loop period.
+ */
+class LoopHealth {
+  public:
+  /**
+   * @param itargetPeriod The loop period to count overruns against in microseconds, or `0` for
+   * none.
+   */
+  LoopHealth(time_t itargetPeriod) : targetPeriod(itargetPeriod) {
+  }
+
+  /**
+   * Marks the start of the controller's loop.
+   *
+   * @param inow The current time.
+   */
+  void beginLoop(time_t inow) {
+    if (hasLooped) {
+      histograms[LOOP_HEALTH_PERIOD].record(inow - lastBegin, targetPeriod);
+      histograms[LOOP_HEALTH_OUTSIDE].record(inow - lastEnd, targetPeriod);
+    }
+    hasLooped = true;
+    lastBegin = inow;
+  }
+
+  /**
+   * Marks the end of the controller's loop.
+   *
+   * @param inow The current time.
+   */
+  void endLoop(time_t inow) {
+    lastEnd = inow;
+  }
+
+  /**
+   * Records the time one part of the loop took.
+   *
+   * @param ihistogram LOOP_HEALTH_MANAGER or LOOP_HEALTH_COMS.
+   * @param iduration The duration in microseconds.
+   */
+  void record(std::uint8_t ihistogram, time_t iduration) {
+    histograms.at(ihistogram).record(iduration, targetPeriod);
+  }
+
+  /**
+   * @param ihistogram One of the LOOP_HEALTH_* histograms.
+   * @return The histogram.
+   */
+  const LoopHistogram &getHistogram(std::uint8_t ihistogram) const {
+    return histograms.at(ihistogram);
+  }
+
+  /**
+   * Clears one histogram.
+   *
+   * @param ihistogram One of the LOOP_HEALTH_* histograms.
+   */
+  void reset(std::uint8_t ihistogram) {
+    histograms.at(ihistogram).reset();
+  }
+
+  time_t getTargetPeriod() const {
+    return targetPeriod;
+  }
+
+  private:
+  std::array<LoopHistogram, LOOP_HEALTH_HISTOGRAM_COUNT> histograms;
+  time_t targetPeriod;
+  time_t lastBegin{0};
+  time_t lastEnd{0};
+  bool hasLooped{false};
+};
+} // namespace bowlerserver
@@ -0,0 +1,201 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace bowlerserver {
+// Stream format is a sequence of tokens. A token with the top bit clear is followed by
+// (token + 1) literal bytes. Otherwise it copies ((token & 0x3F) + LZ_MIN_MATCH) bytes from
+// (offset + 1) bytes back in the output, where the offset is 1 byte if bit 6 is clear and 2 bytes
+// (little endian) if it is set. Copies may overlap the bytes they produce, which encodes runs.
+const std::size_t LZ_MIN_MATCH = 3;
+const std::size_t LZ_MAX_MATCH = LZ_MIN_MATCH + 0x3F;
+const std::size_t LZ_MAX_LITERALS = 0x80;
+const std::size_t LZ_MAX_OFFSET = 0x10000;
+const std::uint8_t LZ_MATCH_BIT = 1 << 7;
+const std::uint8_t LZ_LONG_OFFSET_BIT = 1 << 6;
+// The compressor's hash table has 1 << LZ_HASH_BITS entries of 2 bytes each
+const std::size_t LZ_HASH_BITS = 8;
+// Marks an empty entry in the compressor's hash table
+const std::uint16_t LZ_NO_POSITION = UINT16_MAX;
+
+/**
+ * A small LZ77 codec for frame payloads. The compressor is greedy and keeps one candidate match
+ * per hash of 3 bytes in a fixed table, so it needs no heap and its memory use does not depend on
+ * the frame length. Streams decode to a known length (the payload length), so they carry no
+ * length of their own and bytes after the end of a stream are ignored.
+ */
+class LzCodec {
+  public:
+  /**
+   * Compresses some data.
+   *
+   * @param iinput The data.
+   * @param ilength The number of bytes, less than UINT16_MAX.
+   * @param ooutput The buffer to write the stream into.
+   * @param icapacity The size of the buffer.
+   * @return The length of the stream, or `0` if it does not fit in the buffer.
+   */
+  std::size_t compress(const std::uint8_t *iinput,
+                       std::size_t ilength,
+                       std::uint8_t *ooutput,
+                       std::size_t icapacity) {
+    table.fill(LZ_NO_POSITION);
+
+    std::size_t in = 0;
+    std::size_t literalStart = 0;
+    std::size_t out = 0;
+    while (in + LZ_MIN_MATCH <= ilength) {
+      std::uint16_t &entry = table[hash(iinput + in)];
+      const std::size_t candidate = entry;
+      entry = static_cast<std::uint16_t>(in);
+
+      if (candidate == LZ_NO_POSITION || in - candidate > LZ_MAX_OFFSET ||
+          iinput[candidate] != iinput[in] || iinput[candidate + 1] != iinput[in + 1] ||
+          iinput[candidate + 2] != iinput[in + 2]) {
+        in++;
+        continue;
+      }
+
+      std::size_t matchLength = LZ_MIN_MATCH;
+      while (in + matchLength < ilength && matchLength < LZ_MAX_MATCH &&
+             iinput[candidate + matchLength] == iinput[in + matchLength]) {
+        matchLength++;
+      }
+
+      if (!writeLiterals(iinput + literalStart, in - literalStart, ooutput, out, icapacity)) {
+        return 0;
+      }
+
+      const std::size_t offset = in - candidate - 1;
+      const bool isLongOffset = offset > 0xFF;
+      if (out + (isLongOffset ? 3 : 2) > icapacity) {
+        return 0;
+      }
+      const std::uint8_t offsetBit = isLongOffset ? LZ_LONG_OFFSET_BIT : 0;
+      ooutput[out++] =
+        static_cast<std::uint8_t>(LZ_MATCH_BIT | offsetBit | (matchLength - LZ_MIN_MATCH));
+      ooutput[out++] = static_cast<std::uint8_t>(offset);
+      if (isLongOffset) {
+        ooutput[out++] = static_cast<std::uint8_t>(offset >> 8);
+      }
+
+      // Remember the positions inside the match so later data can refer to them too
+      for (std::size_t i = in + 1; i < in + matchLength && i + LZ_MIN_MATCH <= ilength; i++) {
+        table[hash(iinput + i)] = static_cast<std::uint16_t>(i);
+      }
+
+      in += matchLength;
+      literalStart = in;
+    }
+
+    if (!writeLiterals(iinput + literalStart, ilength - literalStart, ooutput, out, icapacity)) {
+      return 0;
+    }
+    return out;
+  }
+
+  /**
+   * Decompresses a stream.
+   *
+   * @param iinput The stream.
+   * @param ilength The number of bytes available; the stream may be shorter.
+   * @param ooutput The buffer to decompress into.
+   * @param ioutputLength The length of the decompressed data.
+   * @return False if the stream is malformed or ends before filling the output.
+   */
+  static bool decompress(const std::uint8_t *iinput,
+                         std::size_t ilength,
+                         std::uint8_t *ooutput,
+                         std::size_t ioutputLength) {
+    std::size_t in = 0;
+    std::size_t out = 0;
+    while (out < ioutputLength) {
+      if (in >= ilength) {
+        return false;
+      }
+
+      const std::uint8_t token = iinput[in++];
+      if (!(token & LZ_MATCH_BIT)) {
+        const std::size_t count = std::size_t(token) + 1;
+        if (in + count > ilength || out + count > ioutputLength) {
+          return false;
+        }
+        std::copy(iinput + in, iinput + in + count, ooutput + out);
+        in += count;
+        out += count;
+        continue;
+      }
+
+      const bool isLongOffset = token & LZ_LONG_OFFSET_BIT;
+      if (in + (isLongOffset ? 2 : 1) > ilength) {
+        return false;
+      }
+      std::size_t offset = iinput[in++];
+      if (isLongOffset) {
+        offset |= std::size_t(iinput[in++]) << 8;
+      }
+      offset++;
+
+      const std::size_t count = (token & 0x3F) + LZ_MIN_MATCH;
+      if (offset > out || out + count > ioutputLength) {
+        return false;
+      }
+
+      // One byte at a time because the copy can overlap what it writes
+      for (std::size_t i = 0; i < count; i++, out++) {
+        ooutput[out] = ooutput[out - offset];
+      }
+    }
+
+    return true;
+  }
+
+  private:
+  static std::size_t hash(const std::uint8_t *idata) {
+    const std::uint32_t value = idata[0] | (std::uint32_t(idata[1]) << 8) |
+                                (std::uint32_t(idata[2]) << 16);
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+  }
+
+  static bool writeLiterals(const std::uint8_t *iliterals,
+                            std::size_t icount,
+                            std::uint8_t *ooutput,
+                            std::size_t &ioffset,
+                            std::size_t icapacity) {
+    while (icount > 0) {
+      const std::size_t run = std::min(icount, LZ_MAX_LITERALS);
+      if (ioffset + 1 + run > icapacity) {
+        return false;
+      }
+
+      ooutput[ioffset++] = static_cast<std::uint8_t>(run - 1);
+      std::copy(iliterals, iliterals + run, ooutput + ioffset);
+      ioffset += run;
+      iliterals += run;
+      icount -= run;
+    }
+    return true;
+  }
+
+  std::array<std::uint16_t, std::size_t(1) << LZ_HASH_BITS> table;
+};
+} // namespace bowlerserver
@@ -0,0 +1,141 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include <algorithm>
+#include <cstdint>
+
+// How far below DefaultBowlerComs::loop() the stack probe looks, in bytes. The probe paints stack
+// that is not in use rather than taking any itself, so this only has to fit in the free stack of
+// the thread running coms. On ESP32 it is also capped by the loop task's stack headroom.
+#ifndef BOWLER_STACK_PROBE_LENGTH
+#define BOWLER_STACK_PROBE_LENGTH 4096
+#endif
+
+namespace bowlerserver {
+const std::size_t STACK_PROBE_LENGTH = BOWLER_STACK_PROBE_LENGTH;
+// Bytes just below the probe's own frame which are left unpainted, so painting never overwrites
+// the frame doing the painting
+const std::size_t STACK_PROBE_GUARD = 256;
+const std::uint8_t STACK_PROBE_FILL = 0xA5;
+
+// Set in MemoryStats::flags when the work overwrote the whole painted area, so the peak stack
+// depth is only a lower bound
+const std::uint8_t MEMORY_STATS_STACK_SATURATED = 1;
+
+/**
+ * Serialized memory stats format is: <Heap held by coms (4 bytes)> <Peak stack depth (4 bytes)>
+ * <Free heap (4 bytes)> <Largest free heap block (4 bytes)> <Stack headroom (4 bytes)>
+ * <Flags (1 byte)>.
+ */
+const std::size_t MEMORY_STATS_LENGTH = 21;
+
+/**
+ * A snapshot of how much memory the coms use and how much the device has left, in bytes.
+ */
+struct MemoryStats {
+  // The heap held by the coms' own buffers and packet table, not counting the packet event
+  // handlers themselves.
+  std::uint32_t heapBytes;
+  // The deepest stack use below DefaultBowlerComs::loop() seen by the stack probe, or `0` if the
+  // probe is off. See MEMORY_STATS_STACK_SATURATED.
+  std::uint32_t stackPeak;
+  std::uint32_t freeHeap;
+  std::uint32_t largestFreeBlock;
+  // See getStackHeadroom()
+  std::uint32_t stackHeadroom;
+  // MEMORY_STATS_* flags
+  std::uint8_t flags;
+
+  /**
+   * Writes the stats into a buffer of at least MEMORY_STATS_LENGTH bytes.
+   *
+   * @param ibuffer The buffer.
+   */
+  void serialize(std::uint8_t *ibuffer) const {
+    writeLittleEndian(ibuffer, heapBytes);
+    writeLittleEndian(ibuffer + 4, stackPeak);
+    writeLittleEndian(ibuffer + 8, freeHeap);
+    writeLittleEndian(ibuffer + 12, largestFreeBlock);
+    writeLittleEndian(ibuffer + 16, stackHeadroom);
+    ibuffer[20] = flags;
+  }
+};
+
+/**
+ * Measures peak stack depth by painting. paint() fills up to STACK_PROBE_LENGTH bytes of the free
+ * stack below the caller with STACK_PROBE_FILL, starting STACK_PROBE_GUARD bytes below its own
+ * frame. measure(), called from the same caller after some work, counts how much of the paint the
+ * work overwrote. Only bytes which were painted are ever read back.
+ *
+ * Only the calling thread's stack is measured; work run on a WorkerPool is not.
+ */
+class StackProbe {
+  public:
+  /**
+   * Paints the stack below the caller.
+   */
+  __attribute__((noinline)) void paint() {
+    std::size_t length = STACK_PROBE_LENGTH;
+#if defined(PLATFORM_ESP32)
+    // Never paint past the end of the task's stack
+    const std::size_t headroom = getStackHeadroom();
+    length = headroom > 2 * STACK_PROBE_GUARD ? std::min(length, headroom - 2 * STACK_PROBE_GUARD)
+                                               : 0;
+#endif
+
+    // The stack grows down, so the area ends just above the deepest byte a caller may reach
+    const std::uintptr_t frame = reinterpret_cast<std::uintptr_t>(__builtin_frame_address(0));
+    area = reinterpret_cast<volatile std::uint8_t *>(frame - STACK_PROBE_GUARD - length);
+    for (std::size_t i = 0; i < length; i++) {
+      area[i] = STACK_PROBE_FILL;
+    }
+    paintedLength = length;
+  }
+
+  /**
+   * Measures how deep the work since paint() went. The paint is used up.
+   *
+   * @param osaturated Set if the work overwrote the whole painted area, in which case it went at
+   * least as deep as the returned depth.
+   * @return The depth in bytes below the caller's frame, or `0` if nothing is painted. Depths
+   * within STACK_PROBE_GUARD cannot be told apart and are reported as STACK_PROBE_GUARD.
+   */
+  __attribute__((noinline)) std::size_t measure(bool &osaturated) {
+    osaturated = false;
+    if (paintedLength == 0) {
+      return 0;
+    }
+
+    // The start of the area is the deepest, so count the paint left there
+    std::size_t untouched = 0;
+    while (untouched < paintedLength && area[untouched] == STACK_PROBE_FILL) {
+      untouched++;
+    }
+
+    osaturated = untouched == 0;
+    const std::size_t depth = STACK_PROBE_GUARD + paintedLength - untouched;
+    paintedLength = 0;
+    return depth;
+  }
+
+  private:
+  volatile std::uint8_t *area{nullptr};
+  std::size_t paintedLength{0};
+};
+} // namespace bowlerserver
@@ -17,7 +17,6 @@
 #pragma once
 
 #include "bowlerPacket.hpp"
-#include <Arduino.h>
 
 namespace bowlerserver {
 /**
@@ -25,7 +24,7 @@ namespace bowlerserver {
  */
 class NoopPacket : public Packet {
   public:
-  NoopPacket(std::uint8_t iid, bool iisReliable = false) : Packet(iid, iisReliable) {
+  NoopPacket(std::uint16_t iid, bool iisReliable = false) : Packet(iid, iisReliable) {
   }
 
   std::int32_t event(std::uint8_t *payload) override {
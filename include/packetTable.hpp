@@ -0,0 +1,480 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#if !defined(PLATFORM_TEENSY)
+#include <mutex>
+#include <thread>
+#endif
+
+namespace bowlerserver {
+template <typename T> class PacketRegistry;
+
+/**
+ * An immutable table keyed by 16-bit packet id with constant time lookup. The id is split into a
+ * page index (high byte) and a slot index (low byte); pages are only allocated once an id in them
+ * is used, so a sparse id space stays small. Editing makes a new table which shares every
+ * untouched page and value with the old one.
+ */
+template <typename T> class PacketTable {
+  public:
+  /**
+   * @param iid The id to look up.
+   * @return The value for the id, or `nullptr` if there is none.
+   */
+  T *find(std::uint16_t iid) const {
+    const auto &page = pages[iid >> 8];
+    return page ? page->slots[iid & 0xFF].get() : nullptr;
+  }
+
+  /**
+   * Makes a copy of this table with a value added. The id cannot already be used.
+   *
+   * @param iid The id to add the value under.
+   * @param ivalue The value.
+   * @return The new table, or `nullptr` if the id is already used.
+   */
+  PacketTable *withInserted(std::uint16_t iid, std::shared_ptr<T> ivalue) const {
+    if (find(iid) != nullptr) {
+      return nullptr;
+    }
+
+    auto table = new PacketTable(*this);
+    auto &page = table->pages[iid >> 8];
+    std::shared_ptr<Page> newPage(page ? new Page(*page) : new Page());
+    newPage->slots[iid & 0xFF] = std::move(ivalue);
+    newPage->count++;
+    page = std::move(newPage);
+    table->count++;
+    return table;
+  }
+
+  /**
+   * Makes a copy of this table with several values added, copying each page it touches once. No
+   * id can already be used.
+   *
+   * @param ivalues The ids and the values to add under them.
+   * @return The new table, or `nullptr` if any id is already used (or appears twice).
+   */
+  PacketTable *
+  withInserted(const std::vector<std::pair<std::uint16_t, std::shared_ptr<T>>> &ivalues) const {
+    std::unique_ptr<PacketTable> table(new PacketTable(*this));
+    std::vector<std::pair<std::size_t, Page *>> copied;
+    for (auto &&elem : ivalues) {
+      if (table->find(elem.first) != nullptr) {
+        return nullptr;
+      }
+
+      Page &page = table->editPage(elem.first >> 8, copied);
+      page.slots[elem.first & 0xFF] = elem.second;
+      page.count++;
+      table->count++;
+    }
+    return table.release();
+  }
+
+  /**
+   * Makes a copy of this table with the value for an id swapped for another.
+   *
+   * @param iid The id of the value.
+   * @param iexpected The value the id must have now.
+   * @param ivalue The new value.
+   * @return The new table, or `nullptr` if the id does not have the expected value.
+   */
+  PacketTable *
+  withReplaced(std::uint16_t iid, const T *iexpected, std::shared_ptr<T> ivalue) const {
+    if (iexpected == nullptr || find(iid) != iexpected) {
+      return nullptr;
+    }
+
+    auto table = new PacketTable(*this);
+    auto &page = table->pages[iid >> 8];
+    std::shared_ptr<Page> newPage(new Page(*page));
+    newPage->slots[iid & 0xFF] = std::move(ivalue);
+    page = std::move(newPage);
+    return table;
+  }
+
+  /**
+   * Makes a copy of this table with a value removed. A page is dropped once its last value is.
+   *
+   * @param iid The id of the value.
+   * @return The new table, or `nullptr` if there is no value for the id.
+   */
+  PacketTable *withErased(std::uint16_t iid) const {
+    if (find(iid) == nullptr) {
+      return nullptr;
+    }
+
+    auto table = new PacketTable(*this);
+    auto &page = table->pages[iid >> 8];
+    if (page->count == 1) {
+      page.reset();
+    } else {
+      std::shared_ptr<Page> newPage(new Page(*page));
+      newPage->slots[iid & 0xFF].reset();
+      newPage->count--;
+      page = std::move(newPage);
+    }
+    table->count--;
+    return table;
+  }
+
+  /**
+   * Makes a copy of this table with several values removed, copying each page it touches once.
+   * Ids without a value are skipped.
+   *
+   * @param iids The ids of the values.
+   * @param oerased The number of values removed.
+   * @return The new table, or `nullptr` if no value was removed.
+   */
+  PacketTable *withErased(const std::vector<std::uint16_t> &iids, std::size_t &oerased) const {
+    oerased = 0;
+    std::unique_ptr<PacketTable> table(new PacketTable(*this));
+    std::vector<std::pair<std::size_t, Page *>> copied;
+    for (auto &&id : iids) {
+      if (table->find(id) == nullptr) {
+        continue;
+      }
+
+      Page &page = table->editPage(id >> 8, copied);
+      page.slots[id & 0xFF].reset();
+      page.count--;
+      table->count--;
+      oerased++;
+    }
+
+    for (auto &&elem : copied) {
+      if (elem.second->count == 0) {
+        table->pages[elem.first].reset();
+      }
+    }
+    return oerased == 0 ? nullptr : table.release();
+  }
+
+  /**
+   * Calls a function with every id and value, in id order.
+   *
+   * @param ifunc The function, called as `ifunc(id, value)`.
+   */
+  template <typename F> void forEach(F ifunc) const {
+    for (std::size_t i = 0; i < pages.size(); i++) {
+      if (pages[i]) {
+        for (std::size_t j = 0; j < pages[i]->slots.size(); j++) {
+          if (pages[i]->slots[j]) {
+            ifunc(static_cast<std::uint16_t>((i << 8) | j), *pages[i]->slots[j]);
+          }
+        }
+      }
+    }
+  }
+
+  /**
+   * @return The number of values in the table.
+   */
+  std::size_t size() const {
+    return count;
+  }
+
+  /**
+   * @return The heap this table and its pages and values take, counting pages shared with other
+   * tables too.
+   */
+  std::size_t getHeapBytes() const {
+    std::size_t bytes = sizeof(PacketTable);
+    for (auto &&page : pages) {
+      if (page) {
+        bytes += sizeof(Page) + page->count * sizeof(T);
+      }
+    }
+    return bytes;
+  }
+
+  private:
+  friend class PacketRegistry<T>;
+
+  struct Page {
+    std::array<std::shared_ptr<T>, 256> slots;
+    std::size_t count{0};
+  };
+
+  /**
+   * Gets a page of this (unpublished) table to edit, copying it the first time it is edited.
+   *
+   * @param iindex The page index.
+   * @param icopied The pages copied so far.
+   * @return The page.
+   */
+  Page &editPage(std::size_t iindex, std::vector<std::pair<std::size_t, Page *>> &icopied) {
+    for (auto &&elem : icopied) {
+      if (elem.first == iindex) {
+        return *elem.second;
+      }
+    }
+
+    auto &page = pages[iindex];
+    std::shared_ptr<Page> newPage(page ? new Page(*page) : new Page());
+    icopied.push_back(std::make_pair(iindex, newPage.get()));
+    page = std::move(newPage);
+    return *icopied.back().second;
+  }
+
+  std::array<std::shared_ptr<const Page>, 256> pages;
+  std::size_t count{0};
+  // Set by PacketRegistry when the table is published, in publishing order
+  std::uint32_t version{0};
+};
+
+#if defined(PLATFORM_TEENSY)
+// The Teensy has no threads, so every caller is the reader thread
+using RegistryThreadId = int;
+
+inline RegistryThreadId getRegistryThreadId() {
+  return 1;
+}
+
+// Nor is there anything to lock against
+class RegistryMutex {
+  public:
+  void lock() {
+  }
+
+  bool try_lock() {
+    return true;
+  }
+
+  void unlock() {
+  }
+};
+#else
+using RegistryThreadId = std::thread::id;
+
+inline RegistryThreadId getRegistryThreadId() {
+  return std::this_thread::get_id();
+}
+
+using RegistryMutex = std::mutex;
+#endif
+
+class RegistryLock {
+  public:
+  explicit RegistryLock(RegistryMutex &imutex) : mutex(imutex) {
+    mutex.lock();
+  }
+
+  ~RegistryLock() {
+    mutex.unlock();
+  }
+
+  private:
+  RegistryMutex &mutex;
+};
+
+/**
+ * Holds the current PacketTable. Writers (from any thread) build a new table and publish it
+ * atomically, so the one reader thread that dispatches packets never takes a lock. Old tables are
+ * freed right away if the reader is not using any table (between quiescent() and acquire()) or
+ * if the reader itself replaced them without acquiring them, and otherwise once the reader has
+ * passed a quiescent point after they were replaced. So the reader's own writes (e.g. from a
+ * packet event) and writes made while it is idle never pile up replaced tables.
+ */
+template <typename T> class PacketRegistry {
+  public:
+  PacketRegistry() : current(new PacketTable<T>()) {
+  }
+
+  virtual ~PacketRegistry() {
+    delete current.load();
+    for (auto &&elem : retired) {
+      delete elem.first;
+    }
+  }
+
+  /**
+   * Gets the current table. Only for the reader thread; the table stays valid until it next
+   * calls quiescent().
+   *
+   * @return The current table.
+   */
+  const PacketTable<T> &acquire() {
+    readerThread.store(getRegistryThreadId());
+    // Announce the reader before loading the table so a writer replacing it sees the reader
+    const bool wasActive = isReaderActive.exchange(true);
+    const PacketTable<T> *table = current.load();
+    if (!wasActive) {
+      firstAcquired = table->version;
+    }
+    lastAcquired = table->version;
+    return *table;
+  }
+
+  /**
+   * Marks that the reader thread no longer uses any table it acquired. Frees replaced tables if
+   * no writer is busy; never blocks.
+   */
+  void quiescent() {
+    readerEpoch.fetch_add(1);
+    isReaderActive.store(false);
+    if (hasRetired.load(std::memory_order_relaxed) && writeMutex.try_lock()) {
+      reclaim();
+      writeMutex.unlock();
+    }
+  }
+
+  /**
+   * Adds a value. The id cannot already be used.
+   *
+   * @param iid The id to add the value under.
+   * @param ivalue The value.
+   * @return False if the id is already used.
+   */
+  bool insert(std::uint16_t iid, std::shared_ptr<T> ivalue) {
+    RegistryLock lock(writeMutex);
+    return publish(current.load()->withInserted(iid, std::move(ivalue)));
+  }
+
+  /**
+   * Adds several values at once, publishing one new table for all of them.
+   *
+   * @param ivalues The ids and the values to add under them.
+   * @return False if any id is already used, in which case none are added.
+   */
+  bool insert(const std::vector<std::pair<std::uint16_t, std::shared_ptr<T>>> &ivalues) {
+    if (ivalues.empty()) {
+      return true;
+    }
+
+    RegistryLock lock(writeMutex);
+    return publish(current.load()->withInserted(ivalues));
+  }
+
+  /**
+   * Swaps the value for an id for another, unless the id was changed by someone else first.
+   *
+   * @param iid The id of the value.
+   * @param iexpected The value the id must have now.
+   * @param ivalue The new value.
+   * @return False if the id does not have the expected value.
+   */
+  bool replace(std::uint16_t iid, const T *iexpected, std::shared_ptr<T> ivalue) {
+    RegistryLock lock(writeMutex);
+    return publish(current.load()->withReplaced(iid, iexpected, std::move(ivalue)));
+  }
+
+  /**
+   * Removes a value.
+   *
+   * @param iid The id of the value.
+   * @return False if there is no value for the id.
+   */
+  bool erase(std::uint16_t iid) {
+    RegistryLock lock(writeMutex);
+    return publish(current.load()->withErased(iid));
+  }
+
+  /**
+   * Removes several values at once, publishing one new table for all of them.
+   *
+   * @param iids The ids of the values. Ids without a value are skipped.
+   * @return The number of values removed.
+   */
+  std::size_t erase(const std::vector<std::uint16_t> &iids) {
+    RegistryLock lock(writeMutex);
+    std::size_t erased = 0;
+    publish(current.load()->withErased(iids, erased));
+    return erased;
+  }
+
+  /**
+   * Calls a function with the current table from any thread. Holds off writers while it runs.
+   *
+   * @param ifunc The function, called as `ifunc(table)`.
+   */
+  template <typename F> void read(F ifunc) {
+    RegistryLock lock(writeMutex);
+    ifunc(*current.load());
+  }
+
+  /**
+   * @return The heap the current table and any tables waiting to be freed take. Safe to call from
+   * any thread.
+   */
+  std::size_t getHeapBytes() {
+    RegistryLock lock(writeMutex);
+    // Retired tables share most of their pages with the current one
+    return current.load()->getHeapBytes() + retired.size() * sizeof(PacketTable<T>) +
+           retired.capacity() * sizeof(retired[0]);
+  }
+
+  private:
+  bool publish(PacketTable<T> *inext) {
+    if (inext == nullptr) {
+      return false;
+    }
+
+    inext->version = ++publishCount;
+    const PacketTable<T> *old = current.exchange(inext);
+    retired.push_back(std::make_pair(old, readerEpoch.load()));
+    hasRetired.store(true, std::memory_order_relaxed);
+    reclaim();
+    return true;
+  }
+
+  void reclaim() {
+    // Only loaded after every retired table was replaced, so a reader which could still be using
+    // one is seen as active
+    const bool isReaderIdle = !isReaderActive.load();
+    const bool isReader = !isReaderIdle && readerThread.load() == getRegistryThreadId();
+    const std::uint32_t epoch = readerEpoch.load();
+    auto keep = retired.begin();
+    for (auto it = retired.begin(); it != retired.end(); ++it) {
+      // The reader has passed a quiescent point since this table was replaced, or it is this
+      // thread and never acquired the table since its last quiescent point
+      const std::uint32_t version = it->first->version;
+      if (isReaderIdle || static_cast<std::int32_t>(epoch - it->second) > 0 ||
+          (isReader && (static_cast<std::int32_t>(version - firstAcquired) < 0 ||
+                        static_cast<std::int32_t>(version - lastAcquired) > 0))) {
+        delete it->first;
+      } else {
+        *keep++ = *it;
+      }
+    }
+    retired.erase(keep, retired.end());
+    hasRetired.store(!retired.empty(), std::memory_order_relaxed);
+  }
+
+  std::atomic<const PacketTable<T> *> current;
+  std::atomic<std::uint32_t> readerEpoch{0};
+  std::atomic<bool> hasRetired{false};
+  std::atomic<bool> isReaderActive{false};
+  std::atomic<RegistryThreadId> readerThread{RegistryThreadId()};
+  // The versions of the first and last tables the reader acquired since its last quiescent point.
+  // Only used by the reader thread.
+  std::uint32_t firstAcquired{0};
+  std::uint32_t lastAcquired{0};
+  std::uint32_t publishCount{0};
+  RegistryMutex writeMutex;
+  std::vector<std::pair<const PacketTable<T> *, std::uint32_t>> retired;
+};
+} // namespace bowlerserver
@@ -0,0 +1,172 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerPacket.hpp"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <type_traits>
+
+namespace bowlerserver {
+const std::int32_t REGISTER_RANGE_LENGTH = 3;
+// Set in a range's count byte to write the range instead of reading it
+const std::uint8_t REGISTER_RANGE_WRITE = 1 << 7;
+
+/**
+ * A Packet which exposes a table of up to R typed variables (registers) so the PC can read and
+ * write many of them in one frame, instead of needing a packet per variable. A register's address
+ * is its index in the table. Registers are fixed-width integers or floats and go on the wire
+ * little endian at their own size.
+ *
+ * Request payload format is: <Range count (1 byte)> <Ranges (REGISTER_RANGE_LENGTH bytes each)>
+ * <Write data>. Each range is <First address (2 bytes)> <Count (1 byte)> and covers Count
+ * consecutive registers; REGISTER_RANGE_WRITE in the count byte makes it a write range. The values
+ * for the write ranges follow the ranges, packed in order.
+ *
+ * Reply payload format is: <Status (1 byte)> <Read data>, with the values of the read ranges
+ * packed in order.
+ *
+ * The whole request is checked before anything is written. A range with an unused address, a
+ * write to a read-only register, or data which does not fit in the payload rejects the request
+ * with STATUS_REJECTED_GENERIC. Writes happen before reads, so one frame can write setpoints and
+ * read back state.
+ */
+template <std::size_t N, std::size_t R> class RegisterMapPacket : public Packet {
+  static_assert(R <= UINT16_MAX + 1, "Registers are addressed with 16-bit addresses.");
+
+  public:
+  RegisterMapPacket(std::uint16_t iid, bool iisReliable = false) : Packet(iid, iisReliable) {
+  }
+
+  /**
+   * Adds a register.
+   *
+   * @param iaddress The address of the register. Must be less than R and not already used.
+   * @param ivalue The variable. Must outlive the packet, and is only accessed from the packet
+   * event.
+   * @param iisWritable Whether the PC may write the register.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  template <typename T>
+  std::int32_t addRegister(std::uint16_t iaddress, T *ivalue, bool iisWritable = true) {
+    static_assert(std::is_integral<T>::value || std::is_same<T, float>::value,
+                  "Registers must be fixed-width integers or floats.");
+    static_assert(!std::is_same<T, bool>::value, "Use a std::uint8_t register for flags.");
+    static_assert(sizeof(RegisterBits<T>) == sizeof(T), "Floats must be 32 bits.");
+
+    if (iaddress >= R || registers[iaddress].value != nullptr) {
+      errno = EINVAL;
+      return BOWLER_ERROR;
+    }
+
+    registers[iaddress] =
+      Register{ivalue, sizeof(T), iisWritable, &readRegister<T>, &writeRegister<T>};
+    return 1;
+  }
+
+  std::int32_t event(std::uint8_t *payload) override {
+    const std::size_t length = getPayloadLength<N>();
+    const std::size_t rangeCount = payload[0];
+    const std::size_t rangesEnd = 1 + rangeCount * REGISTER_RANGE_LENGTH;
+
+    // Check every range first so a bad request changes nothing
+    std::size_t writeLength = 0;
+    std::size_t readLength = 0;
+    bool isValid = rangesEnd <= length;
+    for (std::size_t i = 0; isValid && i < rangeCount; i++) {
+      const std::uint8_t *range = payload + 1 + i * REGISTER_RANGE_LENGTH;
+      const std::size_t first = readLittleEndian<std::uint16_t>(range);
+      const std::size_t count = range[2] & ~REGISTER_RANGE_WRITE;
+      const bool isWrite = range[2] & REGISTER_RANGE_WRITE;
+      for (std::size_t address = first; isValid && address < first + count; address++) {
+        isValid = address < R && registers[address].value != nullptr &&
+                  (!isWrite || registers[address].isWritable);
+        if (isValid) {
+          (isWrite ? writeLength : readLength) += registers[address].size;
+        }
+      }
+    }
+
+    if (!isValid || rangesEnd + writeLength > length || 1 + readLength > length) {
+      payload[0] = STATUS_REJECTED_GENERIC;
+      errno = isValid ? EMSGSIZE : EINVAL;
+      return BOWLER_ERROR;
+    }
+
+    // The reply overwrites the request, so gather the reads on the side
+    const std::uint8_t *writeData = payload + rangesEnd;
+    std::uint8_t *readData = replyData.data();
+    for (std::size_t pass = 0; pass < 2; pass++) {
+      const bool isWritePass = pass == 0;
+      for (std::size_t i = 0; i < rangeCount; i++) {
+        const std::uint8_t *range = payload + 1 + i * REGISTER_RANGE_LENGTH;
+        if (bool(range[2] & REGISTER_RANGE_WRITE) != isWritePass) {
+          continue;
+        }
+
+        const std::size_t first = readLittleEndian<std::uint16_t>(range);
+        const std::size_t count = range[2] & ~REGISTER_RANGE_WRITE;
+        for (std::size_t address = first; address < first + count; address++) {
+          const Register &reg = registers[address];
+          if (isWritePass) {
+            reg.write(reg.value, writeData);
+            writeData += reg.size;
+          } else {
+            reg.read(reg.value, readData);
+            readData += reg.size;
+          }
+        }
+      }
+    }
+
+    payload[0] = STATUS_ACCEPTED;
+    std::memcpy(payload + 1, replyData.data(), readLength);
+    std::fill(payload + 1 + readLength, payload + length, 0);
+    return 1;
+  }
+
+  protected:
+  struct Register {
+    void *value;
+    std::uint8_t size;
+    bool isWritable;
+    void (*read)(const void *, std::uint8_t *);
+    void (*write)(void *, const std::uint8_t *);
+  };
+
+  // Registers go on the wire as their bit pattern; floats as the same size integer
+  template <typename T>
+  using RegisterBits =
+    typename std::conditional<std::is_same<T, float>::value, std::uint32_t, T>::type;
+
+  template <typename T> static void readRegister(const void *ivalue, std::uint8_t *obuffer) {
+    RegisterBits<T> bits;
+    std::memcpy(&bits, ivalue, sizeof(bits));
+    writeLittleEndian(obuffer, bits);
+  }
+
+  template <typename T> static void writeRegister(void *ovalue, const std::uint8_t *ibuffer) {
+    const RegisterBits<T> bits = readLittleEndian<RegisterBits<T>>(ibuffer);
+    std::memcpy(ovalue, &bits, sizeof(bits));
+  }
+
+  std::array<Register, R> registers{};
+  std::array<std::uint8_t, N - HEADER_LENGTH> replyData;
+};
+} // namespace bowlerserver
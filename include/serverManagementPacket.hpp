@@ -18,7 +18,9 @@
 
 #include "bowlerDeviceServerUtil.hpp"
 #include "bowlerPacket.hpp"
-#include <Arduino.h>
+#include "frameTrace.hpp"
+#include "linkMonitor.hpp"
+#include "loopHealth.hpp"
 
 namespace bowlerserver {
 /**
@@ -34,9 +36,14 @@ template <std::size_t N> class ServerManagementPacket : public Packet {
     const std::uint8_t operation = payload[0];
     switch (operation) {
     case OPERATION_DISCONNECT_ID: {
-      for (auto &&id : coms->getAllPacketIDs()) {
-        coms->removePacket(id);
-      }
+      coms->removePackets(coms->getAllPacketIDs());
+
+      // The handlers are gone so there is nothing left to resume, and the next PC will start out
+      // with the legacy header format
+      sessionToken = 0;
+      coms->setHeaderFormat(HEADER_FORMAT_LEGACY);
+      coms->setGroupIndex(GROUP_INDEX_NONE);
+      coms->clearScheduledCommands();
 
       payload[0] = STATUS_ACCEPTED;
       return 2;
@@ -47,11 +54,220 @@ template <std::size_t N> class ServerManagementPacket : public Packet {
         payload[0] = STATUS_REJECTED_GENERIC;
         return BOWLER_ERROR;
       } else {
+        sessionToken = makeSessionToken();
         payload[0] = STATUS_ACCEPTED;
         return 1;
       }
     }
 
+    case OPERATION_READ_FRAME_TRACE: {
+      // Request format is: <Operation (1 byte)> <Start seq (4 bytes)>.
+      // Reply format is: <Status (1 byte)> <Entry count (1 byte)> <First seq (4 bytes)>
+      // <Recorded count (4 bytes)> <Entries (FRAME_TRACE_ENTRY_LENGTH bytes each)>.
+      FrameTrace *trace = coms->getFrameTrace();
+      if (trace == nullptr || PAYLOAD_LENGTH < FRAME_TRACE_REPLY_HEADER_LENGTH) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        errno = ENOTSUP;
+        return BOWLER_ERROR;
+      }
+
+      const std::uint32_t startSeq = readLittleEndian<std::uint32_t>(payload + 1);
+      const std::uint32_t recordedCount = trace->getRecordedCount();
+      std::uint32_t firstSeq;
+      const std::size_t count = trace->serialize(startSeq,
+                                                 payload + FRAME_TRACE_REPLY_HEADER_LENGTH,
+                                                 PAYLOAD_LENGTH - FRAME_TRACE_REPLY_HEADER_LENGTH,
+                                                 firstSeq);
+
+      payload[0] = STATUS_ACCEPTED;
+      payload[1] = static_cast<std::uint8_t>(count);
+      writeLittleEndian(payload + 2, firstSeq);
+      writeLittleEndian(payload + 6, recordedCount);
+      return 1;
+    }
+
+    case OPERATION_TIME_SYNC: {
+      // Request format is: <Operation (1 byte)> <Origin time (8 bytes)>.
+      // Reply format is: <Status (1 byte)> <Origin time (8 bytes)> <Receive time (8 bytes)>
+      // <Transmit time (8 bytes)>. The origin time is the PC's send time, echoed back so the PC
+      // can compute offset and round trip time like NTP does.
+      if (PAYLOAD_LENGTH < TIME_SYNC_REPLY_LENGTH) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        errno = EMSGSIZE;
+        return BOWLER_ERROR;
+      }
+
+      payload[0] = STATUS_ACCEPTED;
+      writeLittleEndian(payload + 9, static_cast<std::int64_t>(coms->getLastReceiveTime()));
+      writeLittleEndian(payload + 17, static_cast<std::int64_t>(getTime()));
+      return 1;
+    }
+
+    case OPERATION_SET_FRAME_TIMESTAMPS: {
+      // Request format is: <Operation (1 byte)> <Packet id (2 bytes)> <Enabled (1 byte)>.
+      auto packet = coms->getPacket(readLittleEndian<std::uint16_t>(payload + 1));
+      if (packet == nullptr || N < HEADER_LENGTH + FRAME_TIMESTAMPS_LENGTH) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        errno = EINVAL;
+        return BOWLER_ERROR;
+      }
+
+      packet->setTimestamped(payload[3] != 0);
+      payload[0] = STATUS_ACCEPTED;
+      return 1;
+    }
+
+    case OPERATION_SET_COMPRESSION: {
+      // Request format is: <Operation (1 byte)> <Packet id (2 bytes)> <Codec (1 byte)>, with a
+      // COMPRESSION_CODEC_* codec. Codecs the device does not have are rejected, so the PC can
+      // fall back to another one.
+      const std::uint16_t id = readLittleEndian<std::uint16_t>(payload + 1);
+      const std::uint8_t codec = payload[3];
+      auto packet = coms->getPacket(id);
+      if (packet == nullptr || id == SERVER_MANAGEMENT_PACKET_ID ||
+          (codec != COMPRESSION_CODEC_NONE && codec != COMPRESSION_CODEC_LZ)) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        errno = EINVAL;
+        return BOWLER_ERROR;
+      }
+
+      packet->setCompressed(codec == COMPRESSION_CODEC_LZ);
+      payload[0] = STATUS_ACCEPTED;
+      return 1;
+    }
+
+    case OPERATION_GET_SESSION: {
+      // Reply format is: <Status (1 byte)> <Session token (4 bytes)>. The token is 0 if there is
+      // no session.
+      payload[0] = STATUS_ACCEPTED;
+      writeLittleEndian(payload + 1, sessionToken);
+      return 1;
+    }
+
+    case OPERATION_RESUME_SESSION: {
+      // Request format is: <Operation (1 byte)> <Session token (4 bytes)>. Keeps every packet
+      // event handler and only resets RDT state, so a reconnecting PC does not need to
+      // disconnect and add the ensured packets again. Like a disconnect, this is accepted
+      // whatever Seq Num it comes with. Commands the last PC scheduled are dropped because the
+      // new PC cannot know about them.
+      const std::uint32_t token = readLittleEndian<std::uint32_t>(payload + 1);
+      if (sessionToken == 0 || token != sessionToken) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        errno = EINVAL;
+        return BOWLER_ERROR;
+      }
+
+      coms->resetReliableState();
+      coms->clearScheduledCommands();
+      payload[0] = STATUS_ACCEPTED;
+      // Return 2 so our own RDT state goes back to the starting state as well
+      return 2;
+    }
+
+    case OPERATION_SET_HEADER_FORMAT: {
+      // Request format is: <Operation (1 byte)> <Header format (1 byte)>. This reply still uses the
+      // old format.
+      if (coms->setHeaderFormat(payload[1]) == BOWLER_ERROR) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        return BOWLER_ERROR;
+      }
+
+      payload[0] = STATUS_ACCEPTED;
+      return 1;
+    }
+
+    case OPERATION_READ_LOOP_HEALTH: {
+      // Request format is: <Operation (1 byte)> <Histogram (1 byte)> <Reset (1 byte)>.
+      // Reply format is: <Status (1 byte)> <Histogram (1 byte)> <Target period (4 bytes)>
+      // <Histogram (LOOP_HISTOGRAM_LENGTH bytes)>. The histogram is cleared after it is read if
+      // Reset is nonzero.
+      LoopHealth *health = coms->getLoopHealth();
+      const std::uint8_t histogram = payload[1];
+      if (health == nullptr || histogram >= LOOP_HEALTH_HISTOGRAM_COUNT ||
+          PAYLOAD_LENGTH < LOOP_HEALTH_REPLY_LENGTH) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        errno = health == nullptr ? ENOTSUP : EINVAL;
+        return BOWLER_ERROR;
+      }
+
+      const bool reset = payload[2] != 0;
+      payload[0] = STATUS_ACCEPTED;
+      writeLittleEndian(payload + 2, static_cast<std::uint32_t>(health->getTargetPeriod()));
+      health->getHistogram(histogram).serialize(payload + 6);
+      if (reset) {
+        health->reset(histogram);
+      }
+      return 1;
+    }
+
+    case OPERATION_READ_MEMORY_STATS: {
+      // Request format is: <Operation (1 byte)> <Reset (1 byte)>.
+      // Reply format is: <Status (1 byte)> <Memory stats (MEMORY_STATS_LENGTH bytes)>
+      // <Packet count (2 bytes)>. The peak stack depth is cleared after it is read if Reset is
+      // nonzero.
+      if (PAYLOAD_LENGTH < MEMORY_STATS_REPLY_LENGTH) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        errno = EINVAL;
+        return BOWLER_ERROR;
+      }
+
+      const bool reset = payload[1] != 0;
+      payload[0] = STATUS_ACCEPTED;
+      coms->getMemoryStats().serialize(payload + 1);
+      writeLittleEndian(payload + 1 + MEMORY_STATS_LENGTH,
+                        static_cast<std::uint16_t>(coms->getAllPacketIDs().size()));
+      if (reset) {
+        coms->resetStackPeak();
+      }
+      return 1;
+    }
+
+    case OPERATION_READ_UNUSED_PACKETS: {
+      // Request format is: <Operation (1 byte)>.
+      // Reply format is: <Status (1 byte)> <Count (2 bytes)> <IDs (2 bytes each)>, listing the
+      // lazily made packets which have not been used yet. IDs past the end of the payload are
+      // left out but still counted.
+      const std::vector<std::uint16_t> ids = coms->getUnusedPacketIDs();
+      payload[0] = STATUS_ACCEPTED;
+      writeLittleEndian(payload + 1, static_cast<std::uint16_t>(ids.size()));
+      for (std::size_t i = 0; i < ids.size() && 3 + 2 * (i + 1) <= PAYLOAD_LENGTH; i++) {
+        writeLittleEndian(payload + 3 + 2 * i, ids[i]);
+      }
+      return 1;
+    }
+
+    case OPERATION_HEARTBEAT: {
+      // Request format is: <Operation (1 byte)>. Keeps the link up while the PC has nothing else
+      // to send (any frame does).
+      // Reply format is: <Status (1 byte)> <Timeout (4 bytes)> <Link stats (LINK_STATS_LENGTH
+      // bytes)>.
+      LinkMonitor *link = coms->getLinkMonitor();
+      if (link == nullptr || PAYLOAD_LENGTH < HEARTBEAT_REPLY_LENGTH) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        errno = link == nullptr ? ENOTSUP : EINVAL;
+        return BOWLER_ERROR;
+      }
+
+      payload[0] = STATUS_ACCEPTED;
+      writeLittleEndian(payload + 1, static_cast<std::uint32_t>(link->getTimeout()));
+      link->serialize(payload + 5);
+      return 1;
+    }
+
+    case OPERATION_CLEAR_SCHEDULED_COMMANDS: {
+      // Request format is: <Operation (1 byte)>. Stops a buffered trajectory.
+      coms->clearScheduledCommands();
+      payload[0] = STATUS_ACCEPTED;
+      return 1;
+    }
+
+    case OPERATION_SET_GROUP_INDEX: {
+      // Request format is: <Operation (1 byte)> <Group index (2 bytes)>.
+      coms->setGroupIndex(readLittleEndian<std::uint16_t>(payload + 1));
+      payload[0] = STATUS_ACCEPTED;
+      return 1;
+    }
+
     default: {
       errno = EINVAL;
       return BOWLER_ERROR;
@@ -60,6 +276,21 @@ template <std::size_t N> class ServerManagementPacket : public Packet {
   }
 
   private:
+  std::uint32_t makeSessionToken() {
+    // Mix in the time so tokens differ across reboots. 0 is reserved for no session.
+    std::uint32_t token = static_cast<std::uint32_t>(getTime()) ^ (++sessionCount << 24);
+    return token == 0 ? 1 : token;
+  }
+
+  static const std::size_t PAYLOAD_LENGTH = N - HEADER_LENGTH;
+  static const std::size_t FRAME_TRACE_REPLY_HEADER_LENGTH = 10;
+  static const std::size_t TIME_SYNC_REPLY_LENGTH = 25;
+  static const std::size_t LOOP_HEALTH_REPLY_LENGTH = 6 + LOOP_HISTOGRAM_LENGTH;
+  static const std::size_t MEMORY_STATS_REPLY_LENGTH = 3 + MEMORY_STATS_LENGTH;
+  static const std::size_t HEARTBEAT_REPLY_LENGTH = 5 + LINK_STATS_LENGTH;
+
   BowlerComs<N> *coms;
+  std::uint32_t sessionToken{0};
+  std::uint32_t sessionCount{0};
 };
 } // namespace bowlerserver
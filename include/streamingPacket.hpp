@@ -0,0 +1,205 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerPacket.hpp"
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace bowlerserver {
+const std::uint8_t FRAGMENT_FIRST = 1;
+const std::uint8_t FRAGMENT_LAST = 2;
+const std::uint8_t FRAGMENT_READ = 4;
+
+const std::int32_t FRAGMENT_HEADER_LENGTH = 6;
+
+/**
+ * A Packet which transfers objects larger than one frame as a series of fragments. Each chunk is
+ * handed to the packet as it arrives.
+ *
+ * Payload format is:
+ * <Flags (1 byte)> <Status (1 byte)> <Offset (2 bytes)> <Length (2 bytes)> <Data (Length bytes)>.
+ *
+ * The PC sends the object with FRAGMENT_FIRST on the first fragment and FRAGMENT_LAST on the last
+ * one. A fragment with FRAGMENT_READ asks for a chunk of the packet's reply instead; the reply
+ * has FRAGMENT_LAST set once the end is reached. The status byte is set in every reply.
+ * Fragments carry as much data as fits in the packet's frame length (see
+ * getFragmentDataLength).
+ */
+template <std::size_t N> class StreamingPacket : public Packet {
+  static_assert(N >= HEADER_LENGTH + FRAGMENT_HEADER_LENGTH + 1,
+                "Packet length must leave room for the fragment header plus one data byte.");
+
+  public:
+  StreamingPacket(std::uint16_t iid, bool iisReliable = false) : Packet(iid, iisReliable) {
+  }
+
+  std::int32_t event(std::uint8_t *payload) override {
+    const std::uint8_t flags = payload[0];
+    const std::uint16_t offset = readLittleEndian<std::uint16_t>(payload + 2);
+    std::uint16_t length = readLittleEndian<std::uint16_t>(payload + 4);
+    std::uint8_t *data = payload + FRAGMENT_HEADER_LENGTH;
+
+    const std::uint16_t dataLength = getFragmentDataLength();
+    std::int32_t error;
+    if (length > dataLength) {
+      errno = EMSGSIZE;
+      error = BOWLER_ERROR;
+    } else if (flags & FRAGMENT_READ) {
+      bool last = false;
+      length = dataLength;
+      error = readChunk(data, offset, length, last);
+      payload[0] = last ? (flags | FRAGMENT_LAST) : (flags & ~FRAGMENT_LAST);
+    } else {
+      error = writeChunk(data, offset, length, flags);
+    }
+
+    if (error == BOWLER_ERROR) {
+      length = 0;
+    }
+
+    payload[1] = error == BOWLER_ERROR ? STATUS_REJECTED_GENERIC : STATUS_ACCEPTED;
+    writeLittleEndian(payload + 4, length);
+    return error;
+  }
+
+  /**
+   * Handles a chunk of the object being sent by the PC.
+   *
+   * @param idata The chunk.
+   * @param ioffset The offset of the chunk inside the object.
+   * @param ilength The length of the chunk.
+   * @param iflags The fragment flags (FRAGMENT_FIRST and FRAGMENT_LAST).
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  virtual std::int32_t writeChunk(const std::uint8_t *idata,
+                                  std::uint16_t ioffset,
+                                  std::uint16_t ilength,
+                                  std::uint8_t iflags) = 0;
+
+  /**
+   * Produces a chunk of the reply for the PC. Has no reply by default.
+   *
+   * @param odata The buffer to write the chunk into.
+   * @param ioffset The offset of the chunk inside the reply.
+   * @param iolength The room in the buffer. Set it to the length of the chunk.
+   * @param olast Set this if the chunk reaches the end of the reply.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  virtual std::int32_t readChunk(std::uint8_t * /*odata*/,
+                                 std::uint16_t /*ioffset*/,
+                                 std::uint16_t &iolength,
+                                 bool &olast) {
+    iolength = 0;
+    olast = true;
+    return 1;
+  }
+
+  /**
+   * @return The number of data bytes each fragment can carry in this packet's frames (see
+   * Packet::setFrameLength).
+   */
+  std::uint16_t getFragmentDataLength() const {
+    const std::size_t payloadLength = getPayloadLength<N>();
+    if (payloadLength <= static_cast<std::size_t>(FRAGMENT_HEADER_LENGTH)) {
+      return 0;
+    }
+    return static_cast<std::uint16_t>(payloadLength - FRAGMENT_HEADER_LENGTH);
+  }
+};
+
+/**
+ * A StreamingPacket which reassembles the object into a preallocated buffer of M bytes and
+ * handles it once the last fragment arrives. Fragments must arrive in order; an out-of-order
+ * fragment is rejected so the PC can resend it. The reply is written back into the same buffer
+ * and can be read out with FRAGMENT_READ fragments.
+ */
+template <std::size_t N, std::size_t M> class ReassemblingPacket : public StreamingPacket<N> {
+  static_assert(M <= UINT16_MAX, "Reassembled objects are addressed with 16-bit offsets.");
+
+  public:
+  ReassemblingPacket(std::uint16_t iid, bool iisReliable = false)
+    : StreamingPacket<N>(iid, iisReliable) {
+  }
+
+  std::int32_t writeChunk(const std::uint8_t *idata,
+                          std::uint16_t ioffset,
+                          std::uint16_t ilength,
+                          std::uint8_t iflags) override {
+    if (iflags & FRAGMENT_FIRST) {
+      received = 0;
+      replyLength = 0;
+    }
+
+    if (ioffset != received) {
+      // Missing or repeated fragment
+      errno = EILSEQ;
+      return BOWLER_ERROR;
+    }
+
+    if (ioffset + ilength > M) {
+      errno = EMSGSIZE;
+      return BOWLER_ERROR;
+    }
+
+    std::memcpy(buffer.data() + ioffset, idata, ilength);
+    received += ilength;
+
+    if (iflags & FRAGMENT_LAST) {
+      std::size_t length = 0;
+      auto error = eventReassembled(buffer.data(), received, length);
+      replyLength = error == BOWLER_ERROR ? 0 : std::min(length, M);
+      return error;
+    }
+
+    return 1;
+  }
+
+  std::int32_t readChunk(std::uint8_t *odata,
+                         std::uint16_t ioffset,
+                         std::uint16_t &iolength,
+                         bool &olast) override {
+    if (ioffset > replyLength) {
+      errno = EINVAL;
+      return BOWLER_ERROR;
+    }
+
+    iolength = static_cast<std::uint16_t>(std::min<std::size_t>(iolength, replyLength - ioffset));
+    std::memcpy(odata, buffer.data() + ioffset, iolength);
+    olast = ioffset + iolength == replyLength;
+    return 1;
+  }
+
+  /**
+   * Processes the reassembled object (read from it, do something, write a reply back into it).
+   *
+   * @param iodata The reassembled object. Has room for M bytes.
+   * @param ilength The length of the object.
+   * @param oreplyLength Set this to the length of the reply written into the buffer.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  virtual std::int32_t
+  eventReassembled(std::uint8_t *iodata, std::size_t ilength, std::size_t &oreplyLength) = 0;
+
+  private:
+  std::array<std::uint8_t, M> buffer;
+  std::size_t received{0};
+  std::size_t replyLength{0};
+};
+} // namespace bowlerserver
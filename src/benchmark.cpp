@@ -0,0 +1,148 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if defined(PLATFORM_NATIVE) && defined(BOWLER_BENCHMARK)
+
+#include "bowlerNativeUdpServer.hpp"
+#include "defaultBowlerComs.hpp"
+#include "noopPacket.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+using namespace bowlerserver;
+
+/**
+ * A UDP socket on the loopback interface standing in for the PC. Frames are sent and received in
+ * batches so the client's own system calls do not hide the server's.
+ */
+class BenchmarkClient {
+  public:
+  BenchmarkClient(std::uint16_t iserverPort, std::size_t ibatchSize)
+    : buffers(ibatchSize), vectors(ibatchSize), headers(ibatchSize) {
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.sin_port = htons(iserverPort);
+    for (std::size_t i = 0; i < ibatchSize; i++) {
+      vectors[i].iov_base = buffers[i].data();
+      vectors[i].iov_len = DEFAULT_PACKET_SIZE;
+      headers[i].msg_hdr.msg_iov = &vectors[i];
+      headers[i].msg_hdr.msg_iovlen = 1;
+    }
+  }
+
+  ~BenchmarkClient() {
+    close(fd);
+  }
+
+  /**
+   * Sends copies of a frame with one system call.
+   *
+   * @param iframe The frame.
+   * @param icount The number of copies, at most the batch size.
+   * @return The number sent.
+   */
+  std::size_t send(const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> &iframe,
+                   std::size_t icount) {
+    for (std::size_t i = 0; i < icount; i++) {
+      buffers[i] = iframe;
+      headers[i].msg_hdr.msg_name = &server;
+      headers[i].msg_hdr.msg_namelen = sizeof(server);
+    }
+    const int count = sendmmsg(fd, headers.data(), icount, 0);
+    return count < 0 ? 0 : static_cast<std::size_t>(count);
+  }
+
+  /**
+   * Receives the replies which have arrived, without waiting, with one system call.
+   *
+   * @return The number received.
+   */
+  std::size_t receive() {
+    for (auto &&header : headers) {
+      header.msg_hdr.msg_name = nullptr;
+      header.msg_hdr.msg_namelen = 0;
+    }
+    const int count = recvmmsg(fd, headers.data(), headers.size(), MSG_DONTWAIT, nullptr);
+    return count < 0 ? 0 : static_cast<std::size_t>(count);
+  }
+
+  private:
+  int fd;
+  sockaddr_in server{};
+  std::vector<std::array<std::uint8_t, DEFAULT_PACKET_SIZE>> buffers;
+  std::vector<iovec> vectors;
+  std::vector<mmsghdr> headers;
+};
+
+/**
+ * Measures how many frames per second one thread of coms handles over loopback UDP.
+ *
+ * @param ibatchSize The server's batch size and the coms' drain limit.
+ * @return The frames per second.
+ */
+static double measureUdpFrameRate(std::size_t ibatchSize) {
+  const std::uint16_t port = 21900;
+  NativeUDPServer<DEFAULT_PACKET_SIZE> *server =
+    new NativeUDPServer<DEFAULT_PACKET_SIZE>(port, ibatchSize);
+  if (!server->isOpen()) {
+    delete server;
+    return 0;
+  }
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<NativeUDPServer<DEFAULT_PACKET_SIZE>>(server)};
+  coms.setDrainLimit(ibatchSize);
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2, false)));
+
+  // Keep a window of frames in flight so the server always has a batch waiting
+  const std::size_t frameCount = 200000;
+  const std::size_t window = 64;
+  BenchmarkClient client(port, window);
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> frame{2, 0, 0};
+  std::size_t sent = 0;
+  std::size_t replied = 0;
+  const auto start = getTime();
+  while (replied < frameCount) {
+    sent += client.send(frame, std::min(frameCount - sent, window - (sent - replied)));
+    coms.loop();
+    replied += client.receive();
+  }
+
+  return frameCount * 1e6 / (getTime() - start);
+}
+
+/**
+ * Usage: benchmark [runs]
+ *
+ * Prints the median frame rate of one thread of coms over loopback UDP without batching and with
+ * batches of 8 and 32 (see NativeUDPServer). The numbers depend on the machine and kernel, so
+ * this is a separate program rather than part of the unit tests.
+ */
+int main(int argc, char **argv) {
+  const std::size_t runs = argc > 1 ? std::max(1ul, std::strtoul(argv[1], nullptr, 10)) : 5;
+  for (std::size_t batchSize : {1, 8, 32}) {
+    std::vector<double> rates;
+    for (std::size_t i = 0; i < runs; i++) {
+      rates.push_back(measureUdpFrameRate(batchSize));
+    }
+    std::sort(rates.begin(), rates.end());
+    std::printf("UDP batch %zu: %.0f frames/s\n", batchSize, rates[rates.size() / 2]);
+  }
+  return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if defined(PLATFORM_NATIVE) && !defined(UNIT_TEST)
+
+#include "bowlerDeviceFarm.hpp"
+#include "noopPacket.hpp"
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+
+using namespace bowlerserver;
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+  stopRequested = 1;
+}
+
+/**
+ * Usage: deviceFarm [device count] [base port] [worker count] [batch size]
+ *
+ * Simulates many devices and prints the frames per second each worker (core) handles.
+ */
+int main(int argc, char **argv) {
+  const std::size_t deviceCount = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000;
+  const unsigned long port = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20000;
+  if (port > 0xFFFF) {
+    BOWLER_LOG("The base port must be at most 65535, not %lu\n", port);
+    return EXIT_FAILURE;
+  }
+  const auto basePort = static_cast<std::uint16_t>(port);
+  std::size_t workerCount = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 0;
+  if (workerCount == 0) {
+    workerCount = std::max(1u, std::thread::hardware_concurrency());
+  }
+  const std::size_t batchSize = argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 1;
+
+  DeviceFarm<DEFAULT_PACKET_SIZE> farm(
+    deviceCount, basePort, workerCount, [](DefaultBowlerComs<DEFAULT_PACKET_SIZE> &icoms) {
+      // Same packets as the firmware in main.cpp
+      icoms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2, true)));
+    },
+    batchSize);
+
+  if (farm.start() == BOWLER_ERROR) {
+    BOWLER_LOG("Error starting the device farm: %d %s\n", errno, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  std::signal(SIGINT, requestStop);
+  std::printf("Simulating %zu devices on ports %u-%zu with %zu workers\n",
+              deviceCount,
+              basePort,
+              basePort + deviceCount - 1,
+              workerCount);
+
+  std::vector<std::uint64_t> last(workerCount, 0);
+  while (!stopRequested) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < workerCount; i++) {
+      const std::uint64_t frames = farm.getFramesHandled(i);
+      std::printf("worker %zu: %llu frames/s\n", i, (unsigned long long)(frames - last[i]));
+      total += frames - last[i];
+      last[i] = frames;
+    }
+    std::printf("total: %llu frames/s\n", (unsigned long long)total);
+    std::fflush(stdout);
+  }
+
+  farm.stop();
+  return EXIT_SUCCESS;
+}
+
+#endif
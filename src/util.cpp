@@ -16,6 +16,21 @@
  */
 #include "bowlerDeviceServerUtil.hpp"
 
+#if defined(PLATFORM_ESP32)
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#elif defined(PLATFORM_TEENSY)
+#include <malloc.h>
+#elif defined(PLATFORM_NATIVE)
+#include <ctime>
+#include <malloc.h>
+#endif
+
+#if defined(PLATFORM_TEENSY)
+extern "C" char *sbrk(int incr);
+#endif
+
 namespace bowlerserver {
 #if defined(PLATFORM_ESP32)
 time_t getTime() {
@@ -25,5 +40,62 @@ time_t getTime() {
 time_t getTime() {
   return micros();
 }
+#elif defined(PLATFORM_NATIVE)
+time_t getTime() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<time_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+#endif
+
+#if defined(PLATFORM_ESP32)
+std::size_t getFreeHeap() {
+  return heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+}
+
+std::size_t getLargestFreeBlock() {
+  return heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
+}
+
+std::size_t getStackHeadroom() {
+  // ESP-IDF counts stack in bytes
+  return uxTaskGetStackHighWaterMark(nullptr);
+}
+#elif defined(PLATFORM_TEENSY)
+// The heap grows up towards the stack, so the gap between them is one free block. Freed chunks
+// below the top of the heap are free too but can only be reused for allocations that fit.
+static std::size_t getHeapGap() {
+  char top;
+  return static_cast<std::size_t>(&top - sbrk(0));
+}
+
+std::size_t getFreeHeap() {
+  return getHeapGap() + mallinfo().fordblks;
+}
+
+std::size_t getLargestFreeBlock() {
+  return getHeapGap();
+}
+
+std::size_t getStackHeadroom() {
+  return 0;
+}
+#elif defined(PLATFORM_NATIVE)
+// The process heap can always grow, so these only count what malloc already holds
+std::size_t getFreeHeap() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  return mallinfo2().fordblks;
+#else
+  return static_cast<std::size_t>(mallinfo().fordblks);
+#endif
+}
+
+std::size_t getLargestFreeBlock() {
+  return getFreeHeap();
+}
+
+std::size_t getStackHeadroom() {
+  return 0;
+}
 #endif
 } // namespace bowlerserver
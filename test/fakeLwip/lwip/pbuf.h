@@ -0,0 +1,118 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+// A host-side stand-in for the parts of lwIP's pbuf API used by LwipUDPServer, so it can be tested
+// on Linux. Only built into the native test environment.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+typedef std::uint8_t u8_t;
+typedef std::uint16_t u16_t;
+typedef std::int8_t err_t;
+
+#define ERR_OK 0
+#define ERR_MEM -1
+#define ERR_VAL -6
+
+typedef enum { PBUF_TRANSPORT } pbuf_layer;
+typedef enum { PBUF_RAM, PBUF_POOL } pbuf_type;
+
+struct pbuf {
+  struct pbuf *next;
+  void *payload;
+  u16_t tot_len;
+  u16_t len;
+};
+
+// The number of pbufs currently allocated, to check for leaks
+inline int &fake_pbuf_count() {
+  static int count = 0;
+  return count;
+}
+
+/**
+ * Allocates a chain of pbufs, each holding at most isegment bytes.
+ */
+inline struct pbuf *fake_pbuf_alloc_chain(u16_t ilength, u16_t isegment) {
+  struct pbuf *first = nullptr;
+  struct pbuf **link = &first;
+  u16_t remaining = ilength;
+  do {
+    const u16_t length = std::min(remaining, isegment);
+    struct pbuf *p = static_cast<struct pbuf *>(std::malloc(sizeof(struct pbuf) + length));
+    p->next = nullptr;
+    p->payload = p + 1;
+    p->tot_len = remaining;
+    p->len = length;
+    fake_pbuf_count()++;
+    *link = p;
+    link = &p->next;
+    remaining -= length;
+  } while (remaining > 0);
+  return first;
+}
+
+inline struct pbuf *pbuf_alloc(pbuf_layer, u16_t ilength, pbuf_type) {
+  return fake_pbuf_alloc_chain(ilength, ilength);
+}
+
+inline u8_t pbuf_free(struct pbuf *p) {
+  u8_t count = 0;
+  while (p != nullptr) {
+    struct pbuf *next = p->next;
+    std::free(p);
+    fake_pbuf_count()--;
+    count++;
+    p = next;
+  }
+  return count;
+}
+
+inline u16_t pbuf_copy_partial(const struct pbuf *p, void *idata, u16_t ilength, u16_t ioffset) {
+  u16_t copied = 0;
+  for (; p != nullptr && copied < ilength; p = p->next) {
+    if (ioffset >= p->len) {
+      ioffset -= p->len;
+      continue;
+    }
+
+    const u16_t count = std::min<u16_t>(p->len - ioffset, ilength - copied);
+    std::memcpy(
+      static_cast<u8_t *>(idata) + copied, static_cast<u8_t *>(p->payload) + ioffset, count);
+    copied += count;
+    ioffset = 0;
+  }
+  return copied;
+}
+
+inline err_t pbuf_take(struct pbuf *p, const void *idata, u16_t ilength) {
+  if (p == nullptr || p->tot_len < ilength) {
+    return ERR_MEM;
+  }
+
+  u16_t copied = 0;
+  for (; p != nullptr && copied < ilength; p = p->next) {
+    const u16_t count = std::min<u16_t>(p->len, ilength - copied);
+    std::memcpy(p->payload, static_cast<const u8_t *>(idata) + copied, count);
+    copied += count;
+  }
+  return ERR_OK;
+}
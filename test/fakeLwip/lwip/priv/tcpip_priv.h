@@ -0,0 +1,32 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+// A host-side stand-in for lwIP's tcpip_api_call. There is no lwIP thread, so calls run
+// immediately on the calling thread.
+
+#include "lwip/pbuf.h"
+
+struct tcpip_api_call_data {
+  err_t err;
+};
+
+typedef err_t (*tcpip_api_call_fn)(struct tcpip_api_call_data *call);
+
+inline err_t tcpip_api_call(tcpip_api_call_fn ifn, struct tcpip_api_call_data *icall) {
+  return ifn(icall);
+}
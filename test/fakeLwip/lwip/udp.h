@@ -0,0 +1,119 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+// A host-side stand-in for the parts of lwIP's raw UDP API used by LwipUDPServer. Sent datagrams
+// are recorded on the pcb and received ones are injected with fake_udp_deliver.
+
+#include "lwip/pbuf.h"
+#include <vector>
+
+typedef struct {
+  std::uint32_t addr;
+} ip_addr_t;
+
+static const ip_addr_t fake_ip_addr_any = {0};
+#define IP_ADDR_ANY (&fake_ip_addr_any)
+#define ip_addr_copy(dest, src) ((dest) = (src))
+#define ip_2_ip4(ipaddr) (ipaddr)
+#define ip4_addr_get_u32(src_ipaddr) ((src_ipaddr)->addr)
+#define ip_addr_set_ip4_u32(ipaddr, val) ((ipaddr)->addr = (val))
+
+struct udp_pcb;
+typedef void (*udp_recv_fn)(
+  void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port);
+
+struct fake_udp_datagram {
+  std::vector<u8_t> data;
+  ip_addr_t address;
+  u16_t port;
+};
+
+struct udp_pcb {
+  u16_t local_port;
+  udp_recv_fn recv;
+  void *recv_arg;
+  std::vector<fake_udp_datagram> sent;
+};
+
+// The pcbs which are currently open
+inline std::vector<struct udp_pcb *> &fake_udp_pcbs() {
+  static std::vector<struct udp_pcb *> pcbs;
+  return pcbs;
+}
+
+inline struct udp_pcb *udp_new() {
+  struct udp_pcb *pcb = new udp_pcb{0, nullptr, nullptr, {}};
+  fake_udp_pcbs().push_back(pcb);
+  return pcb;
+}
+
+inline err_t udp_bind(struct udp_pcb *pcb, const ip_addr_t *, u16_t iport) {
+  pcb->local_port = iport;
+  return ERR_OK;
+}
+
+inline void udp_recv(struct udp_pcb *pcb, udp_recv_fn irecv, void *iarg) {
+  pcb->recv = irecv;
+  pcb->recv_arg = iarg;
+}
+
+inline err_t
+udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *iaddress, u16_t iport) {
+  fake_udp_datagram datagram{std::vector<u8_t>(p->tot_len), *iaddress, iport};
+  pbuf_copy_partial(p, datagram.data.data(), p->tot_len, 0);
+  pcb->sent.push_back(datagram);
+  return ERR_OK;
+}
+
+inline void udp_remove(struct udp_pcb *pcb) {
+  auto &pcbs = fake_udp_pcbs();
+  pcbs.erase(std::remove(pcbs.begin(), pcbs.end(), pcb), pcbs.end());
+  delete pcb;
+}
+
+/**
+ * Delivers a datagram to the pcb bound to a port, the way the network interface would, as a chain
+ * of pbufs holding at most isegment bytes each.
+ *
+ * @return False if no pcb is bound to the port.
+ */
+inline bool fake_udp_deliver(u16_t iport,
+                             const u8_t *idata,
+                             u16_t ilength,
+                             ip_addr_t iaddress,
+                             u16_t ifromPort,
+                             u16_t isegment) {
+  for (auto &&pcb : fake_udp_pcbs()) {
+    if (pcb->local_port == iport && pcb->recv != nullptr) {
+      struct pbuf *p = fake_pbuf_alloc_chain(ilength, isegment);
+      pbuf_take(p, idata, ilength);
+      pcb->recv(pcb->recv_arg, pcb, p, &iaddress, ifromPort);
+      return true;
+    }
+  }
+  return false;
+}
+
+inline struct udp_pcb *fake_udp_find(u16_t iport) {
+  for (auto &&pcb : fake_udp_pcbs()) {
+    if (pcb->local_port == iport) {
+      return pcb;
+    }
+  }
+  return nullptr;
+}
@@ -33,6 +33,22 @@ template <std::size_t N> class MockBowlerServer : public BowlerServer<N> {
     return 1;
   }
 
+  std::int32_t writeFrame(const std::array<std::uint8_t, N> &payload,
+                          std::size_t length) override {
+    writeLengths.push(length);
+    return write(payload);
+  }
+
+  std::int32_t readFrame(std::array<std::uint8_t, N> &payload, std::size_t &length) override {
+    // Frames are full length unless a length was queued for them
+    length = N;
+    if (!readLengthsToSend.empty()) {
+      length = readLengthsToSend.front();
+      readLengthsToSend.pop();
+    }
+    return read(payload);
+  }
+
   std::int32_t isDataAvailable(bool &available) override {
     available = readsToSend.size() > 0;
     return 1;
@@ -40,5 +56,7 @@ template <std::size_t N> class MockBowlerServer : public BowlerServer<N> {
 
   std::queue<std::array<std::uint8_t, N>> writesReceived;
   std::queue<std::array<std::uint8_t, N>> readsToSend;
+  std::queue<std::size_t> writeLengths;
+  std::queue<std::size_t> readLengthsToSend;
 };
 } // namespace bowlerserver
@@ -28,16 +28,28 @@ namespace bowlerserver {
  */
 class MockPacket : public Packet {
   public:
-  MockPacket(std::uint8_t iid, bool iisReliable = false) : Packet(iid, iisReliable) {
+  MockPacket(std::uint16_t iid, bool iisReliable = false) : Packet(iid, iisReliable) {
   }
 
   std::int32_t event(std::uint8_t *payload) override {
+    // Take at least eventTime microseconds, like a packet talking to slow hardware
+    const time_t start = getTime();
+    while (getTime() - start < eventTime) {
+    }
+
     std::array<std::uint8_t, DEFAULT_PAYLOAD_SIZE> copy;
     std::memcpy(copy.data(), payload, DEFAULT_PAYLOAD_SIZE * sizeof(payload[0]));
     payloads.push_back(copy);
     return 1;
   }
 
+  std::int32_t eventBatch(std::uint8_t *const *ipayloads, std::size_t count) override {
+    batchSizes.push_back(count);
+    return Packet::eventBatch(ipayloads, count);
+  }
+
   std::vector<std::array<std::uint8_t, DEFAULT_PAYLOAD_SIZE>> payloads;
+  std::vector<std::size_t> batchSizes;
+  time_t eventTime{0};
 };
 } // namespace bowlerserver
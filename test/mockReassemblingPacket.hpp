@@ -0,0 +1,42 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "streamingPacket.hpp"
+#include <vector>
+
+namespace bowlerserver {
+/**
+ * A ReassemblingPacket which records the objects it receives and replies with them unchanged.
+ */
+template <std::size_t N, std::size_t M>
+class MockReassemblingPacket : public ReassemblingPacket<N, M> {
+  public:
+  MockReassemblingPacket(std::uint16_t iid, bool iisReliable = false)
+    : ReassemblingPacket<N, M>(iid, iisReliable) {
+  }
+
+  std::int32_t
+  eventReassembled(std::uint8_t *iodata, std::size_t ilength, std::size_t &oreplyLength) override {
+    objects.push_back(std::vector<std::uint8_t>(iodata, iodata + ilength));
+    oreplyLength = ilength;
+    return 1;
+  }
+
+  std::vector<std::vector<std::uint8_t>> objects;
+};
+} // namespace bowlerserver
@@ -0,0 +1,50 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+namespace bowlerserver {
+/**
+ * A SerialServer port which reads from and records bytes in memory.
+ */
+class MockSerialPort {
+  public:
+  int available() {
+    return static_cast<int>(bytesToRead.size());
+  }
+
+  std::size_t readBytes(char *ibuffer, std::size_t ilength) {
+    std::size_t count = 0;
+    while (count < ilength && !bytesToRead.empty()) {
+      ibuffer[count++] = static_cast<char>(bytesToRead.front());
+      bytesToRead.pop_front();
+    }
+    return count;
+  }
+
+  std::size_t write(const std::uint8_t *ibuffer, std::size_t ilength) {
+    bytesWritten.insert(bytesWritten.end(), ibuffer, ibuffer + ilength);
+    return ilength;
+  }
+
+  std::deque<std::uint8_t> bytesToRead;
+  std::vector<std::uint8_t> bytesWritten;
+};
+} // namespace bowlerserver
@@ -14,12 +14,28 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
  */
+#include "bowlerSerialServer.hpp"
 #include "defaultBowlerComs.hpp"
 #include "mockBowlerServer.hpp"
 #include "mockPacket.hpp"
+#include "mockReassemblingPacket.hpp"
+#include "mockSerialPort.hpp"
 #include "noopPacket.hpp"
+#include "registerMapPacket.hpp"
 #include <unity.h>
 
+#if defined(PLATFORM_NATIVE)
+#include "bowlerDeviceFarm.hpp"
+#include "bowlerLwipUdpServer.hpp"
+#include "bowlerNativeUdpServer.hpp"
+#include "bowlerSharedMemoryServer.hpp"
+#include <atomic>
+#include <fcntl.h>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+#endif
+
 using namespace bowlerserver;
 
 #define SETUP_BOWLER_COMS                                                                          \
@@ -137,8 +153,8 @@ template <std::size_t N> void get_all_packet_ids() {
   coms.addPacket(std::shared_ptr<MockPacket>(new MockPacket(3, false)));
 
   auto ids = coms.getAllPacketIDs();
-  std::array<std::uint8_t, 2> expected{2, 3};
-  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), ids.data(), expected.size());
+  std::array<std::uint16_t, 2> expected{2, 3};
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(expected.data(), ids.data(), expected.size());
 }
 
 template <std::size_t N> void remove_packet() {
@@ -149,8 +165,8 @@ template <std::size_t N> void remove_packet() {
   coms.removePacket(2);
 
   auto ids = coms.getAllPacketIDs();
-  std::array<std::uint8_t, 1> expected{3};
-  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), ids.data(), expected.size());
+  std::array<std::uint16_t, 1> expected{3};
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(expected.data(), ids.data(), expected.size());
 }
 
 template <std::size_t N> void add_ensured_packets() {
@@ -159,8 +175,8 @@ template <std::size_t N> void add_ensured_packets() {
   coms.addEnsuredPackets();
 
   auto ids = coms.getAllPacketIDs();
-  std::array<std::uint8_t, 1> expected{2};
-  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), ids.data(), expected.size());
+  std::array<std::uint16_t, 1> expected{2};
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(expected.data(), ids.data(), expected.size());
 }
 
 template <std::size_t N> void two_rdt_packets() {
@@ -190,15 +206,1455 @@ template <std::size_t N> void disconnect_before_add_ensured_packets() {
   assertReceiveSend(server, coms, {1, 0, 1, 2}, {1, 0, 0, 1});
   // Should contain the one NoopPacket we added earlier
   ids = coms.getAllPacketIDs();
-  std::array<std::uint8_t, 1> expected{2};
-  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), ids.data(), expected.size());
+  std::array<std::uint16_t, 1> expected{2};
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(expected.data(), ids.data(), expected.size());
 
   // Send SeqNum 0 first (expected). Should ACK 0.
   assertReceiveSend(server, coms, {2, 0, 1}, {2, 0, 0});
 }
 
-void setup() {
-  delay(2000);
+template <std::size_t N> void read_frame_trace() {
+  SETUP_BOWLER_COMS;
+  coms.enableFrameTrace(4);
+  MAKE_PACKET(NoopPacket, 2, false);
+
+  assertReceiveSend(server, coms, {2, 0, 0, 7}, {2, 0, 0, 7});
+
+  // Read the trace from the start. The request itself is the third recorded frame.
+  server->readsToSend.push({1, 0, 1, OPERATION_READ_FRAME_TRACE, 0, 0, 0, 0});
+  coms.loop();
+  auto reply = server->writesReceived.front();
+  server->writesReceived.pop();
+
+  const std::uint8_t *payload = reply.data() + HEADER_LENGTH;
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, payload[0]);
+  TEST_ASSERT_EQUAL_UINT8(3, payload[1]);
+  TEST_ASSERT_EQUAL_UINT32(0, readLittleEndian<std::uint32_t>(payload + 2));
+  TEST_ASSERT_EQUAL_UINT32(3, readLittleEndian<std::uint32_t>(payload + 6));
+
+  // The first entry is the unreliable frame being received, the second is its reply
+  const std::uint8_t *entry = payload + 10;
+  std::array<std::uint8_t, 7> expectedRx{FRAME_TRACE_RX, 2, 0, 0, 0, FRAME_TRACE_RECEIVED, 7};
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expectedRx.data(), entry + 4, expectedRx.size());
+  entry += FRAME_TRACE_ENTRY_LENGTH;
+  std::array<std::uint8_t, 7> expectedTx{FRAME_TRACE_TX, 2, 0, 0, 0, FRAME_TRACE_OK, 7};
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expectedTx.data(), entry + 4, expectedTx.size());
+
+  // Once the trace wraps, reading from the start begins at the oldest held entry
+  server->readsToSend.push({1, 1, 0, OPERATION_READ_FRAME_TRACE, 0, 0, 0, 0});
+  coms.loop();
+  reply = server->writesReceived.front();
+  TEST_ASSERT_EQUAL_UINT32(1, readLittleEndian<std::uint32_t>(payload + 2));
+  TEST_ASSERT_EQUAL_UINT32(5, readLittleEndian<std::uint32_t>(payload + 6));
+}
+
+/**
+ * A FrameTrace whose sequence numbers start just short of wrapping around.
+ */
+class WrappingFrameTrace : public FrameTrace {
+  public:
+  WrappingFrameTrace(std::size_t icapacity, std::uint32_t ifirstSeq) : FrameTrace(icapacity) {
+    recorded = ifirstSeq;
+  }
+};
+
+template <std::size_t N> void frame_trace_wraps() {
+  // 3 does not divide 2^32, so the slot of a sequence number is not seq % capacity after the wrap
+  WrappingFrameTrace trace(3, 0xFFFFFFFE);
+  for (std::uint8_t i = 0; i < 5; i++) {
+    trace.record(FRAME_TRACE_RX, 2, 0, 0, &i, 1, FRAME_TRACE_RECEIVED);
+  }
+  TEST_ASSERT_EQUAL_UINT32(3, trace.getRecordedCount());
+  TEST_ASSERT_EQUAL_UINT32(0, trace.getOldestSeq());
+
+  // Reading from before the wrap starts at the oldest held entry
+  std::array<std::uint8_t, 4 * FRAME_TRACE_ENTRY_LENGTH> buffer{};
+  std::uint32_t firstSeq = 1;
+  TEST_ASSERT_EQUAL_UINT32(3, trace.serialize(0xFFFFFFFE, buffer.data(), buffer.size(), firstSeq));
+  TEST_ASSERT_EQUAL_UINT32(0, firstSeq);
+  for (std::uint8_t i = 0; i < 3; i++) {
+    TEST_ASSERT_EQUAL_UINT8(i + 2, buffer[i * FRAME_TRACE_ENTRY_LENGTH + 10]);
+  }
+
+  // Reading from the latest entry gives only that one, and nothing past it
+  TEST_ASSERT_EQUAL_UINT32(1, trace.serialize(2, buffer.data(), buffer.size(), firstSeq));
+  TEST_ASSERT_EQUAL_UINT8(4, buffer[10]);
+  TEST_ASSERT_EQUAL_UINT32(0, trace.serialize(3, buffer.data(), buffer.size(), firstSeq));
+}
+
+template <std::size_t N> void frame_trace_small() {
+  // A capacity of 0 is clamped to a single entry
+  FrameTrace trace(0);
+  std::array<std::uint8_t, FRAME_TRACE_PAYLOAD_LENGTH> full{};
+  full.fill(0xAA);
+  trace.record(FRAME_TRACE_RX, 2, 0, 0, full.data(), full.size(), FRAME_TRACE_RECEIVED);
+
+  // A short payload does not leave bytes of the previous frame in the snapshot
+  std::uint8_t shortPayload = 7;
+  trace.record(FRAME_TRACE_TX, 2, 0, 0, &shortPayload, 1, FRAME_TRACE_OK);
+  TEST_ASSERT_EQUAL_UINT32(1, trace.getOldestSeq());
+
+  std::array<std::uint8_t, 2 * FRAME_TRACE_ENTRY_LENGTH> buffer{};
+  std::uint32_t firstSeq = 0;
+  TEST_ASSERT_EQUAL_UINT32(1, trace.serialize(0, buffer.data(), buffer.size(), firstSeq));
+  TEST_ASSERT_EQUAL_UINT32(1, firstSeq);
+  std::array<std::uint8_t, FRAME_TRACE_PAYLOAD_LENGTH> expected{};
+  expected[0] = 7;
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), buffer.data() + 10, expected.size());
+}
+
+template <std::size_t N> void time_sync() {
+  SETUP_BOWLER_COMS;
+
+  server->readsToSend.push({1, 0, 1, OPERATION_TIME_SYNC, 1, 2, 3, 4, 5, 6, 7, 8});
+  coms.loop();
+  auto reply = server->writesReceived.front();
+  const std::uint8_t *payload = reply.data() + HEADER_LENGTH;
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, payload[0]);
+
+  // The origin time is echoed back and the transmit time is never before the receive time
+  std::array<std::uint8_t, 8> origin{1, 2, 3, 4, 5, 6, 7, 8};
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(origin.data(), payload + 1, origin.size());
+  auto receiveTime = readLittleEndian<std::int64_t>(payload + 9);
+  auto transmitTime = readLittleEndian<std::int64_t>(payload + 17);
+  TEST_ASSERT_TRUE(transmitTime >= receiveTime);
+}
+
+template <std::size_t N> void loop_health() {
+  SETUP_BOWLER_COMS;
+
+  // Not enabled yet
+  server->readsToSend.push({1, 0, 1, OPERATION_READ_LOOP_HEALTH, LOOP_HEALTH_PERIOD, 0});
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_REJECTED_GENERIC, server->writesReceived.front()[HEADER_LENGTH]);
+  server->writesReceived.pop();
+
+  coms.enableLoopHealth(1000);
+  LoopHealth *health = coms.getLoopHealth();
+  health->beginLoop(0);
+  health->record(LOOP_HEALTH_COMS, 40);
+  health->endLoop(100);
+  health->beginLoop(1100);
+
+  // Read and reset the period histogram
+  server->readsToSend.push({1, 1, 0, OPERATION_READ_LOOP_HEALTH, LOOP_HEALTH_PERIOD, 1});
+  coms.loop();
+  auto reply = server->writesReceived.front();
+  server->writesReceived.pop();
+  const std::uint8_t *payload = reply.data() + HEADER_LENGTH;
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, payload[0]);
+  TEST_ASSERT_EQUAL_UINT8(LOOP_HEALTH_PERIOD, payload[1]);
+  TEST_ASSERT_EQUAL_UINT32(1000, readLittleEndian<std::uint32_t>(payload + 2));
+  TEST_ASSERT_EQUAL_UINT32(1, readLittleEndian<std::uint32_t>(payload + 6));
+  TEST_ASSERT_EQUAL_UINT32(1100, readLittleEndian<std::uint32_t>(payload + 10));
+  TEST_ASSERT_EQUAL_UINT32(1, readLittleEndian<std::uint32_t>(payload + 14));
+  // 1100 us is in [1024, 2048)
+  TEST_ASSERT_EQUAL_UINT32(1, readLittleEndian<std::uint32_t>(payload + 18 + 4 * 6));
+  TEST_ASSERT_EQUAL_UINT32(0, health->getHistogram(LOOP_HEALTH_PERIOD).getSampleCount());
+
+  // The other histograms were not reset
+  TEST_ASSERT_EQUAL_UINT32(1, health->getHistogram(LOOP_HEALTH_OUTSIDE).getSampleCount());
+  TEST_ASSERT_EQUAL_UINT32(1000, health->getHistogram(LOOP_HEALTH_OUTSIDE).getMax());
+  TEST_ASSERT_EQUAL_UINT32(1, health->getHistogram(LOOP_HEALTH_COMS).getBucket(1));
+  TEST_ASSERT_EQUAL_UINT32(0, health->getHistogram(LOOP_HEALTH_COMS).getOverrunCount());
+}
+
+template <std::size_t N> void frame_timestamps() {
+  SETUP_BOWLER_COMS;
+  MAKE_PACKET(NoopPacket, 2, false);
+
+  assertReceiveSend(
+    server, coms, {1, 0, 1, OPERATION_SET_FRAME_TIMESTAMPS, 2, 0, 1}, {1, 0, 0, 1, 2, 0, 1});
+
+  server->readsToSend.push({2, 0, 0});
+  coms.loop();
+  auto reply = server->writesReceived.front();
+  const std::uint8_t *stamps = reply.data() + N - FRAME_TIMESTAMPS_LENGTH;
+  auto receiveTime = readLittleEndian<std::uint32_t>(stamps);
+  auto transmitTime = readLittleEndian<std::uint32_t>(stamps + 4);
+  TEST_ASSERT_EQUAL_UINT32(static_cast<std::uint32_t>(coms.getLastReceiveTime()), receiveTime);
+  TEST_ASSERT_TRUE(transmitTime - receiveTime < 1000000);
+}
+
+template <std::size_t N> void resume_session() {
+  SETUP_BOWLER_COMS;
+  std::shared_ptr<MockPacket> mockPacket(new MockPacket(2, true));
+  coms.addEnsuredPacket([mockPacket]() { return mockPacket; });
+
+  assertReceiveSend(server, coms, {1, 0, 1, OPERATION_ADD_ENSURED_PACKETS}, {1, 0, 0, 1});
+
+  server->readsToSend.push({1, 1, 0, OPERATION_GET_SESSION});
+  coms.loop();
+  auto reply = server->writesReceived.front();
+  server->writesReceived.pop();
+  const std::uint32_t token = readLittleEndian<std::uint32_t>(reply.data() + HEADER_LENGTH + 1);
+  TEST_ASSERT_TRUE(token != 0);
+
+  // Leave the packet waiting for SeqNum 1
+  assertReceiveSend(server, coms, {2, 0, 1}, {2, 0, 0});
+
+  // A wrong token is rejected
+  std::array<std::uint8_t, N> resume{1, 0, 1, OPERATION_RESUME_SESSION};
+  writeLittleEndian(resume.data() + HEADER_LENGTH + 1, token + 1);
+  std::array<std::uint8_t, N> expected = resume;
+  expected[2] = 0;
+  expected[HEADER_LENGTH] = STATUS_REJECTED_GENERIC;
+  assertReceiveSend(server, coms, resume, expected);
+
+  // The right token resets RDT state but keeps the handler
+  resume[1] = 1;
+  writeLittleEndian(resume.data() + HEADER_LENGTH + 1, token);
+  expected = resume;
+  expected[HEADER_LENGTH] = STATUS_ACCEPTED;
+  assertReceiveSend(server, coms, resume, expected);
+  assertReceiveSend(server, coms, {2, 0, 1}, {2, 0, 0});
+  TEST_ASSERT_EQUAL_INT(2, mockPacket->payloads.size());
+
+  // A new PC starts at SeqNum 0 while the management packet is waiting for SeqNum 1
+  server->readsToSend.push({1, 0, 1, OPERATION_GET_SESSION});
+  coms.loop();
+  server->writesReceived.pop();
+  resume[1] = 0;
+  expected = resume;
+  expected[2] = 0;
+  expected[HEADER_LENGTH] = STATUS_ACCEPTED;
+  assertReceiveSend(server, coms, resume, expected);
+  assertReceiveSend(server, coms, {2, 0, 1}, {2, 0, 0});
+  TEST_ASSERT_EQUAL_INT(3, mockPacket->payloads.size());
+}
+
+template <std::size_t N> void reassemble_fragments() {
+  SETUP_BOWLER_COMS;
+  std::shared_ptr<MockReassemblingPacket<N, 128>> packet(new MockReassemblingPacket<N, 128>(2));
+  coms.addPacket(packet);
+
+  const std::size_t dataLength = N - HEADER_LENGTH - FRAGMENT_HEADER_LENGTH;
+  std::vector<std::uint8_t> object(dataLength + 10);
+  for (std::size_t i = 0; i < object.size(); i++) {
+    object[i] = static_cast<std::uint8_t>(i + 1);
+  }
+
+  // Send the object in two fragments
+  std::size_t offset = 0;
+  while (offset < object.size()) {
+    const std::size_t length = std::min(dataLength, object.size() - offset);
+    std::array<std::uint8_t, N> fragment{2, 0, 0};
+    std::uint8_t *payload = fragment.data() + HEADER_LENGTH;
+    payload[0] = (offset == 0 ? FRAGMENT_FIRST : 0) |
+                 (offset + length == object.size() ? FRAGMENT_LAST : 0);
+    writeLittleEndian(payload + 2, static_cast<std::uint16_t>(offset));
+    writeLittleEndian(payload + 4, static_cast<std::uint16_t>(length));
+    std::copy(object.begin() + offset, object.begin() + offset + length, payload + 6);
+
+    server->readsToSend.push(fragment);
+    coms.loop();
+    TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, server->writesReceived.front()[HEADER_LENGTH + 1]);
+    server->writesReceived.pop();
+    offset += length;
+  }
+
+  TEST_ASSERT_EQUAL_INT(1, packet->objects.size());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(object.data(), packet->objects[0].data(), object.size());
+
+  // Read the reply back out, which is the object itself
+  std::vector<std::uint8_t> readBack;
+  bool last = false;
+  while (!last) {
+    std::array<std::uint8_t, N> fragment{2, 0, 0, FRAGMENT_READ};
+    writeLittleEndian(fragment.data() + HEADER_LENGTH + 2,
+                      static_cast<std::uint16_t>(readBack.size()));
+    server->readsToSend.push(fragment);
+    coms.loop();
+    auto reply = server->writesReceived.front();
+    server->writesReceived.pop();
+
+    const std::uint8_t *payload = reply.data() + HEADER_LENGTH;
+    TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, payload[1]);
+    const std::uint16_t length = readLittleEndian<std::uint16_t>(payload + 4);
+    readBack.insert(readBack.end(), payload + 6, payload + 6 + length);
+    last = payload[0] & FRAGMENT_LAST;
+  }
+
+  TEST_ASSERT_EQUAL_INT(object.size(), readBack.size());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(object.data(), readBack.data(), object.size());
+}
+
+template <std::size_t N> void fragments_in_short_frames() {
+  SETUP_BOWLER_COMS;
+  std::shared_ptr<MockReassemblingPacket<N, 128>> packet(new MockReassemblingPacket<N, 128>(2));
+  packet->setFrameLength(HEADER_LENGTH + FRAGMENT_HEADER_LENGTH + 8);
+  coms.addPacket(packet);
+  TEST_ASSERT_EQUAL_UINT16(8, packet->getFragmentDataLength());
+
+  // More data than fits in the packet's frames is rejected
+  std::array<std::uint8_t, N> fragment{2, 0, 0, FRAGMENT_FIRST | FRAGMENT_LAST, 0, 0, 0, 12};
+  server->readsToSend.push(fragment);
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_REJECTED_GENERIC,
+                          server->writesReceived.front()[HEADER_LENGTH + 1]);
+  server->writesReceived.pop();
+
+  fragment = {2, 0, 0, FRAGMENT_FIRST | FRAGMENT_LAST, 0, 0, 0, 8, 0, 1, 2, 3, 4, 5, 6, 7, 8};
+  server->readsToSend.push(fragment);
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, server->writesReceived.front()[HEADER_LENGTH + 1]);
+  server->writesReceived.pop();
+
+  // Reads are limited to the frame length as well
+  server->readsToSend.push({2, 0, 0, FRAGMENT_READ});
+  coms.loop();
+  const std::uint8_t *payload = server->writesReceived.front().data() + HEADER_LENGTH;
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, payload[1]);
+  TEST_ASSERT_EQUAL_UINT16(8, readLittleEndian<std::uint16_t>(payload + 4));
+  TEST_ASSERT_TRUE(payload[0] & FRAGMENT_LAST);
+  server->writesReceived.pop();
+}
+
+template <std::size_t N> void wide_header_format() {
+  SETUP_BOWLER_COMS;
+  MAKE_PACKET(NoopPacket, 0x1234, true);
+
+  // The reply to the switch still uses the legacy format
+  assertReceiveSend(server,
+                    coms,
+                    {1, 0, 1, OPERATION_SET_HEADER_FORMAT, HEADER_FORMAT_WIDE},
+                    {1, 0, 0, 1, HEADER_FORMAT_WIDE});
+
+  // Send SeqNum 0 first (expected). Should ACK 0.
+  assertReceiveSend(server, coms, {0x34, 0x12, 0}, {0x34, 0x12, 0});
+
+  // Send SeqNum 1 (expected). Should ACK 1.
+  const std::uint8_t seqAck = HEADER_SEQ_BIT | HEADER_ACK_BIT;
+  assertReceiveSend(server, coms, {0x34, 0x12, HEADER_SEQ_BIT}, {0x34, 0x12, seqAck});
+
+  // Send SeqNum 1 (not expected). Should ACK 1.
+  assertReceiveSend(server, coms, {0x34, 0x12, HEADER_SEQ_BIT}, {0x34, 0x12, seqAck});
+
+  // The management packet is addressed with a wide id as well. Disconnecting goes back to the
+  // legacy format.
+  assertReceiveSend(
+    server, coms, {1, 0, HEADER_SEQ_BIT, OPERATION_DISCONNECT_ID}, {1, 0, seqAck, 1});
+  TEST_ASSERT_EQUAL_INT(0, coms.getAllPacketIDs().size());
+  assertReceiveSend(server, coms, {2, 0, 1}, {2, 0, 1});
+}
+
+template <std::size_t N> void batch_unreliable_frames() {
+  SETUP_BOWLER_COMS;
+  coms.setDrainLimit(8);
+  std::shared_ptr<MockPacket> batched(new MockPacket(2, false));
+  std::shared_ptr<MockPacket> single(new MockPacket(3, false));
+  coms.addPacket(batched);
+  coms.addPacket(single);
+
+  server->readsToSend.push({2, 0, 0, 1});
+  server->readsToSend.push({3, 0, 0, 2});
+  server->readsToSend.push({2, 0, 0, 3});
+  server->readsToSend.push({2, 0, 0, 4});
+  coms.loop();
+
+  // All three frames for id 2 went to one batch, in order
+  TEST_ASSERT_EQUAL_INT(1, batched->batchSizes.size());
+  TEST_ASSERT_EQUAL_INT(3, batched->batchSizes[0]);
+  TEST_ASSERT_EQUAL_INT(3, batched->payloads.size());
+  TEST_ASSERT_EQUAL_UINT8(4, batched->payloads[2][0]);
+  TEST_ASSERT_EQUAL_INT(0, single->batchSizes.size());
+
+  // The replies are written in the order the frames were read
+  std::array<std::uint8_t, 4> expectedOrder{1, 2, 3, 4};
+  for (auto &&expected : expectedOrder) {
+    TEST_ASSERT_EQUAL_UINT8(expected, server->writesReceived.front()[HEADER_LENGTH]);
+    server->writesReceived.pop();
+  }
+}
+
+template <std::size_t N> void priority_order() {
+  SETUP_BOWLER_COMS;
+  coms.setDrainLimit(8);
+  std::shared_ptr<MockPacket> low(new MockPacket(2, false));
+  std::shared_ptr<MockPacket> normal(new MockPacket(3, true));
+  std::shared_ptr<MockPacket> high(new MockPacket(4, false));
+  low->setPriority(PRIORITY_LOW);
+  high->setPriority(PRIORITY_HIGH);
+  coms.addPacket(low);
+  coms.addPacket(normal);
+  coms.addPacket(high);
+
+  server->readsToSend.push({2, 0, 0, 1});
+  server->readsToSend.push({3, 0, 0, 2});
+  server->readsToSend.push({2, 0, 0, 3});
+  server->readsToSend.push({4, 0, 0, 4});
+  server->readsToSend.push({3, 1, 0, 5});
+  coms.loop();
+
+  // Replies go out by priority class, and in the order they were read within a class
+  std::array<std::uint8_t, 5> expectedOrder{4, 2, 5, 1, 3};
+  for (auto &&expected : expectedOrder) {
+    TEST_ASSERT_EQUAL_UINT8(expected, server->writesReceived.front()[HEADER_LENGTH]);
+    server->writesReceived.pop();
+  }
+
+  // The reliable packet saw both of its frames in order
+  TEST_ASSERT_EQUAL_INT(2, normal->payloads.size());
+  TEST_ASSERT_EQUAL_UINT8(5, normal->payloads[1][0]);
+}
+
+template <std::size_t N> void expired_frames() {
+  SETUP_BOWLER_COMS;
+  coms.setDrainLimit(8);
+  std::shared_ptr<MockPacket> slow(new MockPacket(2, false));
+  std::shared_ptr<MockPacket> stale(new MockPacket(3, true));
+  slow->setPriority(PRIORITY_HIGH);
+  slow->setDeadline(1);
+  slow->eventTime = 1000;
+  stale->setPriority(PRIORITY_LOW);
+  stale->setDeadline(500);
+  coms.addPacket(slow);
+  coms.addPacket(stale);
+
+  server->readsToSend.push({3, 0, 1, 1});
+  server->readsToSend.push({2, 0, 0, 2});
+  coms.loop();
+
+  // The high priority frame ran even though it is past its own deadline
+  TEST_ASSERT_EQUAL_INT(1, slow->payloads.size());
+  TEST_ASSERT_EQUAL_UINT8(2, server->writesReceived.front()[HEADER_LENGTH]);
+  server->writesReceived.pop();
+
+  // The low priority frame waited behind it for too long, so it was dropped and not ACKed
+  TEST_ASSERT_EQUAL_INT(0, stale->payloads.size());
+  std::array<std::uint8_t, N> expected{3, 0, 1 | HEADER_STATUS_BIT, STATUS_EXPIRED};
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), server->writesReceived.front().data(), N);
+  server->writesReceived.pop();
+
+  // Without the backlog the same frame is handled
+  assertReceiveSend(server, coms, {3, 0, 1, 1}, {3, 0, 0, 1});
+}
+
+template <std::size_t N> void rate_limit() {
+  SETUP_BOWLER_COMS;
+  coms.setDrainLimit(8);
+  std::shared_ptr<MockPacket> limited(new MockPacket(2, true));
+  limited->setRateLimit(1, 2);
+  coms.addPacket(limited);
+
+  server->readsToSend.push({2, 0, 1, 1});
+  server->readsToSend.push({2, 1, 0, 2});
+  server->readsToSend.push({2, 0, 1, 3});
+  coms.loop();
+
+  // The burst lets two frames through
+  TEST_ASSERT_EQUAL_INT(2, limited->payloads.size());
+  server->writesReceived.pop();
+  server->writesReceived.pop();
+
+  // The third is dropped and not ACKed
+  std::array<std::uint8_t, N> expected{2, 0, 1 | HEADER_STATUS_BIT, STATUS_RATE_LIMITED};
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), server->writesReceived.front().data(), N);
+  server->writesReceived.pop();
+}
+
+/**
+ * A Packet whose event runs a function, e.g. to register packets from the coms thread.
+ */
+class CallbackPacket : public Packet {
+  public:
+  CallbackPacket(std::uint16_t iid, std::function<void(void)> icallback)
+    : Packet(iid, false), callback(std::move(icallback)) {
+  }
+
+  std::int32_t event(std::uint8_t *) override {
+    callback();
+    return 1;
+  }
+
+  private:
+  std::function<void(void)> callback;
+};
+
+template <std::size_t N> void loop_budget() {
+  SETUP_BOWLER_COMS;
+  bool isSlow = false;
+  coms.addPacket(std::shared_ptr<CallbackPacket>(new CallbackPacket(2, [&isSlow]() {
+    const auto start = getTime();
+    while (isSlow && getTime() - start < 1000) {
+    }
+  })));
+  coms.setLoopBudget(500);
+  coms.loop();
+
+  // Time spent in the main loop between iterations does not count
+  auto start = getTime();
+  while (getTime() - start < 1000) {
+  }
+  assertReceiveSend(server, coms, {2, 0, 0, 1}, {2, 0, 0, 1});
+
+  // The iteration itself took too long
+  isSlow = true;
+  assertReceiveSend(server, coms, {2, 0, 0, 1}, {2, 0, HEADER_BUSY_BIT, 1});
+
+  // It is back within budget
+  isSlow = false;
+  assertReceiveSend(server, coms, {2, 0, 0, 1}, {2, 0, 0, 1});
+}
+
+template <std::size_t N> void serial_framing() {
+  MockSerialPort devicePort;
+  MockSerialPort hostPort;
+  SerialServer<N, MockSerialPort> *server = new SerialServer<N, MockSerialPort>(devicePort);
+  DefaultBowlerComs<N> coms{std::unique_ptr<SerialServer<N, MockSerialPort>>(server)};
+  MAKE_PACKET(NoopPacket, 2, false);
+  SerialServer<N, MockSerialPort> host(hostPort);
+
+  // The standard CRC-16/CCITT-FALSE check value, so the host's CRC matches other implementations
+  const std::uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+  TEST_ASSERT_EQUAL_UINT16(0x29B1, crc16(check, sizeof(check)));
+  TEST_ASSERT_EQUAL_UINT16(0xFFFF, crc16(check, 0));
+
+  // Encode a frame full of zeros and a long run without any
+  std::array<std::uint8_t, N> frame{2, 0, 0};
+  for (std::size_t i = HEADER_LENGTH + 10; i < N; i++) {
+    frame[i] = static_cast<std::uint8_t>(i);
+  }
+  host.write(frame);
+  const std::vector<std::uint8_t> encoded = hostPort.bytesWritten;
+  TEST_ASSERT_EQUAL_UINT8(0, encoded.back());
+
+  // Line noise, then a corrupted copy of the frame, then the real one
+  devicePort.bytesToRead.insert(devicePort.bytesToRead.end(), {7, 7, 0});
+  devicePort.bytesToRead.insert(devicePort.bytesToRead.end(), encoded.begin(), encoded.end());
+  devicePort.bytesToRead[10] ^= 0x40;
+  devicePort.bytesToRead.insert(devicePort.bytesToRead.end(), encoded.begin(), encoded.end());
+
+  TEST_ASSERT_EQUAL_INT(1, coms.loop());
+  TEST_ASSERT_EQUAL_INT(2, server->getFramesDropped());
+
+  // The host decodes the reply, which is the frame echoed back
+  hostPort.bytesToRead.insert(
+    hostPort.bytesToRead.end(), devicePort.bytesWritten.begin(), devicePort.bytesWritten.end());
+  std::array<std::uint8_t, N> replyFrame;
+  TEST_ASSERT_EQUAL_INT(1, host.read(replyFrame));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(frame.data(), replyFrame.data(), N);
+}
+
+template <std::size_t N> void group_frames() {
+  SETUP_BOWLER_COMS;
+  std::shared_ptr<MockPacket> packet(new MockPacket(5, false));
+  coms.addPacket(packet);
+
+  // Group frames are ignored until the device has a group index
+  server->readsToSend.push({0, 0, 0, 5, 0, 2, 1, GROUP_FLAG_ACK, 10, 11});
+  TEST_ASSERT_EQUAL_INT(1, coms.loop());
+  TEST_ASSERT_EQUAL_INT(0, packet->payloads.size());
+  TEST_ASSERT_TRUE(server->writesReceived.empty());
+
+  assertReceiveSend(server,
+                    coms,
+                    {1, 0, 0, OPERATION_SET_GROUP_INDEX, 2, 0},
+                    {1, 0, 0, STATUS_ACCEPTED, 2, 0});
+
+  // The event sees this device's slice. There is no reply without GROUP_FLAG_ACK.
+  server->readsToSend.push({0, 0, 0, 5, 0, 2, 4, 0, 10, 11, 20, 21, 30, 31, 40, 41});
+  TEST_ASSERT_EQUAL_INT(1, coms.loop());
+  TEST_ASSERT_EQUAL_INT(1, packet->payloads.size());
+  TEST_ASSERT_EQUAL_UINT8(30, packet->payloads[0][0]);
+  TEST_ASSERT_EQUAL_UINT8(31, packet->payloads[0][1]);
+  TEST_ASSERT_EQUAL_UINT8(0, packet->payloads[0][2]);
+  TEST_ASSERT_TRUE(server->writesReceived.empty());
+
+  // With GROUP_FLAG_ACK the reply says which device it is from
+  assertReceiveSend(server,
+                    coms,
+                    {0, 0, 0, 5, 0, 2, 3, GROUP_FLAG_ACK, 10, 11, 20, 21, 30, 31},
+                    {0, 0, 0, 5, 0, 2, 0, 30, 31});
+
+  // The group is smaller than this device's index
+  server->readsToSend.push({0, 0, 0, 5, 0, 2, 1, GROUP_FLAG_ACK, 10, 11});
+  TEST_ASSERT_EQUAL_INT(1, coms.loop());
+  TEST_ASSERT_EQUAL_INT(2, packet->payloads.size());
+  TEST_ASSERT_TRUE(server->writesReceived.empty());
+}
+
+template <std::size_t N> void frame_size_classes() {
+  SETUP_BOWLER_COMS;
+  std::shared_ptr<MockPacket> small(new MockPacket(2, false));
+  small->setFrameLength(8);
+  coms.addPacket(small);
+  MAKE_PACKET(NoopPacket, 3, false);
+
+  // A full length frame for the small packet is cut to its size class, and so is the reply
+  server->readsToSend.push({2, 0, 0, 1, 2, 3, 4, 5, 6, 7});
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(5, small->payloads[0][4]);
+  TEST_ASSERT_EQUAL_UINT8(0, small->payloads[0][5]);
+  TEST_ASSERT_EQUAL_INT(8, server->writeLengths.front());
+  server->writeLengths.pop();
+  server->writesReceived.pop();
+
+  // Other packets keep the full length
+  assertReceiveSend(server, coms, {3, 0, 0, 1}, {3, 0, 0, 1});
+  TEST_ASSERT_EQUAL_INT(N, server->writeLengths.front());
+  server->writeLengths.pop();
+
+  // Frames without a handler are echoed at the length they came in
+  server->readLengthsToSend.push(5);
+  server->readsToSend.push({9, 0, 0, 1, 2});
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(5, server->writeLengths.front());
+
+  // Short frames over serial
+  MockSerialPort port;
+  SerialServer<N, MockSerialPort> serial(port);
+  std::array<std::uint8_t, N> frame{2, 0, 0, 9, 0, 9};
+  serial.writeFrame(frame, 6);
+  port.bytesToRead.assign(port.bytesWritten.begin(), port.bytesWritten.end());
+  std::array<std::uint8_t, N> received;
+  received.fill(0xFF);
+  std::size_t length;
+  TEST_ASSERT_EQUAL_INT(1, serial.readFrame(received, length));
+  TEST_ASSERT_EQUAL_INT(6, length);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(frame.data(), received.data(), N);
+}
+
+template <std::size_t N> void register_map() {
+  SETUP_BOWLER_COMS;
+  std::shared_ptr<RegisterMapPacket<N, 8>> packet(new RegisterMapPacket<N, 8>(2));
+  std::uint8_t mode = 3;
+  std::int16_t offset = -2;
+  std::uint32_t count = 0x01020304;
+  float gain = 1.5f;
+  packet->addRegister(0, &mode);
+  packet->addRegister(1, &offset);
+  packet->addRegister(2, &count, false);
+  packet->addRegister(5, &gain);
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, packet->addRegister(5, &mode));
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, packet->addRegister(8, &mode));
+  coms.addPacket(packet);
+
+  // Read two ranges in one frame
+  assertReceiveSend(server,
+                    coms,
+                    {2, 0, 0, 2, 0, 0, 3, 5, 0, 1},
+                    {2, 0, 0, STATUS_ACCEPTED, 3, 0xFE, 0xFF, 4, 3, 2, 1, 0, 0, 0xC0, 0x3F});
+
+  // Write two registers and read another back in the same frame
+  assertReceiveSend(server,
+                    coms,
+                    {2, 0, 0, 3, 0, 0, 0x81, 5, 0, 0x81, 1, 0, 1, 7, 0, 0, 0, 0x40},
+                    {2, 0, 0, STATUS_ACCEPTED, 0xFE, 0xFF});
+  TEST_ASSERT_EQUAL_UINT8(7, mode);
+  TEST_ASSERT_TRUE(gain == 2.0f);
+
+  // A write to a read-only register rejects the whole request
+  server->readsToSend.push({2, 0, 0, 2, 0, 0, 0x81, 2, 0, 0x81, 9, 1, 2, 3, 4});
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_REJECTED_GENERIC, server->writesReceived.front()[HEADER_LENGTH]);
+  server->writesReceived.pop();
+  TEST_ASSERT_EQUAL_UINT8(7, mode);
+
+  // So does an unused address
+  server->readsToSend.push({2, 0, 0, 1, 3, 0, 1});
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_REJECTED_GENERIC, server->writesReceived.front()[HEADER_LENGTH]);
+  server->writesReceived.pop();
+
+  // And a reply which does not fit in the packet's frame
+  packet->setFrameLength(8);
+  server->readsToSend.push({2, 0, 0, 1, 0, 0, 3});
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_REJECTED_GENERIC, server->writesReceived.front()[HEADER_LENGTH]);
+}
+
+template <std::size_t N> void scheduled_commands() {
+  SETUP_BOWLER_COMS;
+  coms.enableScheduledCommands(2);
+  std::shared_ptr<MockPacket> packet(new MockPacket(2, false));
+  packet->setScheduled(true);
+  coms.addPacket(packet);
+
+  // Queue two commands, the later one first. The replies only say they were queued.
+  const auto start = getTime();
+  std::array<std::uint8_t, N> frame{2, 0, 0};
+  writeLittleEndian(frame.data() + HEADER_LENGTH, static_cast<std::uint32_t>(start + 4000));
+  frame[HEADER_LENGTH + SCHEDULED_TIME_LENGTH] = 9;
+  assertReceiveSend(server, coms, frame, {2, 0, HEADER_STATUS_BIT, STATUS_ACCEPTED});
+  writeLittleEndian(frame.data() + HEADER_LENGTH, static_cast<std::uint32_t>(start + 2000));
+  frame[HEADER_LENGTH + SCHEDULED_TIME_LENGTH] = 8;
+  assertReceiveSend(server, coms, frame, {2, 0, HEADER_STATUS_BIT, STATUS_ACCEPTED});
+  TEST_ASSERT_EQUAL_INT(0, packet->payloads.size());
+  TEST_ASSERT_EQUAL_INT(2, coms.getScheduledCommandCount());
+
+  // There is no room for a third
+  assertReceiveSend(server, coms, frame, {2, 0, HEADER_STATUS_BIT, STATUS_SCHEDULE_FULL});
+
+  // Each runs once it is due, earliest first
+  coms.runScheduledCommands(start + 1999);
+  TEST_ASSERT_EQUAL_INT(0, packet->payloads.size());
+  coms.runScheduledCommands(start + 2000);
+  TEST_ASSERT_EQUAL_INT(1, packet->payloads.size());
+  TEST_ASSERT_EQUAL_UINT8(8, packet->payloads[0][0]);
+  coms.runScheduledCommands(start + 5000);
+  TEST_ASSERT_EQUAL_INT(2, packet->payloads.size());
+  TEST_ASSERT_EQUAL_UINT8(9, packet->payloads[1][0]);
+
+  // A command which is already due runs when the next iteration starts
+  writeLittleEndian(frame.data() + HEADER_LENGTH, static_cast<std::uint32_t>(getTime() - 100));
+  assertReceiveSend(server, coms, frame, {2, 0, HEADER_STATUS_BIT, STATUS_ACCEPTED});
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(3, packet->payloads.size());
+
+  // Clearing the schedule drops waiting commands
+  writeLittleEndian(frame.data() + HEADER_LENGTH, static_cast<std::uint32_t>(getTime() + 100000));
+  assertReceiveSend(server, coms, frame, {2, 0, HEADER_STATUS_BIT, STATUS_ACCEPTED});
+  assertReceiveSend(
+    server, coms, {1, 0, 1, OPERATION_CLEAR_SCHEDULED_COMMANDS}, {1, 0, 0, STATUS_ACCEPTED});
+  TEST_ASSERT_EQUAL_INT(0, coms.getScheduledCommandCount());
+}
+
+template <std::size_t N> void lazy_ensured_packets() {
+  SETUP_BOWLER_COMS;
+  coms.setDrainLimit(4);
+  int made = 0;
+  coms.addEnsuredPacket(3, [&made]() {
+    made++;
+    return std::shared_ptr<MockPacket>(new MockPacket(3, false));
+  });
+  coms.addEnsuredPacket(4, []() { return std::shared_ptr<NoopPacket>(new NoopPacket(4, false)); });
+
+  // Connecting only reserves the ids
+  assertReceiveSend(server, coms, {1, 0, 1, OPERATION_ADD_ENSURED_PACKETS}, {1, 0, 0, 1});
+  TEST_ASSERT_EQUAL_INT(0, made);
+  TEST_ASSERT_EQUAL_INT(2, coms.getAllPacketIDs().size());
+  TEST_ASSERT_TRUE(coms.getPacket(3) == nullptr);
+  assertReceiveSend(server,
+                    coms,
+                    {1, 1, 0, OPERATION_READ_UNUSED_PACKETS},
+                    {1, 1, 1, STATUS_ACCEPTED, 2, 0, 3, 0, 4, 0});
+
+  // The first frames make the packet once, even when they are read together
+  server->readsToSend.push({3, 0, 0, 7});
+  server->readsToSend.push({3, 0, 0, 8});
+  TEST_ASSERT_EQUAL_INT(1, coms.loop());
+  TEST_ASSERT_EQUAL_INT(1, made);
+  TEST_ASSERT_EQUAL_INT(2, server->writesReceived.size());
+  auto packet = std::static_pointer_cast<MockPacket>(coms.getPacket(3));
+  TEST_ASSERT_EQUAL_INT(2, packet->payloads.size());
+  TEST_ASSERT_EQUAL_UINT8(8, packet->payloads[1][0]);
+  server->writesReceived.pop();
+  server->writesReceived.pop();
+
+  assertReceiveSend(server, coms, {3, 0, 0, 9}, {3, 0, 0, 9});
+  TEST_ASSERT_EQUAL_INT(1, made);
+  assertReceiveSend(server,
+                    coms,
+                    {1, 0, 1, OPERATION_READ_UNUSED_PACKETS},
+                    {1, 0, 0, STATUS_ACCEPTED, 1, 0, 4, 0});
+}
+
+template <std::size_t N> void link_monitor() {
+  SETUP_BOWLER_COMS;
+
+  // Not enabled yet
+  server->readsToSend.push({1, 0, 1, OPERATION_HEARTBEAT});
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_REJECTED_GENERIC, server->writesReceived.front()[HEADER_LENGTH]);
+  server->writesReceived.pop();
+
+  LinkMonitor &link = coms.enableLinkMonitor(100000, 3);
+  int failsafes = 0;
+  link.addFailsafe([&failsafes]() { failsafes++; });
+
+  // The link is not up until the PC is heard from, so nothing can be lost before then
+  TEST_ASSERT_FALSE(link.check(getTime() + 1000000));
+  TEST_ASSERT_EQUAL_INT(0, failsafes);
+
+  server->readsToSend.push({1, 1, 0, OPERATION_HEARTBEAT});
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, server->writesReceived.front()[HEADER_LENGTH]);
+  server->writesReceived.pop();
+  TEST_ASSERT_TRUE(link.isLinkUp());
+
+  // Missing fewer than three beats is fine
+  const auto heard = getTime();
+  TEST_ASSERT_TRUE(link.check(heard + 250000));
+  TEST_ASSERT_EQUAL_INT(0, failsafes);
+
+  // The failsafes run once when the link is lost
+  TEST_ASSERT_FALSE(link.check(heard + 350000));
+  TEST_ASSERT_FALSE(link.check(heard + 400000));
+  TEST_ASSERT_EQUAL_INT(1, failsafes);
+  TEST_ASSERT_EQUAL_UINT32(1, link.getLossCount());
+  TEST_ASSERT_TRUE(link.getLastDetectionLatency() >= 350000);
+  TEST_ASSERT_TRUE(link.getLastDetectionLatency() < 400000);
+
+  // Any frame brings it back, and the heartbeat reports the loss
+  server->readsToSend.push({1, 0, 1, OPERATION_HEARTBEAT});
+  coms.loop();
+  TEST_ASSERT_TRUE(link.isLinkUp());
+  auto reply = server->writesReceived.front();
+  server->writesReceived.pop();
+  const std::uint8_t *payload = reply.data() + HEADER_LENGTH;
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, payload[0]);
+  TEST_ASSERT_EQUAL_UINT32(300000, readLittleEndian<std::uint32_t>(payload + 1));
+  TEST_ASSERT_EQUAL_UINT32(1, readLittleEndian<std::uint32_t>(payload + 5));
+  TEST_ASSERT_EQUAL_UINT32(link.getLastDetectionLatency(),
+                           readLittleEndian<std::uint32_t>(payload + 9));
+  TEST_ASSERT_EQUAL_UINT32(link.getMaxDetectionLatency(),
+                           readLittleEndian<std::uint32_t>(payload + 13));
+}
+
+template <std::size_t N> void compressed_frames() {
+  SETUP_BOWLER_COMS;
+  std::shared_ptr<MockPacket> packet(new MockPacket(2, false));
+  coms.addPacket(packet);
+  MAKE_PACKET(NoopPacket, 3, false);
+
+  // Codecs the device does not have are rejected
+  server->readsToSend.push({1, 0, 1, OPERATION_SET_COMPRESSION, 2, 0, 7});
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_REJECTED_GENERIC, server->writesReceived.front()[HEADER_LENGTH]);
+  server->writesReceived.pop();
+  assertReceiveSend(server,
+                    coms,
+                    {1, 1, 0, OPERATION_SET_COMPRESSION, 2, 0, COMPRESSION_CODEC_LZ},
+                    {1, 1, 1, STATUS_ACCEPTED, 2, 0, COMPRESSION_CODEC_LZ});
+  assertReceiveSend(server,
+                    coms,
+                    {1, 0, 1, OPERATION_SET_COMPRESSION, 3, 0, COMPRESSION_CODEC_LZ},
+                    {1, 0, 0, STATUS_ACCEPTED, 3, 0, COMPRESSION_CODEC_LZ});
+
+  // The PC's compressed frame is decompressed before the event
+  std::array<std::uint8_t, N - HEADER_LENGTH> payload{};
+  for (std::size_t i = 0; i < 16; i++) {
+    payload[i] = static_cast<std::uint8_t>(i % 4 + 1);
+  }
+  LzCodec codec;
+  std::array<std::uint8_t, N> frame{2, 0, HEADER_COMPRESSED_BIT};
+  const std::size_t compressedLength =
+    codec.compress(payload.data(), payload.size(), frame.data() + HEADER_LENGTH, N);
+  TEST_ASSERT_TRUE(compressedLength > 0 && compressedLength < 16);
+  server->readLengthsToSend.push(HEADER_LENGTH + compressedLength);
+  server->readsToSend.push(frame);
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(payload.data(), packet->payloads[0].data(), payload.size());
+
+  // The reply is compressed and shorter
+  auto reply = server->writesReceived.front();
+  server->writesReceived.pop();
+  TEST_ASSERT_EQUAL_UINT8(HEADER_COMPRESSED_BIT, reply[2]);
+  TEST_ASSERT_TRUE(server->writeLengths.back() < std::size_t(N));
+  std::array<std::uint8_t, N - HEADER_LENGTH> decompressed;
+  TEST_ASSERT_TRUE(LzCodec::decompress(reply.data() + HEADER_LENGTH,
+                                       server->writeLengths.back() - HEADER_LENGTH,
+                                       decompressed.data(),
+                                       decompressed.size()));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(payload.data(), decompressed.data(), payload.size());
+
+  // A reply which does not compress is sent as it is
+  std::array<std::uint8_t, N> noisy{3, 0, 0};
+  std::uint32_t state = 1;
+  for (std::size_t i = HEADER_LENGTH; i < N; i++) {
+    state = state * 1103515245 + 12345;
+    noisy[i] = static_cast<std::uint8_t>(state >> 16);
+  }
+  assertReceiveSend(server, coms, noisy, noisy);
+  TEST_ASSERT_EQUAL_INT(N, server->writeLengths.back());
+
+  // A malformed frame never reaches the event
+  server->readsToSend.push({2, 0, HEADER_COMPRESSED_BIT, 0x85, 0});
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(1, packet->payloads.size());
+  reply = server->writesReceived.front();
+  TEST_ASSERT_EQUAL_UINT8(HEADER_STATUS_BIT, reply[2] & HEADER_STATUS_BIT);
+}
+
+/**
+ * A Packet which reports a version number after the request and counts its events.
+ */
+class VersionPacket : public Packet {
+  public:
+  VersionPacket(std::uint16_t iid, bool iisReliable) : Packet(iid, iisReliable) {
+  }
+
+  std::int32_t event(std::uint8_t *payload) override {
+    eventCount++;
+    payload[1] = version;
+    if (isFailing) {
+      errno = EIO;
+      return BOWLER_ERROR;
+    }
+    return 1;
+  }
+
+  std::uint8_t version{7};
+  int eventCount{0};
+  bool isFailing{false};
+};
+
+template <std::size_t N> void reply_cache() {
+  SETUP_BOWLER_COMS;
+  coms.enableReplyCache(2);
+  std::shared_ptr<VersionPacket> packet(new VersionPacket(2, true));
+  packet->setIdempotent(true);
+  coms.addPacket(packet);
+
+  // A repeated request is answered from the cache, still following RDT
+  assertReceiveSend(server, coms, {2, 0, 0, 1}, {2, 0, 0, 1, 7});
+  assertReceiveSend(server, coms, {2, 1, 0, 1}, {2, 1, 1, 1, 7});
+  TEST_ASSERT_EQUAL_INT(1, packet->eventCount);
+  TEST_ASSERT_EQUAL_UINT32(1, coms.getReplyCacheHits());
+
+  // Other requests are cached separately
+  assertReceiveSend(server, coms, {2, 0, 1, 2}, {2, 0, 0, 2, 7});
+  TEST_ASSERT_EQUAL_INT(2, packet->eventCount);
+
+  // Cached replies last until they are invalidated
+  packet->version = 8;
+  assertReceiveSend(server, coms, {2, 1, 0, 1}, {2, 1, 1, 1, 7});
+  packet->invalidateCache();
+  assertReceiveSend(server, coms, {2, 0, 1, 1}, {2, 0, 0, 1, 8});
+  TEST_ASSERT_EQUAL_INT(3, packet->eventCount);
+
+  // Or until they expire
+  packet->setIdempotent(true, 1000);
+  packet->version = 9;
+  const auto start = getTime();
+  while (getTime() - start <= 1000) {
+  }
+  assertReceiveSend(server, coms, {2, 1, 0, 1}, {2, 1, 1, 1, 9});
+  TEST_ASSERT_EQUAL_INT(4, packet->eventCount);
+
+  // Failed events are not cached
+  packet->isFailing = true;
+  assertReceiveSend(server, coms, {2, 0, 1, 3}, {2, 0, 0, 3, 9});
+  packet->isFailing = false;
+  assertReceiveSend(server, coms, {2, 1, 0, 3}, {2, 1, 1, 3, 9});
+  TEST_ASSERT_EQUAL_INT(6, packet->eventCount);
+  TEST_ASSERT_EQUAL_UINT32(2, coms.getReplyCacheHits());
+
+  // Replies cached before the packet was removed are not used once it is added back
+  packet->setIdempotent(true);
+  packet->version = 10;
+  coms.addEnsuredPacket([packet]() { return packet; });
+  assertReceiveSend(server, coms, {1, 0, 1, OPERATION_DISCONNECT_ID}, {1, 0, 0, 1});
+  assertReceiveSend(server, coms, {1, 0, 1, OPERATION_ADD_ENSURED_PACKETS}, {1, 0, 0, 1});
+  assertReceiveSend(server, coms, {2, 0, 1, 3}, {2, 0, 0, 3, 10});
+  TEST_ASSERT_EQUAL_INT(7, packet->eventCount);
+}
+
+template <std::size_t N> void registry_heap_bounded() {
+  SETUP_BOWLER_COMS;
+  for (std::uint16_t id = 10; id < 210; id++) {
+    coms.addEnsuredPacket(
+      [id]() { return std::shared_ptr<NoopPacket>(new NoopPacket(id, false)); });
+  }
+
+  // Register from inside an event, where the coms are using a table: in one batch, then one at a
+  // time like a handler adding its own packets
+  std::size_t during = 0;
+  coms.addPacket(std::shared_ptr<CallbackPacket>(new CallbackPacket(2, [&]() {
+    TEST_ASSERT_EQUAL_INT(1, coms.addEnsuredPackets());
+    for (std::uint16_t id = 300; id < 350; id++) {
+      coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(id, false)));
+    }
+    for (std::uint16_t id = 300; id < 350; id++) {
+      coms.removePacket(id);
+    }
+    during = coms.getMemoryStats().heapBytes;
+  })));
+
+  server->readsToSend.push({2, 0, 0});
+  coms.loop();
+  server->writesReceived.pop();
+  TEST_ASSERT_EQUAL_INT(201, coms.getAllPacketIDs().size());
+
+  // Only the table the iteration dispatched from waited to be freed, not one per registration
+  const std::size_t after = coms.getMemoryStats().heapBytes;
+  TEST_ASSERT_TRUE(during > after);
+  TEST_ASSERT_TRUE(during - after < 8192);
+
+  // Disconnecting removes every packet at once
+  assertReceiveSend(server, coms, {1, 0, 1, OPERATION_DISCONNECT_ID}, {1, 0, 0, STATUS_ACCEPTED});
+  TEST_ASSERT_EQUAL_INT(0, coms.getAllPacketIDs().size());
+  TEST_ASSERT_TRUE(coms.getMemoryStats().heapBytes < after);
+}
+
+#if defined(PLATFORM_NATIVE)
+template <std::size_t N> void parallel_events() {
+  SETUP_BOWLER_COMS;
+  coms.setDrainLimit(8);
+  coms.setWorkerPool(std::unique_ptr<WorkerPool>(new ThreadWorkerPool(2)));
+  std::shared_ptr<MockPacket> reliable(new MockPacket(2, true));
+  std::shared_ptr<MockPacket> unreliable(new MockPacket(3, false));
+  coms.addPacket(reliable);
+  coms.addPacket(unreliable);
+
+  for (std::uint8_t i = 0; i < 10; i++) {
+    const std::uint8_t seqNum = i % 2;
+    server->readsToSend.push({2, seqNum, 0, i});
+    server->readsToSend.push({3, 0, 0, i});
+    coms.loop();
+  }
+
+  // Every frame was handled in order per packet, and every reply was written in order
+  TEST_ASSERT_EQUAL_INT(10, reliable->payloads.size());
+  TEST_ASSERT_EQUAL_INT(10, unreliable->payloads.size());
+  for (std::uint8_t i = 0; i < 10; i++) {
+    TEST_ASSERT_EQUAL_UINT8(i, reliable->payloads[i][0]);
+    TEST_ASSERT_EQUAL_UINT8(i, unreliable->payloads[i][0]);
+
+    const std::uint8_t seqNum = i % 2;
+    std::array<std::uint8_t, 4> expectedReliable{2, seqNum, seqNum, i};
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(
+      expectedReliable.data(), server->writesReceived.front().data(), expectedReliable.size());
+    server->writesReceived.pop();
+
+    std::array<std::uint8_t, 4> expectedUnreliable{3, 0, 0, i};
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(
+      expectedUnreliable.data(), server->writesReceived.front().data(), expectedUnreliable.size());
+    server->writesReceived.pop();
+  }
+}
+
+template <std::size_t N> void concurrent_registration() {
+  SETUP_BOWLER_COMS;
+  MAKE_PACKET(NoopPacket, 2, false);
+
+  // Hot-plug packets from another thread while the coms dispatch
+  std::atomic<bool> done{false};
+  std::thread writer([&]() {
+    for (int i = 0; i < 200; i++) {
+      coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(3, false)));
+      coms.removePacket(3);
+    }
+    coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(4, false)));
+    done = true;
+  });
+
+  std::size_t handled = 0;
+  while (!done) {
+    server->readsToSend.push({2, 0, 0, 1});
+    coms.loop();
+    handled++;
+  }
+  writer.join();
+
+  // Every frame for the packet which was always there got its reply
+  TEST_ASSERT_EQUAL_INT(handled, server->writesReceived.size());
+
+  // The packet added last is dispatched to on the next iteration
+  while (!server->writesReceived.empty()) {
+    server->writesReceived.pop();
+  }
+  assertReceiveSend(server, coms, {4, 0, 0, 1}, {4, 0, 0, 1});
+}
+
+template <std::size_t N> void shared_memory_server() {
+  const std::string name = "/bowler-test-" + std::to_string(getpid());
+  SharedMemoryServer<N> *server = new SharedMemoryServer<N>(name);
+  TEST_ASSERT_TRUE(server->isOpen());
+  DefaultBowlerComs<N> coms{std::unique_ptr<SharedMemoryServer<N>>(server)};
+  MAKE_PACKET(NoopPacket, 2, true);
+
+  // A second server cannot take over the channel, and giving up does not remove it
+  {
+    SharedMemoryServer<N> second(name);
+    TEST_ASSERT_FALSE(second.isOpen());
+  }
+
+  SharedMemoryClient<N> client(name);
+  TEST_ASSERT_TRUE(client.isOpen());
+
+  // Run the device on its own thread, sleeping between frames
+  std::atomic<bool> done{false};
+  std::thread device([&]() {
+    while (!done) {
+      if (server->waitForData(1000)) {
+        coms.loop();
+      }
+    }
+  });
+
+  std::array<std::uint8_t, N> replyFrame;
+  for (std::uint8_t i = 0; i < 100; i++) {
+    const std::uint8_t seqNum = i % 2;
+    std::array<std::uint8_t, N> frame{2, seqNum, 0, i};
+    TEST_ASSERT_EQUAL_INT(1, client.write(frame));
+    TEST_ASSERT_EQUAL_INT(1, client.read(replyFrame, 1000000));
+
+    std::array<std::uint8_t, N> expected{2, seqNum, seqNum, i};
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), replyFrame.data(), N);
+  }
+
+  done = true;
+  device.join();
+}
+
+template <std::size_t N> void serial_server_pty() {
+  // The device uses the pty like a UART and the test drives the other end as the host
+  const int hostFd = posix_openpt(O_RDWR | O_NOCTTY);
+  TEST_ASSERT_TRUE(hostFd >= 0);
+  TEST_ASSERT_EQUAL_INT(0, grantpt(hostFd));
+  TEST_ASSERT_EQUAL_INT(0, unlockpt(hostFd));
+  const int deviceFd = open(ptsname(hostFd), O_RDWR | O_NOCTTY);
+  TEST_ASSERT_TRUE(deviceFd >= 0);
+  termios attributes;
+  tcgetattr(deviceFd, &attributes);
+  cfmakeraw(&attributes);
+  tcsetattr(deviceFd, TCSANOW, &attributes);
+
+  FdSerialPort devicePort(deviceFd);
+  FdSerialPort hostPort(hostFd);
+  SerialServer<N, FdSerialPort> *server = new SerialServer<N, FdSerialPort>(devicePort);
+  DefaultBowlerComs<N> coms{std::unique_ptr<SerialServer<N, FdSerialPort>>(server)};
+  MAKE_PACKET(NoopPacket, 2, true);
+  SerialServer<N, FdSerialPort> host(hostPort);
+
+  for (std::uint8_t i = 0; i < 20; i++) {
+    const std::uint8_t seqNum = i % 2;
+    std::array<std::uint8_t, N> frame{2, seqNum, 0, i};
+    TEST_ASSERT_EQUAL_INT(1, host.write(frame));
+
+    bool available = false;
+    const auto start = getTime();
+    while (!available && getTime() - start < 1000000) {
+      coms.loop();
+      host.isDataAvailable(available);
+    }
+
+    std::array<std::uint8_t, N> replyFrame;
+    TEST_ASSERT_EQUAL_INT(1, host.read(replyFrame));
+    std::array<std::uint8_t, N> expected{2, seqNum, seqNum, i};
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), replyFrame.data(), N);
+  }
+
+  close(deviceFd);
+  close(hostFd);
+}
+
+template <std::size_t N> void lwip_udp_server() {
+  {
+    LwipUDPServer<N> *server = new LwipUDPServer<N>(BOWLER_SERVER_UDP_PORT);
+    DefaultBowlerComs<N> coms{std::unique_ptr<LwipUDPServer<N>>(server)};
+    MAKE_PACKET(NoopPacket, 2, true);
+
+    // The first iteration opens the pcb
+    TEST_ASSERT_EQUAL_INT(1, coms.loop());
+    udp_pcb *pcb = fake_udp_find(BOWLER_SERVER_UDP_PORT);
+    TEST_ASSERT_TRUE(pcb != nullptr);
+
+    // Each frame arrives as a chain of small pbufs and the reply goes back to the sender
+    const ip_addr_t pc{0x0100007F};
+    for (std::uint8_t i = 0; i < 4; i++) {
+      const std::uint8_t seqNum = i % 2;
+      std::array<std::uint8_t, N> frame{2, seqNum, 0, i};
+      TEST_ASSERT_TRUE(fake_udp_deliver(BOWLER_SERVER_UDP_PORT, frame.data(), N, pc, 5000, 20));
+      TEST_ASSERT_EQUAL_INT(1, coms.loop());
+
+      std::array<std::uint8_t, N> expected{2, seqNum, seqNum, i};
+      TEST_ASSERT_EQUAL_INT(i + 1, pcb->sent.size());
+      TEST_ASSERT_EQUAL_UINT16(5000, pcb->sent.back().port);
+      TEST_ASSERT_EQUAL_UINT32(pc.addr, pcb->sent.back().address.addr);
+      TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), pcb->sent.back().data.data(), N);
+    }
+
+    // Datagrams past the ring's capacity are dropped in the receive callback
+    std::array<std::uint8_t, N> frame{2, 0, 0};
+    for (std::uint32_t i = 0; i < LWIP_RX_RING_SLOTS + 2; i++) {
+      fake_udp_deliver(BOWLER_SERVER_UDP_PORT, frame.data(), N, pc, 5000, 64);
+    }
+    TEST_ASSERT_EQUAL_UINT32(2, server->getFramesDropped());
+    TEST_ASSERT_EQUAL_INT(LWIP_RX_RING_SLOTS, fake_pbuf_count());
+  }
+
+  // Destroying the server closed the pcb and freed the queued pbufs
+  TEST_ASSERT_TRUE(fake_udp_find(BOWLER_SERVER_UDP_PORT) == nullptr);
+  TEST_ASSERT_EQUAL_INT(0, fake_pbuf_count());
+}
+
+template <std::size_t N> void lwip_udp_two_senders() {
+  LwipUDPServer<N> *server = new LwipUDPServer<N>(BOWLER_SERVER_UDP_PORT);
+  DefaultBowlerComs<N> coms{std::unique_ptr<LwipUDPServer<N>>(server)};
+  coms.setDrainLimit(2);
+  MAKE_PACKET(NoopPacket, 2, false);
+  TEST_ASSERT_EQUAL_INT(1, coms.loop());
+  udp_pcb *pcb = fake_udp_find(BOWLER_SERVER_UDP_PORT);
+
+  // Both frames are read in one iteration and each reply goes back to its own sender
+  const ip_addr_t first{0x0100007F};
+  const ip_addr_t second{0x0200007F};
+  std::array<std::uint8_t, N> frame{2, 0, 0, 1};
+  fake_udp_deliver(BOWLER_SERVER_UDP_PORT, frame.data(), N, first, 5000, 64);
+  frame[3] = 2;
+  fake_udp_deliver(BOWLER_SERVER_UDP_PORT, frame.data(), N, second, 6000, 64);
+  TEST_ASSERT_EQUAL_INT(1, coms.loop());
+
+  TEST_ASSERT_EQUAL_INT(2, pcb->sent.size());
+  for (auto &&sent : pcb->sent) {
+    if (sent.data[3] == 1) {
+      TEST_ASSERT_EQUAL_UINT32(first.addr, sent.address.addr);
+      TEST_ASSERT_EQUAL_UINT16(5000, sent.port);
+    } else {
+      TEST_ASSERT_EQUAL_UINT8(2, sent.data[3]);
+      TEST_ASSERT_EQUAL_UINT32(second.addr, sent.address.addr);
+      TEST_ASSERT_EQUAL_UINT16(6000, sent.port);
+    }
+  }
+}
+
+/**
+ * A UDP socket on the loopback interface standing in for the PC.
+ */
+class UdpTestClient {
+  public:
+  UdpTestClient(std::uint16_t iserverPort) {
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.sin_port = htons(iserverPort);
+    timeval timeout{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
+
+  ~UdpTestClient() {
+    close(fd);
+  }
+
+  template <std::size_t N> void send(const std::array<std::uint8_t, N> &iframe) {
+    sendto(fd, iframe.data(), N, 0, reinterpret_cast<sockaddr *>(&server), sizeof(server));
+  }
+
+  template <std::size_t N> bool receive(std::array<std::uint8_t, N> &iframe) {
+    return recv(fd, iframe.data(), N, 0) == static_cast<ssize_t>(N);
+  }
+
+  private:
+  int fd;
+  sockaddr_in server{};
+};
+
+/**
+ * A Packet whose event puts a buffer of S bytes on the stack.
+ */
+template <std::size_t S> class DeepStackPacket : public Packet {
+  public:
+  DeepStackPacket(std::uint16_t iid) : Packet(iid, false) {
+  }
+
+  std::int32_t event(std::uint8_t *payload) override {
+    volatile std::uint8_t scratch[S];
+    for (std::size_t i = 0; i < sizeof(scratch); i++) {
+      scratch[i] = payload[i % DEFAULT_PAYLOAD_SIZE];
+    }
+    payload[0] = scratch[sizeof(scratch) - 1];
+    return 1;
+  }
+};
+
+template <std::size_t N> void memory_stats() {
+  SETUP_BOWLER_COMS;
+  MAKE_PACKET(DeepStackPacket<1024>, 2);
+  MAKE_PACKET(DeepStackPacket<2 * STACK_PROBE_LENGTH>, 3);
+
+  // The frame buffers are counted
+  const auto small = coms.getMemoryStats();
+  coms.setDrainLimit(8);
+  const auto large = coms.getMemoryStats();
+  TEST_ASSERT_TRUE(large.heapBytes - small.heapBytes >= 7 * N);
+  TEST_ASSERT_EQUAL_UINT32(0, large.stackPeak);
+
+  // Nothing is read when nothing was painted
+  StackProbe probe;
+  bool saturated = true;
+  TEST_ASSERT_EQUAL_UINT32(0, probe.measure(saturated));
+  TEST_ASSERT_FALSE(saturated);
+
+  // The event's scratch buffer fits in the probed area
+  coms.enableStackProbe(true);
+  server->readsToSend.push({2, 0, 0, 7});
+  coms.loop();
+  server->writesReceived.pop();
+  auto stats = coms.getMemoryStats();
+  TEST_ASSERT_TRUE(stats.stackPeak >= 1024);
+  TEST_ASSERT_TRUE(stats.stackPeak < STACK_PROBE_GUARD + STACK_PROBE_LENGTH);
+  TEST_ASSERT_EQUAL_UINT8(0, stats.flags);
+
+  // This one goes deeper than the probe looks, which is flagged rather than passed off as a depth
+  server->readsToSend.push({3, 0, 0, 7});
+  coms.loop();
+  server->writesReceived.pop();
+  stats = coms.getMemoryStats();
+  TEST_ASSERT_EQUAL_UINT32(STACK_PROBE_GUARD + STACK_PROBE_LENGTH, stats.stackPeak);
+  TEST_ASSERT_EQUAL_UINT8(MEMORY_STATS_STACK_SATURATED, stats.flags);
+
+  // Read and reset the peak, without the probe so the read itself is not measured
+  coms.enableStackProbe(false);
+  server->readsToSend.push({1, 0, 1, OPERATION_READ_MEMORY_STATS, 1});
+  coms.loop();
+  auto reply = server->writesReceived.front();
+  const std::uint8_t *payload = reply.data() + HEADER_LENGTH;
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, payload[0]);
+  TEST_ASSERT_EQUAL_UINT32(coms.getMemoryStats().heapBytes,
+                          readLittleEndian<std::uint32_t>(payload + 1));
+  TEST_ASSERT_EQUAL_UINT32(STACK_PROBE_GUARD + STACK_PROBE_LENGTH,
+                          readLittleEndian<std::uint32_t>(payload + 5));
+  TEST_ASSERT_EQUAL_UINT8(MEMORY_STATS_STACK_SATURATED, payload[1 + 20]);
+  TEST_ASSERT_EQUAL_UINT16(2, readLittleEndian<std::uint16_t>(payload + 1 + MEMORY_STATS_LENGTH));
+  stats = coms.getMemoryStats();
+  TEST_ASSERT_EQUAL_UINT32(0, stats.stackPeak);
+  TEST_ASSERT_EQUAL_UINT8(0, stats.flags);
+}
+
+template <std::size_t N> void udp_batching() {
+  NativeUDPServer<N> *server = new NativeUDPServer<N>(21866, 8);
+  TEST_ASSERT_TRUE(server->isOpen());
+  DefaultBowlerComs<N> coms{std::unique_ptr<NativeUDPServer<N>>(server)};
+  coms.setDrainLimit(8);
+  MAKE_PACKET(NoopPacket, 2, false);
+
+  // Two PCs whose frames are read in the same batch
+  UdpTestClient first(21866);
+  UdpTestClient second(21866);
+  for (std::uint8_t i = 0; i < 3; i++) {
+    first.send(std::array<std::uint8_t, N>{2, 0, 0, 1, i});
+    second.send(std::array<std::uint8_t, N>{2, 0, 0, 2, i});
+  }
+
+  const auto start = getTime();
+  while (server->getFramesReceived() < 6 && getTime() - start < 1000000) {
+    coms.loop();
+  }
+  TEST_ASSERT_EQUAL_INT(6, server->getFramesReceived());
+
+  // Every reply went back to the PC which sent the frame, in order
+  std::array<std::uint8_t, N> replyFrame;
+  for (std::uint8_t i = 0; i < 3; i++) {
+    TEST_ASSERT_TRUE(first.receive(replyFrame));
+    TEST_ASSERT_EQUAL_UINT8(1, replyFrame[3]);
+    TEST_ASSERT_EQUAL_UINT8(i, replyFrame[4]);
+    TEST_ASSERT_TRUE(second.receive(replyFrame));
+    TEST_ASSERT_EQUAL_UINT8(2, replyFrame[3]);
+    TEST_ASSERT_EQUAL_UINT8(i, replyFrame[4]);
+  }
+}
+
+template <std::size_t N> void device_farm() {
+  auto setupDevice = [](DefaultBowlerComs<N> &icoms) {
+    icoms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2, false)));
+  };
+
+  // No workers, or ports past 65535, are rejected
+  DeviceFarm<N> noWorkers(1, 21870, 0, setupDevice);
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, noWorkers.start());
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  DeviceFarm<N> tooManyPorts(2, 0xFFFF, 1, setupDevice);
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, tooManyPorts.start());
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+
+  // Each device answers on its own port
+  DeviceFarm<N> farm(2, 21870, 1, setupDevice);
+  TEST_ASSERT_EQUAL_INT(1, farm.start());
+  for (std::uint8_t i = 0; i < 2; i++) {
+    UdpTestClient client(21870 + i);
+    client.send(std::array<std::uint8_t, N>{2, 0, 0, i});
+    std::array<std::uint8_t, N> replyFrame;
+    TEST_ASSERT_TRUE(client.receive(replyFrame));
+    TEST_ASSERT_EQUAL_UINT8(i, replyFrame[3]);
+  }
+  farm.stop();
+  TEST_ASSERT_TRUE(farm.getFramesHandled(0) == 2);
+}
+
+/**
+ * Measures how fast LzCodec compresses and decompresses a payload and logs the results. A payload
+ * which does not compress is sent as is, so there is nothing to decompress and only the time
+ * spent finding that out is logged.
+ *
+ * @param iname The name of the payload to log.
+ * @param ipayload The payload.
+ * @param olength The compressed length, or `0` if it did not compress.
+ */
+static void measureCompression(const char *iname,
+                               const std::vector<std::uint8_t> &ipayload,
+                               std::size_t &olength) {
+  const int iterations = 20000;
+  LzCodec codec;
+  std::vector<std::uint8_t> compressed(ipayload.size());
+  std::vector<std::uint8_t> decompressed(ipayload.size());
+
+  olength = 0;
+  const auto compressStart = getTime();
+  for (int i = 0; i < iterations; i++) {
+    olength = codec.compress(ipayload.data(), ipayload.size(), compressed.data(), ipayload.size());
+  }
+  const auto compressTime = getTime() - compressStart;
+
+  const double megabytes = double(ipayload.size()) * iterations / 1e6;
+  if (olength == 0) {
+    BOWLER_LOG("%s: %zu bytes, not compressible, checked at %.1f MB/s\n",
+               iname,
+               ipayload.size(),
+               megabytes / (compressTime / 1e6));
+    return;
+  }
+
+  const auto decompressStart = getTime();
+  for (int i = 0; i < iterations; i++) {
+    LzCodec::decompress(compressed.data(), olength, decompressed.data(), decompressed.size());
+  }
+  const auto decompressTime = getTime() - decompressStart;
+
+  BOWLER_LOG("%s: %zu -> %zu bytes, compress %.1f MB/s, decompress %.1f MB/s\n",
+             iname,
+             ipayload.size(),
+             olength,
+             megabytes / (compressTime / 1e6),
+             megabytes / (decompressTime / 1e6));
+  TEST_ASSERT_TRUE(ipayload == decompressed);
+}
+
+template <std::size_t N> void benchmark_compression() {
+  // A row of a depth image: smooth 16 bit values with runs of no reading
+  std::vector<std::uint8_t> depthRow(1024);
+  for (std::size_t i = 0; i < depthRow.size() / 2; i++) {
+    const std::uint16_t depth = (i / 64) % 3 == 0 ? 0 : static_cast<std::uint16_t>(1500 + i / 8);
+    writeLittleEndian(depthRow.data() + 2 * i, depth);
+  }
+
+  // Log lines
+  std::vector<std::uint8_t> log;
+  for (int i = 0; log.size() < 1024; i++) {
+    char line[64];
+    const int length =
+      std::snprintf(line, sizeof(line), "[%06d] motor %d: pos=%d err=0\n", i, i % 4, 100 + i);
+    log.insert(log.end(), line, line + length);
+  }
+  log.resize(1024);
+
+  // A short status in a large frame
+  std::vector<std::uint8_t> padded(1024, 0);
+  padded[0] = STATUS_ACCEPTED;
+  padded[1] = 42;
+
+  std::vector<std::uint8_t> noise(1024);
+  std::uint32_t state = 1;
+  for (auto &&byte : noise) {
+    state = state * 1103515245 + 12345;
+    byte = static_cast<std::uint8_t>(state >> 16);
+  }
+
+  std::size_t length;
+  measureCompression("depth row", depthRow, length);
+  TEST_ASSERT_TRUE(length > 0 && length < depthRow.size() / 2);
+  measureCompression("log", log, length);
+  TEST_ASSERT_TRUE(length > 0 && length < log.size());
+  measureCompression("padded status", padded, length);
+  TEST_ASSERT_TRUE(length > 0 && length < 64);
+  measureCompression("noise", noise, length);
+  TEST_ASSERT_EQUAL_INT(0, length);
+}
+#endif
+
+int runTests() {
   UNITY_BEGIN();
   RUN_TEST(receive_seqnum_0<DEFAULT_PACKET_SIZE>);
   RUN_TEST(receive_seqnum_1<DEFAULT_PACKET_SIZE>);
@@ -213,8 +1669,56 @@ void setup() {
   RUN_TEST(add_ensured_packets<DEFAULT_PACKET_SIZE>);
   RUN_TEST(two_rdt_packets<DEFAULT_PACKET_SIZE>);
   RUN_TEST(disconnect_before_add_ensured_packets<DEFAULT_PACKET_SIZE>);
-  UNITY_END();
+  RUN_TEST(read_frame_trace<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(frame_trace_small<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(frame_trace_wraps<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(time_sync<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(loop_health<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(frame_timestamps<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(resume_session<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(reassemble_fragments<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(fragments_in_short_frames<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(wide_header_format<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(batch_unreliable_frames<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(priority_order<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(expired_frames<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(rate_limit<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(loop_budget<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(serial_framing<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(group_frames<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(frame_size_classes<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(register_map<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(scheduled_commands<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(lazy_ensured_packets<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(link_monitor<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(compressed_frames<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(reply_cache<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(registry_heap_bounded<DEFAULT_PACKET_SIZE>);
+#if defined(PLATFORM_NATIVE)
+  RUN_TEST(parallel_events<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(concurrent_registration<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(shared_memory_server<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(serial_server_pty<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(lwip_udp_server<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(lwip_udp_two_senders<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(memory_stats<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(udp_batching<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(device_farm<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(benchmark_compression<DEFAULT_PACKET_SIZE>);
+#endif
+  return UNITY_END();
+}
+
+#if defined(PLATFORM_NATIVE)
+int main() {
+  return runTests();
+}
+#else
+void setup() {
+  delay(2000);
+  runTests();
 }
 
 void loop() {
 }
+#endif